@@ -42,8 +42,10 @@ void fuzz_one(FILE* input_fp)
         switch (input_type)
         {
         case '1': {
-            float loadavg;
-            _get_load_average_proc_loadavg(input_fp, &loadavg);
+            char buffer[128];
+            size_t items = fread(buffer, 1, sizeof(buffer), input_fp);
+            proc_loadavg_values values;
+            _parse_proc_loadavg(buffer, items, &values);
             break;
         }
         case '2':
@@ -69,6 +71,58 @@ void fuzz_one(FILE* input_fp)
             _string_to_timespec(buffer, &result);
             break;
         }
+        case '6': {
+            struct timespec results[3];
+            char buffer[128];
+            size_t items = fread(buffer, 1, sizeof(buffer) - 1, input_fp);
+            buffer[items] = '\0';
+            _string_to_timespec_list(buffer, results, 3);
+            break;
+        }
+        case '7': {
+            char buffer[4096];
+            size_t items = fread(buffer, 1, sizeof(buffer), input_fp);
+            uint32_t running;
+            uint32_t blocked;
+            _parse_proc_stat_procs(buffer, items, &running, &blocked);
+            break;
+        }
+        case '8': {
+            char buffer[256];
+            size_t items = fread(buffer, 1, sizeof(buffer), input_fp);
+            loadavgwatch_load averages[3];
+            uint64_t total_us;
+            _parse_pressure_some(buffer, items, averages, &total_us);
+            break;
+        }
+        case '9': {
+            char buffer[64];
+            size_t items = fread(buffer, 1, sizeof(buffer), input_fp);
+            uint64_t quota_us;
+            uint64_t period_us;
+            _parse_cgroup_cpu_max(buffer, items, &quota_us, &period_us);
+            break;
+        }
+        case 'a': {
+            char buffer[512];
+            size_t items = fread(buffer, 1, sizeof(buffer), input_fp);
+            uint64_t usage_us;
+            uint64_t throttled_us;
+            _parse_cgroup_cpu_stat(buffer, items, &usage_us, &throttled_us);
+            break;
+        }
+        case 'b': {
+            char buffer[512];
+            size_t items = fread(buffer, 1, sizeof(buffer), input_fp);
+            char path[256];
+            if (_parse_proc_self_cgroup_v2(buffer, items, path, sizeof(path))
+                == LOADAVGWATCH_OK) {
+                // Walks through every parent of the path:
+                while (_cgroup_parent_dir(path, 0)) {
+                }
+            }
+            break;
+        }
     }
 }
 
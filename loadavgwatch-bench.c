@@ -0,0 +1,792 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Benchmarks for the code that runs on every poll and for the
+ * parsers and command execution around it.
+ *
+ * Each benchmark prints one JSON object per line:
+ *
+ * {"name": "poll_stub", "iterations": 100000, "ns_per_op": 41.2,
+ *  "io_syscalls_per_op": 0.00, "allocations_per_op": 0.00}
+ *
+ * io_syscalls_per_op counts read and write type system calls (syscr and
+ * syscw in /proc/self/io) that are the ones that the poll path makes.
+ * Other system calls, like the clone, exec and wait calls of the spawn
+ * benchmarks, are not counted.
+ * allocations_per_op counts malloc(), calloc() and realloc() calls and
+ * is null when the C library does not allow counting them.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include "loadavgwatch.h"
+#include "loadavgwatch-impl.h"
+#include "loadavgwatch-linux-parsers.c"
+#include "main-parsers.c"
+#include "main-process.c"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 100000
+// Spawning processes takes about 1000 times longer than the rest:
+#define SPAWN_ITERATIONS_DIVISOR 1000
+#define SYNTHETIC_CPUS 1024
+
+static volatile uint32_t g_sink;
+
+#ifdef __GLIBC__
+// glibc makes it possible to replace the allocator functions in the
+// executable and to call the real ones through these:
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void __libc_free(void* pointer);
+
+static size_t g_allocations;
+
+void* malloc(size_t size)
+{
+    ++g_allocations;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    ++g_allocations;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size)
+{
+    ++g_allocations;
+    return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer)
+{
+    __libc_free(pointer);
+}
+
+static bool allocation_count(size_t* out_count)
+{
+    *out_count = g_allocations;
+    return true;
+}
+#else
+static bool allocation_count(size_t* out_count)
+{
+    return false;
+}
+#endif // #ifdef __GLIBC__
+
+/**
+ * Reads the number of read and write type system calls that this
+ * process has made.
+ */
+static bool io_syscall_count(uint64_t* out_count)
+{
+    int io_fd = open("/proc/self/io", O_RDONLY);
+    if (io_fd == -1) {
+        return false;
+    }
+    char buffer[512];
+    ssize_t read_bytes = read(io_fd, buffer, sizeof(buffer) - 1);
+    close(io_fd);
+    if (read_bytes <= 0) {
+        return false;
+    }
+    buffer[read_bytes] = '\0';
+    unsigned long long read_calls;
+    unsigned long long write_calls;
+    const char* syscr = strstr(buffer, "syscr: ");
+    const char* syscw = strstr(buffer, "syscw: ");
+    if (syscr == NULL || syscw == NULL
+        || sscanf(syscr, "syscr: %llu", &read_calls) != 1
+        || sscanf(syscw, "syscw: %llu", &write_calls) != 1) {
+        return false;
+    }
+    *out_count = read_calls + write_calls;
+    return true;
+}
+
+typedef struct benchmark
+{
+    const char* name;
+    bool(*setup)(void** out_context);
+    bool(*run)(void* context);
+    void(*teardown)(void* context);
+    long iterations_divisor;
+} benchmark;
+
+static void log_ignore(const char* message, void* data)
+{
+}
+
+static bool setup_none(void** out_context)
+{
+    *out_context = NULL;
+    return true;
+}
+
+static void teardown_none(void* context)
+{
+}
+
+static bool setup_fd_loadavg(void** out_context)
+{
+    int* loadavg_fd = malloc(sizeof(int));
+    if (loadavg_fd == NULL) {
+        return false;
+    }
+    *loadavg_fd = open("/proc/loadavg", O_RDONLY);
+    if (*loadavg_fd == -1) {
+        free(loadavg_fd);
+        return false;
+    }
+    *out_context = loadavg_fd;
+    return true;
+}
+
+static void teardown_fd_loadavg(void* context)
+{
+    close(*(int*)context);
+    free(context);
+}
+
+static bool setup_fp_loadavg(void** out_context)
+{
+    FILE* loadavg_fp = fopen("/proc/loadavg", "r");
+    *out_context = loadavg_fp;
+    return loadavg_fp != NULL;
+}
+
+static void teardown_fp(void* context)
+{
+    fclose((FILE*)context);
+}
+
+/**
+ * The stdio based /proc/loadavg reader that was used before the
+ * pread() based one.
+ */
+static bool run_proc_loadavg_stdio(void* context)
+{
+    FILE* loadavg_fp = (FILE*)context;
+    fseek(loadavg_fp, 0, SEEK_SET);
+    fflush(loadavg_fp);
+    char read_buffer[128];
+    if (fgets(read_buffer, sizeof(read_buffer), loadavg_fp) == NULL) {
+        return false;
+    }
+    float loadavg;
+    if (sscanf(read_buffer, "%f", &loadavg) != 1) {
+        return false;
+    }
+    g_sink = (uint32_t)(loadavg * 100);
+    return true;
+}
+
+static bool run_proc_loadavg_pread(void* context)
+{
+    char read_buffer[128];
+    ssize_t read_bytes = pread(
+        *(int*)context, read_buffer, sizeof(read_buffer), 0);
+    if (read_bytes <= 0) {
+        return false;
+    }
+    proc_loadavg_values values;
+    if (_parse_proc_loadavg(read_buffer, read_bytes, &values) != LOADAVGWATCH_OK) {
+        return false;
+    }
+    g_sink = values.load[0].load;
+    return true;
+}
+
+static loadavgwatch_state* open_quiet_state(void)
+{
+    loadavgwatch_log_object log = {log_ignore, NULL};
+    loadavgwatch_state* state = NULL;
+    if (loadavgwatch_open_logging(&state, &log, &log) != LOADAVGWATCH_OK) {
+        return NULL;
+    }
+    return state;
+}
+
+static bool setup_poll_linux(void** out_context)
+{
+    loadavgwatch_state* state = open_quiet_state();
+    *out_context = state;
+    return state != NULL;
+}
+
+static loadavgwatch_status stub_get_load_average(
+    void* impl_state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
+{
+    out_snapshot->fields = LOADAVGWATCH_SNAPSHOT_LOAD;
+    out_snapshot->load[0] = (loadavgwatch_load){123, 100};
+    return LOADAVGWATCH_OK;
+}
+
+/**
+ * Polls through an injected load source to measure the overhead of
+ * the library itself.
+ */
+static bool setup_poll_stub(void** out_context)
+{
+    loadavgwatch_state* state = open_quiet_state();
+    if (state == NULL) {
+        return false;
+    }
+    state->impl.get_load_average = stub_get_load_average;
+    *out_context = state;
+    return true;
+}
+
+static bool run_poll(void* context)
+{
+    loadavgwatch_poll_result result;
+    if (loadavgwatch_poll((loadavgwatch_state*)context, &result)
+        != LOADAVGWATCH_OK) {
+        return false;
+    }
+    g_sink = result.start_count;
+    return true;
+}
+
+static void teardown_poll(void* context)
+{
+    loadavgwatch_state* state = (loadavgwatch_state*)context;
+    loadavgwatch_close(&state);
+}
+
+typedef struct memory_file
+{
+    char* contents;
+    FILE* fp;
+} memory_file;
+
+static bool open_memory_file(memory_file* file, size_t size)
+{
+    file->fp = fmemopen(file->contents, size, "r");
+    return file->fp != NULL;
+}
+
+/**
+ * Creates /proc/cpuinfo contents for 1024 CPUs with the lines that an
+ * x86 machine has for each CPU.
+ */
+static bool setup_cpuinfo(void** out_context)
+{
+    const size_t cpu_size = 256;
+    memory_file* file = malloc(sizeof(memory_file));
+    if (file == NULL) {
+        return false;
+    }
+    file->contents = malloc(SYNTHETIC_CPUS * cpu_size);
+    if (file->contents == NULL) {
+        free(file);
+        return false;
+    }
+    size_t size = 0;
+    for (int cpu = 0; cpu < SYNTHETIC_CPUS; ++cpu) {
+        size += snprintf(
+            file->contents + size,
+            cpu_size,
+            "processor\t: %d\n"
+            "vendor_id\t: GenuineIntel\n"
+            "model name\t: Intel(R) Xeon(R) CPU @ 2.20GHz\n"
+            "cpu MHz\t\t: 2200.000\n"
+            "physical id\t: %d\n"
+            "core id\t\t: %d\n"
+            "flags\t\t: fpu vme de pse tsc msr pae mce cx8 apic\n"
+            "\n",
+            cpu,
+            cpu / 64,
+            cpu % 64);
+    }
+    if (!open_memory_file(file, size)) {
+        free(file->contents);
+        free(file);
+        return false;
+    }
+    *out_context = file;
+    return true;
+}
+
+/**
+ * Creates /sys/devices/system/cpu/online contents where each of the
+ * 1024 CPUs is listed individually. This is the worst case for the
+ * parser.
+ */
+static bool setup_sys_devices(void** out_context)
+{
+    const size_t cpu_size = 8;
+    memory_file* file = malloc(sizeof(memory_file));
+    if (file == NULL) {
+        return false;
+    }
+    file->contents = malloc(SYNTHETIC_CPUS * cpu_size);
+    if (file->contents == NULL) {
+        free(file);
+        return false;
+    }
+    size_t size = 0;
+    for (int cpu = 0; cpu < SYNTHETIC_CPUS; ++cpu) {
+        size += snprintf(
+            file->contents + size,
+            cpu_size,
+            cpu + 1 < SYNTHETIC_CPUS ? "%d," : "%d\n",
+            cpu);
+    }
+    if (!open_memory_file(file, size)) {
+        free(file->contents);
+        free(file);
+        return false;
+    }
+    *out_context = file;
+    return true;
+}
+
+static void teardown_memory_file(void* context)
+{
+    memory_file* file = (memory_file*)context;
+    fclose(file->fp);
+    free(file->contents);
+    free(file);
+}
+
+static bool run_ncpus_proc_cpuinfo(void* context)
+{
+    memory_file* file = (memory_file*)context;
+    rewind(file->fp);
+    long ncpus = _get_ncpus_proc_cpuinfo(file->fp);
+    g_sink = (uint32_t)ncpus;
+    return ncpus == SYNTHETIC_CPUS;
+}
+
+static bool run_ncpus_sys_devices(void* context)
+{
+    memory_file* file = (memory_file*)context;
+    rewind(file->fp);
+    long ncpus = _get_ncpus_sys_devices(file->fp);
+    g_sink = (uint32_t)ncpus;
+    return ncpus == SYNTHETIC_CPUS;
+}
+
+static bool run_string_to_timespec(void* context)
+{
+    struct timespec value;
+    if (!_string_to_timespec("1d2h3m4.5s", &value)) {
+        return false;
+    }
+    g_sink = (uint32_t)value.tv_sec;
+    return true;
+}
+
+static bool run_timespec_to_string(void* context)
+{
+    const struct timespec value = {93784, 500000000};
+    char result[32];
+    _timespec_to_string(&value, result, sizeof(result));
+    g_sink = (uint32_t)result[0];
+    return result[0] != '\0';
+}
+
+static bool run_string_to_timespec_list(void* context)
+{
+    struct timespec values[3];
+    if (!_string_to_timespec_list("5s,15s,1m", values, 3)) {
+        return false;
+    }
+    g_sink = (uint32_t)values[2].tv_sec;
+    return true;
+}
+
+typedef struct memory_buffer
+{
+    char* contents;
+    size_t size;
+} memory_buffer;
+
+/**
+ * Creates /proc/stat contents for 1024 CPUs. procs_running and
+ * procs_blocked lines come after the per CPU lines, so the parser has
+ * to skip all of them.
+ */
+static bool setup_proc_stat(void** out_context)
+{
+    const size_t cpu_size = 64;
+    const size_t tail_size = 256;
+    memory_buffer* buffer = malloc(sizeof(memory_buffer));
+    if (buffer == NULL) {
+        return false;
+    }
+    buffer->contents = malloc((SYNTHETIC_CPUS + 1) * cpu_size + tail_size);
+    if (buffer->contents == NULL) {
+        free(buffer);
+        return false;
+    }
+    size_t size = snprintf(
+        buffer->contents,
+        cpu_size,
+        "cpu  126419 789 45678 98765432 1234 0 567 0 0 0\n");
+    for (int cpu = 0; cpu < SYNTHETIC_CPUS; ++cpu) {
+        size += snprintf(
+            buffer->contents + size,
+            cpu_size,
+            "cpu%d 123456 789 45678 98765432 1234 0 567 0 0 0\n",
+            cpu);
+    }
+    size += snprintf(
+        buffer->contents + size,
+        tail_size,
+        "intr 123456789 0 0\n"
+        "ctxt 987654321\n"
+        "btime 1500000000\n"
+        "processes 123456\n"
+        "procs_running 3\n"
+        "procs_blocked 1\n"
+        "softirq 12345 0 0\n");
+    buffer->size = size;
+    *out_context = buffer;
+    return true;
+}
+
+static void teardown_memory_buffer(void* context)
+{
+    memory_buffer* buffer = (memory_buffer*)context;
+    free(buffer->contents);
+    free(buffer);
+}
+
+static bool run_proc_stat_procs(void* context)
+{
+    const memory_buffer* buffer = (const memory_buffer*)context;
+    uint32_t running;
+    uint32_t blocked;
+    if (_parse_proc_stat_procs(
+            buffer->contents, buffer->size, &running, &blocked)
+        != LOADAVGWATCH_OK) {
+        return false;
+    }
+    g_sink = running + blocked;
+    return running == 3 && blocked == 1;
+}
+
+static bool run_pressure_some(void* context)
+{
+    static const char pressure[] =
+        "some avg10=1.23 avg60=0.45 avg300=0.06 total=123456789\n"
+        "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+    loadavgwatch_load averages[3];
+    uint64_t total_us;
+    if (_parse_pressure_some(
+            pressure, sizeof(pressure) - 1, averages, &total_us)
+        != LOADAVGWATCH_OK) {
+        return false;
+    }
+    g_sink = averages[0].load;
+    return total_us == 123456789;
+}
+
+static bool run_cgroup_cpu_stat(void* context)
+{
+    static const char cpu_stat[] =
+        "usage_usec 123456789\n"
+        "user_usec 100000000\n"
+        "system_usec 23456789\n"
+        "nr_periods 1000\n"
+        "nr_throttled 20\n"
+        "throttled_usec 500000\n";
+    uint64_t usage_us;
+    uint64_t throttled_us;
+    if (_parse_cgroup_cpu_stat(
+            cpu_stat, sizeof(cpu_stat) - 1, &usage_us, &throttled_us)
+        != LOADAVGWATCH_OK) {
+        return false;
+    }
+    g_sink = (uint32_t)throttled_us;
+    return usage_us == 123456789;
+}
+
+static bool run_cgroup_cpu_max(void* context)
+{
+    static const char cpu_max[] = "200000 100000\n";
+    uint64_t quota_us;
+    uint64_t period_us;
+    if (_parse_cgroup_cpu_max(
+            cpu_max, sizeof(cpu_max) - 1, &quota_us, &period_us)
+        != LOADAVGWATCH_OK) {
+        return false;
+    }
+    g_sink = (uint32_t)quota_us;
+    return period_us == 100000;
+}
+
+static bool run_proc_self_cgroup_v2(void* context)
+{
+    static const char self_cgroup[] =
+        "12:cpu,cpuacct:/docker/abc\n"
+        "0::/user.slice/user-1000.slice/session-1.scope\n";
+    char path[256];
+    if (_parse_proc_self_cgroup_v2(
+            self_cgroup, sizeof(self_cgroup) - 1, path, sizeof(path))
+        != LOADAVGWATCH_OK) {
+        return false;
+    }
+    uint32_t depth = 0;
+    while (_cgroup_parent_dir(path, 0)) {
+        ++depth;
+    }
+    g_sink = depth;
+    return depth == 3;
+}
+
+/**
+ * Runs the command with /bin/sh and waits for it to finish, the way
+ * that commands were run before they were started in the background.
+ *
+ * Returns false if a new process could not be created. Otherwise the
+ * wait status of the child is returned in out_wait_status.
+ */
+static bool run_sh_command_and_wait(const char* command, int* out_wait_status)
+{
+    pid_t child_pid;
+    if (!_spawn_sh_command(command, environ, &child_pid)) {
+        return false;
+    }
+    pid_t waited;
+    // If we get a signal while we're in waitpid() function, it will
+    // result in -1 return value.
+    do {
+        waited = waitpid(child_pid, out_wait_status, 0);
+    } while (waited == -1 && errno == EINTR);
+    return waited == child_pid;
+}
+
+static bool run_sh_command_spawn(void* context)
+{
+    int wait_status;
+    if (!run_sh_command_and_wait("exit 0", &wait_status)) {
+        return false;
+    }
+    return WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == EXIT_SUCCESS;
+}
+
+/**
+ * Makes the process use the given amount of resident memory, like a
+ * large program that uses the library would.
+ */
+static bool setup_rss(void** out_context, size_t megabytes)
+{
+    size_t size = megabytes << 20;
+    char* memory = malloc(size > 0 ? size : 1);
+    if (memory == NULL) {
+        return false;
+    }
+    memset(memory, 1, size);
+    *out_context = memory;
+    return true;
+}
+
+static bool setup_rss_0mb(void** out_context)
+{
+    return setup_rss(out_context, 0);
+}
+
+static bool setup_rss_1024mb(void** out_context)
+{
+    return setup_rss(out_context, 1024);
+}
+
+static void teardown_rss(void* context)
+{
+    free(context);
+}
+
+static bool wait_successful_child(pid_t child_pid)
+{
+    int wait_status;
+    if (waitpid(child_pid, &wait_status, 0) != child_pid) {
+        return false;
+    }
+    return WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == EXIT_SUCCESS;
+}
+
+/**
+ * fork() and exec based way of starting commands that was used before
+ * posix_spawn().
+ */
+static bool run_spawn_fork(void* context)
+{
+    pid_t child_pid = fork();
+    if (child_pid == -1) {
+        return false;
+    }
+    if (child_pid == 0) {
+        char* const child_args[] = {"true", NULL};
+        execvp("true", child_args);
+        // Same code as shells use for commands that are not found:
+        _exit(127);
+    }
+    return wait_successful_child(child_pid);
+}
+
+static bool run_spawn_posix(void* context)
+{
+    pid_t child_pid;
+    if (!_spawn_command("true", environ, &child_pid)) {
+        return false;
+    }
+    return wait_successful_child(child_pid);
+}
+
+static const benchmark BENCHMARKS[] = {
+    {"proc_loadavg_stdio", setup_fp_loadavg, run_proc_loadavg_stdio, teardown_fp, 1},
+    {"proc_loadavg_pread", setup_fd_loadavg, run_proc_loadavg_pread, teardown_fd_loadavg, 1},
+    {"poll_linux", setup_poll_linux, run_poll, teardown_poll, 1},
+    {"poll_stub", setup_poll_stub, run_poll, teardown_poll, 1},
+    {"ncpus_proc_cpuinfo_1024", setup_cpuinfo, run_ncpus_proc_cpuinfo, teardown_memory_file, 100},
+    {"ncpus_sys_devices_1024", setup_sys_devices, run_ncpus_sys_devices, teardown_memory_file, 100},
+    {"string_to_timespec", setup_none, run_string_to_timespec, teardown_none, 1},
+    {"string_to_timespec_list", setup_none, run_string_to_timespec_list, teardown_none, 1},
+    {"timespec_to_string", setup_none, run_timespec_to_string, teardown_none, 1},
+    {"proc_stat_procs_1024", setup_proc_stat, run_proc_stat_procs, teardown_memory_buffer, 100},
+    {"pressure_some", setup_none, run_pressure_some, teardown_none, 1},
+    {"cgroup_cpu_max", setup_none, run_cgroup_cpu_max, teardown_none, 1},
+    {"cgroup_cpu_stat", setup_none, run_cgroup_cpu_stat, teardown_none, 1},
+    {"proc_self_cgroup_v2", setup_none, run_proc_self_cgroup_v2, teardown_none, 1},
+    {"run_sh_command", setup_none, run_sh_command_spawn, teardown_none, SPAWN_ITERATIONS_DIVISOR},
+    {"spawn_fork_rss_0mb", setup_rss_0mb, run_spawn_fork, teardown_rss, SPAWN_ITERATIONS_DIVISOR},
+    {"spawn_fork_rss_1024mb", setup_rss_1024mb, run_spawn_fork, teardown_rss, SPAWN_ITERATIONS_DIVISOR},
+    {"spawn_posix_rss_0mb", setup_rss_0mb, run_spawn_posix, teardown_rss, SPAWN_ITERATIONS_DIVISOR},
+    {"spawn_posix_rss_1024mb", setup_rss_1024mb, run_spawn_posix, teardown_rss, SPAWN_ITERATIONS_DIVISOR},
+};
+
+static double elapsed_ns(const struct timespec* start, const struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static bool run_benchmark(
+    const benchmark* benchmark, long iterations, uint64_t syscall_overhead)
+{
+    void* context;
+    if (!benchmark->setup(&context)) {
+        fprintf(stderr, "Unable to set up %s!\n", benchmark->name);
+        return false;
+    }
+    // Warm up caches and lazily initialized state:
+    if (!benchmark->run(context)) {
+        fprintf(stderr, "%s failed!\n", benchmark->name);
+        benchmark->teardown(context);
+        return false;
+    }
+    uint64_t syscalls_start = 0;
+    bool has_syscalls = io_syscall_count(&syscalls_start);
+    size_t allocations_start = 0;
+    bool has_allocations = allocation_count(&allocations_start);
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; ++i) {
+        if (!benchmark->run(context)) {
+            fprintf(stderr, "%s failed!\n", benchmark->name);
+            benchmark->teardown(context);
+            return false;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    size_t allocations_end = 0;
+    allocation_count(&allocations_end);
+    uint64_t syscalls_end = 0;
+    has_syscalls = has_syscalls && io_syscall_count(&syscalls_end);
+    benchmark->teardown(context);
+
+    printf("{\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f",
+           benchmark->name,
+           iterations,
+           elapsed_ns(&start, &end) / iterations);
+    if (has_syscalls) {
+        printf(", \"io_syscalls_per_op\": %.2f",
+               (double)(syscalls_end - syscalls_start - syscall_overhead)
+               / iterations);
+    } else {
+        printf(", \"io_syscalls_per_op\": null");
+    }
+    if (has_allocations) {
+        printf(", \"allocations_per_op\": %.2f",
+               (double)(allocations_end - allocations_start) / iterations);
+    } else {
+        printf(", \"allocations_per_op\": null");
+    }
+    printf("}\n");
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    long iterations = DEFAULT_ITERATIONS;
+    const char* only_name = NULL;
+    if (argc > 1) {
+        iterations = strtol(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        only_name = argv[2];
+    }
+    if (iterations <= 0 || argc > 3) {
+        fprintf(stderr, "Usage: %s [iterations] [benchmark name]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Reading the counter is a system call itself:
+    uint64_t syscalls_first = 0;
+    uint64_t syscalls_second = 0;
+    uint64_t syscall_overhead = 0;
+    if (io_syscall_count(&syscalls_first) && io_syscall_count(&syscalls_second)) {
+        syscall_overhead = syscalls_second - syscalls_first;
+    }
+
+    int result = EXIT_SUCCESS;
+    for (size_t i = 0; i < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); ++i) {
+        const benchmark* benchmark = &BENCHMARKS[i];
+        if (only_name != NULL && strcmp(only_name, benchmark->name) != 0) {
+            continue;
+        }
+        long benchmark_iterations = iterations / benchmark->iterations_divisor;
+        if (benchmark_iterations < 1) {
+            benchmark_iterations = 1;
+        }
+        // Output is read by other programs while this is running:
+        if (!run_benchmark(benchmark, benchmark_iterations, syscall_overhead)) {
+            result = EXIT_FAILURE;
+        }
+        fflush(stdout);
+    }
+    return result;
+}
@@ -0,0 +1,161 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Exponentially weighted moving averages in fixed point.
+ *
+ * This works the same way as calc_load() in the Linux kernel, but
+ * decay factor is calculated from the actual time between samples
+ * instead of assuming a fixed 5 second sampling interval. This makes
+ * it possible to sample at any rate and with any time constants.
+ */
+
+#include "loadavgwatch.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Inputs and outputs have 16 fractional bits, the same as sysinfo()
+// uses:
+#define EWMA_SHIFT 16
+#define EWMA_FIXED_1 ((uint64_t)1 << EWMA_SHIFT)
+// Decay factors and the stored averages have 32 fractional bits.
+// Extra precision keeps rounding errors from accumulating when decay
+// per sample is very close to 1:
+#define EWMA_DECAY_1 ((uint64_t)1 << 32)
+#define EWMA_INTERNAL_SHIFT 32
+
+#define EWMA_AVERAGES 3
+
+typedef struct ewma_state
+{
+    uint64_t average[EWMA_AVERAGES];
+    uint64_t time_constant_ns[EWMA_AVERAGES];
+    struct timespec last_sample;
+    bool initialized;
+} ewma_state;
+
+/**
+ * Multiplies a value with a 32 bit fixed point fraction without
+ * overflowing the intermediate result. The result is rounded to the
+ * nearest value so that averages do not drift downwards over many
+ * samples.
+ */
+static uint64_t _ewma_mul_q32(uint64_t value, uint64_t fraction)
+{
+    return (value >> 32) * fraction
+        + (((value & 0xffffffffu) * fraction + 0x80000000u) >> 32);
+}
+
+/**
+ * Calculates e^(-numerator / denominator) with 32 fractional bits
+ * without using the math library.
+ *
+ * The exponent is halved until it is small enough for a short Taylor
+ * series and the result is then squared back.
+ */
+static uint64_t _ewma_exp_q32(uint64_t numerator, uint64_t denominator)
+{
+    if (numerator == 0) {
+        return EWMA_DECAY_1;
+    }
+    // e^-32 is smaller than the precision of the result:
+    if (denominator == 0 || numerator / denominator >= 32) {
+        return 0;
+    }
+    // Keep the remainder shifted by 32 bits from overflowing:
+    while (denominator >= ((uint64_t)1 << 31)) {
+        numerator >>= 1;
+        denominator >>= 1;
+    }
+    uint64_t x = ((numerator / denominator) << 32)
+        + ((numerator % denominator) << 32) / denominator;
+    int squarings = 0;
+    while (x > (EWMA_DECAY_1 >> 4)) {
+        x >>= 1;
+        ++squarings;
+    }
+    uint64_t term1 = x;
+    uint64_t term2 = _ewma_mul_q32(term1, x) / 2;
+    uint64_t term3 = _ewma_mul_q32(term2, x) / 3;
+    uint64_t term4 = _ewma_mul_q32(term3, x) / 4;
+    uint64_t result = (EWMA_DECAY_1 + term2 + term4) - (term1 + term3);
+    for (int i = 0; i < squarings; ++i) {
+        result = _ewma_mul_q32(result, result);
+    }
+    return result;
+}
+
+static uint64_t _ewma_timespec_ns(const struct timespec* value)
+{
+    return (uint64_t)value->tv_sec * 1000000000u + (uint64_t)value->tv_nsec;
+}
+
+static void _ewma_init(
+    ewma_state* out_ewma, const struct timespec time_constants[EWMA_AVERAGES])
+{
+    for (int i = 0; i < EWMA_AVERAGES; ++i) {
+        out_ewma->average[i] = 0;
+        out_ewma->time_constant_ns[i] = _ewma_timespec_ns(&time_constants[i]);
+    }
+    out_ewma->initialized = false;
+}
+
+/**
+ * Adds a new sample of active tasks to all averages.
+ *
+ * active is in fixed point with EWMA_SHIFT fractional bits. The first
+ * sample is used as the initial value of all averages.
+ */
+static void _ewma_sample(
+    ewma_state* ewma, const struct timespec* now, uint64_t active)
+{
+    uint64_t active_internal = active << (EWMA_INTERNAL_SHIFT - EWMA_SHIFT);
+    if (!ewma->initialized) {
+        for (int i = 0; i < EWMA_AVERAGES; ++i) {
+            ewma->average[i] = active_internal;
+        }
+        ewma->last_sample = *now;
+        ewma->initialized = true;
+        return;
+    }
+    uint64_t now_ns = _ewma_timespec_ns(now);
+    uint64_t last_ns = _ewma_timespec_ns(&ewma->last_sample);
+    if (now_ns <= last_ns) {
+        return;
+    }
+    uint64_t elapsed_ns = now_ns - last_ns;
+    for (int i = 0; i < EWMA_AVERAGES; ++i) {
+        uint64_t decay = _ewma_exp_q32(elapsed_ns, ewma->time_constant_ns[i]);
+        ewma->average[i] = _ewma_mul_q32(ewma->average[i], decay)
+            + _ewma_mul_q32(active_internal, EWMA_DECAY_1 - decay);
+    }
+    ewma->last_sample = *now;
+}
+
+static void _ewma_get(
+    const ewma_state* ewma, loadavgwatch_load out_loads[EWMA_AVERAGES])
+{
+    for (int i = 0; i < EWMA_AVERAGES; ++i) {
+        const int shift = EWMA_INTERNAL_SHIFT - EWMA_SHIFT;
+        uint64_t average = (ewma->average[i] + ((uint64_t)1 << (shift - 1)))
+            >> shift;
+        out_loads[i].load = average > UINT32_MAX ? UINT32_MAX : (uint32_t)average;
+        out_loads[i].scale = EWMA_FIXED_1;
+    }
+}
@@ -0,0 +1,192 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Fixed capacity ring buffer of polled metric values.
+ *
+ * Timestamps and values are kept in separate arrays so that window
+ * searches only touch timestamps and statistics only touch values.
+ * All memory is allocated when the capacity is set, so adding samples
+ * and querying them never allocates.
+ */
+
+#include "loadavgwatch-impl.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Values are stored in fixed point with this many fractional bits so
+// that samples with different scales can be compared and averaged:
+#define HISTORY_SHIFT 16
+
+static int64_t _history_timespec_ns(const struct timespec* value)
+{
+    return (int64_t)value->tv_sec * 1000000000 + value->tv_nsec;
+}
+
+/**
+ * Allocates timestamp, value and scratch arrays in one block.
+ */
+static bool _history_allocate(loadavgwatch_history* history, size_t capacity)
+{
+    void* memory = malloc(
+        capacity * (sizeof(int64_t) + 2 * sizeof(uint64_t)));
+    if (memory == NULL) {
+        return false;
+    }
+    history->time_ns = (int64_t*)memory;
+    history->value = (uint64_t*)(history->time_ns + capacity);
+    history->scratch = history->value + capacity;
+    history->capacity = capacity;
+    history->next = 0;
+    history->count = 0;
+    return true;
+}
+
+static void _history_free(loadavgwatch_history* history)
+{
+    free(history->time_ns);
+    memset(history, 0, sizeof(*history));
+}
+
+static void _history_clear(loadavgwatch_history* history)
+{
+    history->next = 0;
+    history->count = 0;
+}
+
+/**
+ * Returns the index of the sample that is age samples older than the
+ * newest one.
+ */
+static size_t _history_index(const loadavgwatch_history* history, size_t age)
+{
+    return (history->next + history->capacity - 1 - age) % history->capacity;
+}
+
+static uint64_t _history_from_load(const loadavgwatch_load* value)
+{
+    return ((uint64_t)value->load << HISTORY_SHIFT) / value->scale;
+}
+
+static void _history_add(
+    loadavgwatch_history* history,
+    const struct timespec* now,
+    const loadavgwatch_load* value)
+{
+    history->time_ns[history->next] = _history_timespec_ns(now);
+    history->value[history->next] = _history_from_load(value);
+    history->next = (history->next + 1) % history->capacity;
+    if (history->count < history->capacity) {
+        ++history->count;
+    }
+}
+
+/**
+ * Changes the capacity and keeps as many of the newest samples as
+ * fit into the new buffer.
+ */
+static bool _history_resize(loadavgwatch_history* history, size_t capacity)
+{
+    loadavgwatch_history resized;
+    if (!_history_allocate(&resized, capacity)) {
+        return false;
+    }
+    size_t kept = history->count < capacity ? history->count : capacity;
+    for (size_t age = kept; age > 0; --age) {
+        size_t index = _history_index(history, age - 1);
+        resized.time_ns[resized.next] = history->time_ns[index];
+        resized.value[resized.next] = history->value[index];
+        resized.next = (resized.next + 1) % capacity;
+    }
+    resized.count = kept;
+    _history_free(history);
+    *history = resized;
+    return true;
+}
+
+/**
+ * Counts the newest samples that are not older than the window.
+ * Samples are in time order, so the search can stop at the first one
+ * that is too old.
+ */
+static size_t _history_window_count(
+    const loadavgwatch_history* history,
+    const struct timespec* now,
+    const struct timespec* window)
+{
+    int64_t oldest_ns = _history_timespec_ns(now)
+        - _history_timespec_ns(window);
+    size_t count = 0;
+    while (count < history->count
+           && history->time_ns[_history_index(history, count)] >= oldest_ns) {
+        ++count;
+    }
+    return count;
+}
+
+static loadavgwatch_load _history_to_load(uint64_t value)
+{
+    return (loadavgwatch_load){
+        .load = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value,
+        .scale = 1 << HISTORY_SHIFT
+    };
+}
+
+/**
+ * Finds the k'th smallest value by partially sorting the values in
+ * place. This takes linear time on average.
+ */
+static uint64_t _history_select(uint64_t* values, size_t count, size_t k)
+{
+    size_t left = 0;
+    size_t right = count - 1;
+    while (left < right) {
+        uint64_t pivot = values[left + (right - left) / 2];
+        size_t i = left;
+        size_t j = right;
+        while (i <= j) {
+            while (values[i] < pivot) {
+                ++i;
+            }
+            while (values[j] > pivot) {
+                --j;
+            }
+            if (i <= j) {
+                uint64_t swap = values[i];
+                values[i] = values[j];
+                values[j] = swap;
+                ++i;
+                if (j == 0) {
+                    break;
+                }
+                --j;
+            }
+        }
+        if (k <= j) {
+            right = j;
+        } else if (k >= i) {
+            left = i;
+        } else {
+            break;
+        }
+    }
+    return values[k];
+}
@@ -25,6 +25,9 @@ extern "C" {
 
 #include "loadavgwatch.h"
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
@@ -40,12 +43,15 @@ static inline void PRINT_LOG_MESSAGE(
 }
 
 // Used for test related dependency injection:
-typedef int(*impl_clock)(struct timespec* now);
+typedef int(*impl_clock)(void* impl_state, struct timespec* now);
 typedef const char*(*impl_get_system)(void);
 typedef long(*impl_get_ncpus)(void);
 typedef loadavgwatch_status(*impl_open)(const loadavgwatch_state* state, void** out_impl_state);
 typedef loadavgwatch_status(*impl_close)(void* impl_state);
-typedef loadavgwatch_status(*impl_get_load_average)(void* impl_state, float* out_loadavg);
+typedef loadavgwatch_status(*impl_set_parameter)(const loadavgwatch_state* state, void* impl_state, const loadavgwatch_parameter* parameter);
+typedef loadavgwatch_status(*impl_get_load_average)(void* impl_state, const struct timespec* now, loadavgwatch_snapshot* out_snapshot);
+typedef int(*impl_get_event_fd)(const void* impl_state);
+typedef bool(*impl_get_update_interval)(const void* impl_state, struct timespec* out_interval);
 
 typedef struct loadavgwatch_callbacks {
     impl_clock clock;
@@ -53,16 +59,73 @@ typedef struct loadavgwatch_callbacks {
     impl_get_ncpus get_ncpus;
     impl_open open;
     impl_close close;
+    impl_set_parameter set_parameter;
     impl_get_load_average get_load_average;
+    impl_get_event_fd get_event_fd;
+    impl_get_update_interval get_update_interval;
 } loadavgwatch_callbacks;
 
-struct _loadavgwatch_state
+// Number of the most recent samples that the load trend is fitted to:
+#define LOADAVGWATCH_TREND_SAMPLES 8
+// 256 polls with the default 20 second poll interval cover over an
+// hour:
+#define LOADAVGWATCH_DEFAULT_HISTORY_CAPACITY 256
+
+/**
+ * Ring buffer of compared metric values from the latest polls. See
+ * loadavgwatch-history.c.
+ */
+typedef struct loadavgwatch_history
+{
+    int64_t* time_ns;
+    uint64_t* value;
+    // Work area for percentile queries:
+    uint64_t* scratch;
+    size_t capacity;
+    size_t next;
+    size_t count;
+} loadavgwatch_history;
+
+/**
+ * Estimated update phase of a load source that updates its values on a
+ * fixed cadence. See loadavgwatch-phase.c.
+ */
+typedef struct loadavgwatch_phase
 {
-    float start_load;
-    float stop_load;
+    // Interval that the source tells. Zero for sources that calculate
+    // their values on every read:
+    int64_t source_interval_ns;
+    // Estimate of the real interval and how much it can be off:
+    int64_t interval_ns;
+    int64_t uncertainty_ns;
+    // One update happened after update_after_ns and at the latest at
+    // update_before_ns:
+    bool has_update;
+    int64_t update_after_ns;
+    int64_t update_before_ns;
+    // Center of an earlier narrow window and the number of intervals
+    // from it to the current window:
+    bool has_anchor;
+    int64_t anchor_ns;
+    int64_t anchor_intervals;
+    bool has_read;
+    int64_t read_ns;
+    loadavgwatch_load read_load[3];
+} loadavgwatch_phase;
 
-    loadavgwatch_load start_load_fixed;
-    loadavgwatch_load stop_load_fixed;
+/**
+ * Shared memory segment that a state publishes its status in. See
+ * loadavgwatch-shm.c.
+ */
+typedef struct _loadavgwatch_shm loadavgwatch_shm;
+typedef struct _loadavgwatch_group loadavgwatch_group;
+
+struct _loadavgwatch_state
+{
+    long ncpus;
+    loadavgwatch_metric metric;
+    loadavgwatch_load start_load;
+    loadavgwatch_load stop_load;
 
     struct timespec last_start_time;
     struct timespec last_stop_time;
@@ -73,6 +136,20 @@ struct _loadavgwatch_state
     struct timespec quiet_period_over_stop;
     struct timespec start_interval;
     struct timespec stop_interval;
+    // Starts are limited by a token bucket that gains a token every
+    // start interval and holds up to start_burst tokens. The bucket
+    // has filled since this time:
+    uint32_t start_burst;
+    int64_t start_bucket_empty_ns;
+
+    struct timespec prediction_horizon;
+    loadavgwatch_history history;
+    loadavgwatch_phase phase;
+    bool has_polled;
+    bool last_poll_fresh;
+    loadavgwatch_snapshot last_polled;
+    loadavgwatch_shm* shm;
+    loadavgwatch_group* group;
 
     loadavgwatch_log_object log_info_obj;
     loadavgwatch_log_object* log_info;
@@ -92,8 +169,36 @@ long loadavgwatch_impl_get_ncpus(void);
 loadavgwatch_status loadavgwatch_impl_open(
     const loadavgwatch_state* state, void** out_impl_state);
 loadavgwatch_status loadavgwatch_impl_close(void* impl_state);
+loadavgwatch_status loadavgwatch_impl_set_parameter(
+    const loadavgwatch_state* state,
+    void* impl_state,
+    const loadavgwatch_parameter* parameter);
 loadavgwatch_status loadavgwatch_impl_get_load_average(
-    void* impl_state, float* out_loadavg);
+    void* impl_state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot);
+int loadavgwatch_impl_get_event_fd(const void* impl_state);
+bool loadavgwatch_impl_get_update_interval(
+    const void* impl_state, struct timespec* out_interval);
+
+/**
+ * Status updates happen between these calls. Readers retry while an
+ * update is in progress.
+ */
+loadavgwatch_shared_status* loadavgwatch_shm_begin_update(
+    loadavgwatch_shm* shm);
+void loadavgwatch_shm_end_update(loadavgwatch_shm* shm);
+void loadavgwatch_shm_close(loadavgwatch_shm** shm);
+
+/**
+ * Claims a start for the group if no member has started within the
+ * interval. Returns false if some member already has.
+ */
+bool loadavgwatch_group_claim_start(
+    loadavgwatch_group* group, int64_t now_ns, int64_t interval_ns);
+void loadavgwatch_group_register_start(
+    loadavgwatch_group* group, int64_t now_ns);
+void loadavgwatch_group_close(loadavgwatch_group** group);
 
 #ifdef __cplusplus
 }
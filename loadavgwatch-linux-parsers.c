@@ -21,25 +21,398 @@
 #endif // #define _XOPEN_SOURCE
 
 #include "loadavgwatch-impl.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static loadavgwatch_status _get_load_average_proc_loadavg(
-    FILE* loadavg_fp, float* out_loadavg)
+/**
+ * Values of all fields in /proc/loadavg.
+ *
+ * Load averages are in fixed point with the scale of 100 that matches
+ * the precision that the kernel uses when printing them out.
+ */
+typedef struct proc_loadavg_values
+{
+    loadavgwatch_load load[3];
+    uint32_t running_tasks;
+    uint32_t total_tasks;
+    uint32_t last_pid;
+} proc_loadavg_values;
+
+#define PROC_LOADAVG_SCALE 100
+
+/**
+ * Parses an unsigned decimal integer from the beginning of the buffer.
+ *
+ * Returns a pointer to the first unparsed character or NULL if there
+ * were no digits or if the value does not fit into 32 bits.
+ */
+static const char* _parse_uint32(
+    const char* position, const char* end, uint32_t* out_value)
+{
+    const char* digits_start = position;
+    uint64_t value = 0;
+    while (position < end && *position >= '0' && *position <= '9') {
+        value = value * 10 + (uint64_t)(*position - '0');
+        if (value > UINT32_MAX) {
+            return NULL;
+        }
+        ++position;
+    }
+    if (position == digits_start) {
+        return NULL;
+    }
+    *out_value = (uint32_t)value;
+    return position;
+}
+
+/**
+ * Parses an unsigned decimal integer the same way as _parse_uint32()
+ * does, but allows values up to 64 bits. Microsecond counters in
+ * cgroup and pressure files do not fit into 32 bits.
+ */
+static const char* _parse_uint64(
+    const char* position, const char* end, uint64_t* out_value)
+{
+    const char* digits_start = position;
+    uint64_t value = 0;
+    while (position < end && *position >= '0' && *position <= '9') {
+        uint64_t digit = (uint64_t)(*position - '0');
+        if (value > (UINT64_MAX - digit) / 10) {
+            return NULL;
+        }
+        value = value * 10 + digit;
+        ++position;
+    }
+    if (position == digits_start) {
+        return NULL;
+    }
+    *out_value = value;
+    return position;
+}
+
+/**
+ * Parses a decimal value like "12.34" directly to fixed point with
+ * scale of 100.
+ *
+ * Fractional digits after the second one are truncated.
+ */
+static const char* _parse_fixed_point_100(
+    const char* position, const char* end, loadavgwatch_load* out_value)
+{
+    uint32_t integer_part;
+    position = _parse_uint32(position, end, &integer_part);
+    if (position == NULL
+        || integer_part > (UINT32_MAX - (PROC_LOADAVG_SCALE - 1))
+        / PROC_LOADAVG_SCALE) {
+        return NULL;
+    }
+    uint32_t fraction = 0;
+    if (position < end && *position == '.') {
+        ++position;
+        const char* fraction_start = position;
+        uint32_t multiplier = PROC_LOADAVG_SCALE / 10;
+        while (position < end && *position >= '0' && *position <= '9') {
+            fraction += multiplier * (uint32_t)(*position - '0');
+            multiplier /= 10;
+            ++position;
+        }
+        if (position == fraction_start) {
+            return NULL;
+        }
+    }
+    out_value->load = integer_part * PROC_LOADAVG_SCALE + fraction;
+    out_value->scale = PROC_LOADAVG_SCALE;
+    return position;
+}
+
+static const char* _skip_spaces(const char* position, const char* end)
+{
+    while (position < end && (*position == ' ' || *position == '\t')) {
+        ++position;
+    }
+    return position;
+}
+
+/**
+ * Parses the contents of /proc/loadavg that has the following format:
+ *
+ * 0.01 0.02 0.03 4/567 8901
+ *
+ * This does not use stdio or locale dependent functions so that it
+ * can be called on every poll with a minimal overhead.
+ */
+static loadavgwatch_status _parse_proc_loadavg(
+    const char* buffer, size_t size, proc_loadavg_values* out_values)
+{
+    const char* position = buffer;
+    const char* end = buffer + size;
+    proc_loadavg_values values;
+    for (size_t i = 0; i < sizeof(values.load) / sizeof(values.load[0]); ++i) {
+        position = _skip_spaces(position, end);
+        position = _parse_fixed_point_100(position, end, &values.load[i]);
+        if (position == NULL) {
+            return LOADAVGWATCH_ERR_PARSE;
+        }
+    }
+    position = _skip_spaces(position, end);
+    position = _parse_uint32(position, end, &values.running_tasks);
+    if (position == NULL || position == end || *position != '/') {
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    position = _parse_uint32(position + 1, end, &values.total_tasks);
+    if (position == NULL) {
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    position = _skip_spaces(position, end);
+    position = _parse_uint32(position, end, &values.last_pid);
+    if (position == NULL) {
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    *out_values = values;
+    return LOADAVGWATCH_OK;
+}
+
+/**
+ * Finds procs_running and procs_blocked values from /proc/stat.
+ *
+ * procs_running includes the process that reads /proc/stat.
+ */
+static loadavgwatch_status _parse_proc_stat_procs(
+    const char* buffer,
+    size_t size,
+    uint32_t* out_running,
+    uint32_t* out_blocked)
+{
+    static const char running_key[] = "procs_running ";
+    static const char blocked_key[] = "procs_blocked ";
+    const char* end = buffer + size;
+    const char* line = buffer;
+    bool has_running = false;
+    bool has_blocked = false;
+    uint32_t running = 0;
+    uint32_t blocked = 0;
+    while (line < end && !(has_running && has_blocked)) {
+        const char* line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        size_t line_length = line_end - line;
+        if (line_length > sizeof(running_key) - 1
+            && memcmp(line, running_key, sizeof(running_key) - 1) == 0) {
+            if (_parse_uint32(
+                    line + sizeof(running_key) - 1, line_end, &running) == NULL) {
+                return LOADAVGWATCH_ERR_PARSE;
+            }
+            has_running = true;
+        } else if (line_length > sizeof(blocked_key) - 1
+                   && memcmp(line, blocked_key, sizeof(blocked_key) - 1) == 0) {
+            if (_parse_uint32(
+                    line + sizeof(blocked_key) - 1, line_end, &blocked) == NULL) {
+                return LOADAVGWATCH_ERR_PARSE;
+            }
+            has_blocked = true;
+        }
+        line = line_end + 1;
+    }
+    if (!(has_running && has_blocked)) {
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    *out_running = running;
+    *out_blocked = blocked;
+    return LOADAVGWATCH_OK;
+}
+
+/**
+ * Parses the "some" line of pressure stall information files like
+ * /proc/pressure/cpu that have the following format:
+ *
+ * some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ * full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ *
+ * Averages are percentages in fixed point with the scale of 100.
+ * Total is the cumulative stall time in microseconds.
+ */
+static loadavgwatch_status _parse_pressure_some(
+    const char* buffer,
+    size_t size,
+    loadavgwatch_load out_averages[3],
+    uint64_t* out_total_us)
+{
+    static const char some_key[] = "some";
+    static const char* average_keys[] = {"avg10=", "avg60=", "avg300="};
+    static const char total_key[] = "total=";
+    const char* end = buffer + size;
+    if (size < sizeof(some_key) - 1
+        || memcmp(buffer, some_key, sizeof(some_key) - 1) != 0) {
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    const char* position = buffer + sizeof(some_key) - 1;
+    loadavgwatch_load averages[3];
+    for (size_t i = 0; i < 3; ++i) {
+        position = _skip_spaces(position, end);
+        size_t key_length = strlen(average_keys[i]);
+        if ((size_t)(end - position) < key_length
+            || memcmp(position, average_keys[i], key_length) != 0) {
+            return LOADAVGWATCH_ERR_PARSE;
+        }
+        position = _parse_fixed_point_100(
+            position + key_length, end, &averages[i]);
+        if (position == NULL) {
+            return LOADAVGWATCH_ERR_PARSE;
+        }
+    }
+    position = _skip_spaces(position, end);
+    uint64_t total_us;
+    if ((size_t)(end - position) < sizeof(total_key) - 1
+        || memcmp(position, total_key, sizeof(total_key) - 1) != 0
+        || _parse_uint64(
+            position + sizeof(total_key) - 1, end, &total_us) == NULL) {
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    memcpy(out_averages, averages, sizeof(averages));
+    *out_total_us = total_us;
+    return LOADAVGWATCH_OK;
+}
+
+/**
+ * Parses cgroup v2 cpu.max file that has the CPU time quota and the
+ * period it applies to in microseconds:
+ *
+ * 150000 100000
+ *
+ * Quota is "max" for cgroups that are not limited. That is returned
+ * as zero quota.
+ */
+static loadavgwatch_status _parse_cgroup_cpu_max(
+    const char* buffer,
+    size_t size,
+    uint64_t* out_quota_us,
+    uint64_t* out_period_us)
+{
+    static const char unlimited[] = "max";
+    const char* end = buffer + size;
+    const char* position = buffer;
+    uint64_t quota_us = 0;
+    if (size >= sizeof(unlimited) - 1
+        && memcmp(buffer, unlimited, sizeof(unlimited) - 1) == 0) {
+        position += sizeof(unlimited) - 1;
+    } else {
+        position = _parse_uint64(position, end, &quota_us);
+        if (position == NULL) {
+            return LOADAVGWATCH_ERR_PARSE;
+        }
+    }
+    position = _skip_spaces(position, end);
+    uint64_t period_us;
+    if (_parse_uint64(position, end, &period_us) == NULL || period_us == 0) {
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    *out_quota_us = quota_us;
+    *out_period_us = period_us;
+    return LOADAVGWATCH_OK;
+}
+
+/**
+ * Finds usage_usec and throttled_usec values from cgroup v2 cpu.stat
+ * file. throttled_usec exists only when the cpu controller is enabled
+ * for the cgroup and it is zero otherwise.
+ */
+static loadavgwatch_status _parse_cgroup_cpu_stat(
+    const char* buffer,
+    size_t size,
+    uint64_t* out_usage_us,
+    uint64_t* out_throttled_us)
 {
-    char read_buffer[128];
-    char* line_buffer = fgets(read_buffer, sizeof(read_buffer), loadavg_fp);
-    if (line_buffer == NULL) {
-        return LOADAVGWATCH_ERR_READ;
+    static const char usage_key[] = "usage_usec ";
+    static const char throttled_key[] = "throttled_usec ";
+    const char* end = buffer + size;
+    const char* line = buffer;
+    bool has_usage = false;
+    uint64_t usage_us = 0;
+    uint64_t throttled_us = 0;
+    while (line < end) {
+        const char* line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        size_t line_length = line_end - line;
+        if (line_length > sizeof(usage_key) - 1
+            && memcmp(line, usage_key, sizeof(usage_key) - 1) == 0) {
+            if (_parse_uint64(
+                    line + sizeof(usage_key) - 1, line_end, &usage_us) == NULL) {
+                return LOADAVGWATCH_ERR_PARSE;
+            }
+            has_usage = true;
+        } else if (line_length > sizeof(throttled_key) - 1
+                   && memcmp(line, throttled_key, sizeof(throttled_key) - 1) == 0) {
+            if (_parse_uint64(
+                    line + sizeof(throttled_key) - 1,
+                    line_end,
+                    &throttled_us) == NULL) {
+                return LOADAVGWATCH_ERR_PARSE;
+            }
+        }
+        line = line_end + 1;
     }
-    int read_result = sscanf(read_buffer, "%f", out_loadavg);
-    if (read_result != 1) {
+    if (!has_usage) {
         return LOADAVGWATCH_ERR_PARSE;
     }
+    *out_usage_us = usage_us;
+    *out_throttled_us = throttled_us;
     return LOADAVGWATCH_OK;
 }
 
+/**
+ * Finds the cgroup v2 path of the process from /proc/self/cgroup.
+ * Unified hierarchy is on the line that has the hierarchy ID 0 and an
+ * empty controller list:
+ *
+ * 0::/system.slice/loadavgwatch.service
+ */
+static loadavgwatch_status _parse_proc_self_cgroup_v2(
+    const char* buffer, size_t size, char* out_path, size_t path_size)
+{
+    static const char unified_prefix[] = "0::";
+    const char* end = buffer + size;
+    const char* line = buffer;
+    while (line < end) {
+        const char* line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        size_t line_length = line_end - line;
+        size_t prefix_length = sizeof(unified_prefix) - 1;
+        if (line_length > prefix_length
+            && memcmp(line, unified_prefix, prefix_length) == 0) {
+            size_t path_length = line_length - prefix_length;
+            if (line[prefix_length] != '/' || path_length >= path_size) {
+                return LOADAVGWATCH_ERR_PARSE;
+            }
+            memcpy(out_path, line + prefix_length, path_length);
+            out_path[path_length] = '\0';
+            return LOADAVGWATCH_OK;
+        }
+        line = line_end + 1;
+    }
+    return LOADAVGWATCH_ERR_PARSE;
+}
+
+/**
+ * Moves a cgroup directory to its parent cgroup. Directory of the root
+ * cgroup, which has the given length, has no parent and returns false.
+ */
+static bool _cgroup_parent_dir(char* dir, size_t root_length)
+{
+    if (strlen(dir) <= root_length) {
+        return false;
+    }
+    *strrchr(dir, '/') = '\0';
+    return true;
+}
+
 static long _get_ncpus_proc_cpuinfo(FILE* cpuinfo_fp)
 {
     char line_buffer[1024] = {0};
@@ -16,12 +16,17 @@
  * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE 700
 
 #include "loadavgwatch-impl.h"
+#include "loadavgwatch-ewma.c"
 #include "loadavgwatch-linux-parsers.c"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 
@@ -29,26 +34,675 @@ typedef struct _state_linux state_linux;
 
 struct _state_linux
 {
-    FILE* loadavg_fp;
+    int loadavg_fd;
+    // /proc/stat can be tens of kilobytes on machines with many CPUs,
+    // so its read buffer is allocated once and grown only if the
+    // file does not fit into it:
+    int stat_fd;
+    char* stat_buffer;
+    size_t stat_buffer_size;
+    ewma_state stat_ewma;
+    // Pressure stall information file that has a trigger registered
+    // to it. Trigger keeps existing only as long as this stays open:
+    int pressure_fd;
+    bool has_pressure_trigger;
+    char psi_trigger[64];
+    // cgroup v2 files of the cgroup that this process belongs to.
+    // Load is calculated from the CPU time that the cgroup has used
+    // and waited for between polls:
+    int cgroup_stat_fd;
+    int cgroup_pressure_fd;
+    ewma_state cgroup_ewma;
+    struct timespec cgroup_last_sample;
+    uint64_t cgroup_last_usage_us;
+    uint64_t cgroup_last_stall_us;
     loadavgwatch_status(*get_load_average)(
-        state_linux* state, float* out_loadavg);
+        state_linux* state,
+        const struct timespec* now,
+        loadavgwatch_snapshot* out_snapshot);
 };
 
+/**
+ * Reads a file from the beginning with a single pread() call. Kernel
+ * regenerates /proc/ file contents on each read from offset 0, so
+ * there is no need to seek or to reopen the file.
+ */
+static ssize_t pread_from_start(int fd, char* buffer, size_t size)
+{
+    ssize_t read_bytes;
+    do {
+        read_bytes = pread(fd, buffer, size, 0);
+    } while (read_bytes == -1 && errno == EINTR);
+    return read_bytes;
+}
+
+static loadavgwatch_status read_proc_loadavg(
+    int loadavg_fd, proc_loadavg_values* out_values)
+{
+    char read_buffer[128];
+    ssize_t read_bytes = pread_from_start(
+        loadavg_fd, read_buffer, sizeof(read_buffer));
+    if (read_bytes <= 0) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    return _parse_proc_loadavg(read_buffer, (size_t)read_bytes, out_values);
+}
+
 static loadavgwatch_status get_load_average_proc_loadavg(
-    state_linux* state, float* out_loadavg)
+    state_linux* state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
 {
-    fseek(state->loadavg_fp, 0, SEEK_SET);
-    fflush(state->loadavg_fp);
-    return _get_load_average_proc_loadavg(state->loadavg_fp, out_loadavg);
+    proc_loadavg_values values;
+    loadavgwatch_status status = read_proc_loadavg(state->loadavg_fd, &values);
+    if (status != LOADAVGWATCH_OK) {
+        return status;
+    }
+    out_snapshot->fields = LOADAVGWATCH_SNAPSHOT_LOAD
+        | LOADAVGWATCH_SNAPSHOT_RUNNING_TASKS
+        | LOADAVGWATCH_SNAPSHOT_TOTAL_TASKS
+        | LOADAVGWATCH_SNAPSHOT_LAST_PID;
+    memcpy(out_snapshot->load, values.load, sizeof(out_snapshot->load));
+    out_snapshot->running_tasks = values.running_tasks;
+    out_snapshot->total_tasks = values.total_tasks;
+    out_snapshot->last_pid = values.last_pid;
+    return LOADAVGWATCH_OK;
 }
 
 static loadavgwatch_status get_load_average_sysinfo(
-    state_linux* state, float* out_loadavg)
+    state_linux* state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
 {
     struct sysinfo info;
     if (sysinfo(&info) != 0) {
         return LOADAVGWATCH_ERR_READ;
     }
+    // Load averages are in fixed point with SI_LOAD_SHIFT bits for
+    // the fractional part:
+    for (size_t i = 0; i < sizeof(info.loads) / sizeof(info.loads[0]); ++i) {
+        if (info.loads[i] > UINT32_MAX) {
+            return LOADAVGWATCH_ERR_PARSE;
+        }
+        out_snapshot->load[i].load = (uint32_t)info.loads[i];
+        out_snapshot->load[i].scale = 1 << SI_LOAD_SHIFT;
+    }
+    out_snapshot->total_tasks = info.procs;
+    out_snapshot->fields = LOADAVGWATCH_SNAPSHOT_LOAD
+        | LOADAVGWATCH_SNAPSHOT_TOTAL_TASKS;
+    return LOADAVGWATCH_OK;
+}
+
+/**
+ * Reads the whole /proc/stat into the state specific buffer. The
+ * buffer is grown when the file does not fit into it.
+ */
+static loadavgwatch_status read_proc_stat(state_linux* state, size_t* out_size)
+{
+    while (true) {
+        ssize_t read_bytes = pread_from_start(
+            state->stat_fd, state->stat_buffer, state->stat_buffer_size);
+        if (read_bytes <= 0) {
+            return LOADAVGWATCH_ERR_READ;
+        }
+        if ((size_t)read_bytes < state->stat_buffer_size) {
+            *out_size = (size_t)read_bytes;
+            return LOADAVGWATCH_OK;
+        }
+        size_t new_size = state->stat_buffer_size * 2;
+        char* new_buffer = realloc(state->stat_buffer, new_size);
+        if (new_buffer == NULL) {
+            return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+        }
+        state->stat_buffer = new_buffer;
+        state->stat_buffer_size = new_size;
+    }
+}
+
+/**
+ * Calculates load averages from the number of running and blocked
+ * tasks in /proc/stat.
+ *
+ * This approximates the tasks that the kernel counts to its load
+ * average: procs_blocked has only the tasks that wait for I/O, not
+ * all uninterruptible tasks. The tasks are sampled whenever the load
+ * average is polled instead of every 5 seconds. The process reading
+ * /proc/stat is not counted.
+ */
+static loadavgwatch_status get_load_average_proc_stat(
+    state_linux* state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
+{
+    size_t stat_size;
+    loadavgwatch_status read_status = read_proc_stat(state, &stat_size);
+    if (read_status != LOADAVGWATCH_OK) {
+        return read_status;
+    }
+    uint32_t running;
+    uint32_t blocked;
+    loadavgwatch_status parse_status = _parse_proc_stat_procs(
+        state->stat_buffer, stat_size, &running, &blocked);
+    if (parse_status != LOADAVGWATCH_OK) {
+        return parse_status;
+    }
+    uint64_t active = (uint64_t)(running > 0 ? running - 1 : 0) + blocked;
+    if (!state->stat_ewma.initialized && state->loadavg_fd != -1) {
+        // Start from the kernel's 1 minute load average instead of
+        // the momentary number of active tasks:
+        proc_loadavg_values values;
+        if (read_proc_loadavg(state->loadavg_fd, &values) == LOADAVGWATCH_OK) {
+            _ewma_sample(
+                &state->stat_ewma,
+                now,
+                (uint64_t)values.load[0].load * EWMA_FIXED_1
+                / values.load[0].scale);
+        }
+    }
+    _ewma_sample(&state->stat_ewma, now, active * EWMA_FIXED_1);
+    _ewma_get(&state->stat_ewma, out_snapshot->load);
+    out_snapshot->running_tasks = running;
+    out_snapshot->fields = LOADAVGWATCH_SNAPSHOT_LOAD
+        | LOADAVGWATCH_SNAPSHOT_RUNNING_TASKS;
+    return LOADAVGWATCH_OK;
+}
+
+/**
+ * Reads /proc/loadavg values and adds CPU pressure stall information
+ * to them.
+ */
+static loadavgwatch_status get_load_average_pressure(
+    state_linux* state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
+{
+    loadavgwatch_status loadavg_status = get_load_average_proc_loadavg(
+        state, now, out_snapshot);
+    if (loadavg_status != LOADAVGWATCH_OK) {
+        return loadavg_status;
+    }
+    char read_buffer[256];
+    ssize_t read_bytes = pread_from_start(
+        state->pressure_fd, read_buffer, sizeof(read_buffer));
+    if (read_bytes <= 0) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    uint64_t total_us;
+    loadavgwatch_status parse_status = _parse_pressure_some(
+        read_buffer, (size_t)read_bytes, out_snapshot->cpu_pressure, &total_us);
+    if (parse_status != LOADAVGWATCH_OK) {
+        return parse_status;
+    }
+    out_snapshot->fields |= LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE;
+    return LOADAVGWATCH_OK;
+}
+
+static void close_pressure(state_linux* impl_state)
+{
+    if (impl_state->pressure_fd != -1) {
+        close(impl_state->pressure_fd);
+    }
+    impl_state->pressure_fd = -1;
+    impl_state->has_pressure_trigger = false;
+}
+
+/**
+ * Opens a new /proc/pressure/cpu file descriptor and registers the
+ * trigger to it. Kernel signals POLLPRI on the file descriptor when
+ * the trigger threshold is exceeded. Returns -1 if the file can not be
+ * opened. out_trigger_errno is the reason why the trigger was not
+ * registered or 0 if it was.
+ */
+static int open_pressure_trigger(const char* trigger, int* out_trigger_errno)
+{
+    int pressure_fd = open("/proc/pressure/cpu", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (pressure_fd == -1) {
+        pressure_fd = open("/proc/pressure/cpu", O_RDONLY | O_CLOEXEC);
+    }
+    if (pressure_fd == -1) {
+        *out_trigger_errno = errno;
+        return -1;
+    }
+    // Kernel expects the terminating nul character to be part of the
+    // trigger:
+    size_t trigger_size = strlen(trigger) + 1;
+    ssize_t written = write(pressure_fd, trigger, trigger_size);
+    if (written == -1) {
+        *out_trigger_errno = errno;
+    } else if ((size_t)written != trigger_size) {
+        // Short writes do not set errno:
+        *out_trigger_errno = EIO;
+    } else {
+        *out_trigger_errno = 0;
+    }
+    return pressure_fd;
+}
+
+/**
+ * Opens /proc/pressure/cpu with the configured trigger. If the trigger
+ * can not be registered, for example due to missing privileges,
+ * pressure values can still be read from the file on every poll.
+ */
+static loadavgwatch_status open_pressure(
+    const loadavgwatch_state* state, state_linux* impl_state)
+{
+    int trigger_errno;
+    int pressure_fd = open_pressure_trigger(
+        impl_state->psi_trigger, &trigger_errno);
+    if (pressure_fd == -1) {
+        PRINT_LOG_MESSAGE(
+            state->log_warning,
+            "Unable to open /proc/pressure/cpu: %s",
+            strerror(trigger_errno));
+        return LOADAVGWATCH_ERR_INIT;
+    }
+    if (trigger_errno != 0) {
+        PRINT_LOG_MESSAGE(
+            state->log_warning,
+            "Unable to register pressure trigger '%s': %s",
+            impl_state->psi_trigger,
+            strerror(trigger_errno));
+    }
+    close_pressure(impl_state);
+    impl_state->pressure_fd = pressure_fd;
+    impl_state->has_pressure_trigger = trigger_errno == 0;
+    return LOADAVGWATCH_OK;
+}
+
+// Unified cgroup hierarchy is mounted on its own when the system still
+// uses cgroup v1 controllers:
+static const char* CGROUP_ROOTS[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"};
+
+/**
+ * Reads a small file at once. Returns the number of bytes read or -1
+ * on failure.
+ */
+static ssize_t read_small_file(const char* path, char* buffer, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t read_bytes = pread_from_start(fd, buffer, size);
+    close(fd);
+    return read_bytes;
+}
+
+/**
+ * Finds the directory of the cgroup v2 that this process belongs to.
+ * Inside a container with its own cgroup namespace this is the root
+ * of the cgroup file system.
+ */
+static bool find_cgroup_dir(
+    char* out_dir, size_t dir_size, size_t* out_root_length)
+{
+    char self_cgroup[4096];
+    ssize_t read_bytes = read_small_file(
+        "/proc/self/cgroup", self_cgroup, sizeof(self_cgroup));
+    if (read_bytes <= 0) {
+        return false;
+    }
+    const char* root = NULL;
+    for (size_t i = 0; i < sizeof(CGROUP_ROOTS) / sizeof(CGROUP_ROOTS[0]); ++i) {
+        char controllers_path[64];
+        snprintf(
+            controllers_path,
+            sizeof(controllers_path),
+            "%s/cgroup.controllers",
+            CGROUP_ROOTS[i]);
+        if (access(controllers_path, F_OK) == 0) {
+            root = CGROUP_ROOTS[i];
+            break;
+        }
+    }
+    if (root == NULL) {
+        return false;
+    }
+    const size_t root_length = strlen(root);
+    if (dir_size <= root_length) {
+        return false;
+    }
+    memcpy(out_dir, root, root_length);
+    if (_parse_proc_self_cgroup_v2(
+            self_cgroup,
+            (size_t)read_bytes,
+            out_dir + root_length,
+            dir_size - root_length) != LOADAVGWATCH_OK) {
+        return false;
+    }
+    // Path of the root cgroup is "/" and it should not end up as a
+    // trailing slash:
+    size_t dir_length = strlen(out_dir);
+    if (out_dir[dir_length - 1] == '/') {
+        out_dir[dir_length - 1] = '\0';
+    }
+    *out_root_length = root_length;
+    return true;
+}
+
+static loadavgwatch_status read_cgroup_cpu(
+    const state_linux* state,
+    uint64_t* out_usage_us,
+    uint64_t* out_stall_us,
+    loadavgwatch_load out_pressure[3])
+{
+    char read_buffer[512];
+    ssize_t read_bytes = pread_from_start(
+        state->cgroup_stat_fd, read_buffer, sizeof(read_buffer));
+    if (read_bytes <= 0) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    uint64_t throttled_us;
+    loadavgwatch_status stat_status = _parse_cgroup_cpu_stat(
+        read_buffer, (size_t)read_bytes, out_usage_us, &throttled_us);
+    if (stat_status != LOADAVGWATCH_OK) {
+        return stat_status;
+    }
+    *out_stall_us = throttled_us;
+    if (state->cgroup_pressure_fd == -1) {
+        return LOADAVGWATCH_OK;
+    }
+    read_bytes = pread_from_start(
+        state->cgroup_pressure_fd, read_buffer, sizeof(read_buffer));
+    if (read_bytes <= 0) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    uint64_t pressure_us;
+    loadavgwatch_status pressure_status = _parse_pressure_some(
+        read_buffer, (size_t)read_bytes, out_pressure, &pressure_us);
+    if (pressure_status != LOADAVGWATCH_OK) {
+        return pressure_status;
+    }
+    // Throttling is usually included in the pressure, but it depends
+    // on the kernel version. Take the larger one so that time spent
+    // throttled is not counted twice:
+    if (pressure_us > *out_stall_us) {
+        *out_stall_us = pressure_us;
+    }
+    return LOADAVGWATCH_OK;
+}
+
+/**
+ * Calculates load averages of the cgroup that this process belongs
+ * to.
+ *
+ * Number of active tasks is estimated from the CPU time that the
+ * cgroup used between polls and from the time that its tasks were
+ * stalled waiting for a CPU or throttled by the CPU quota. A cgroup
+ * that uses 2 CPUs fully and has tasks waiting all the time has a load
+ * of 3.
+ */
+static loadavgwatch_status get_load_average_cgroup(
+    state_linux* state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
+{
+    uint64_t usage_us;
+    uint64_t stall_us;
+    loadavgwatch_status read_status = read_cgroup_cpu(
+        state, &usage_us, &stall_us, out_snapshot->cpu_pressure);
+    if (read_status != LOADAVGWATCH_OK) {
+        return read_status;
+    }
+    uint64_t now_us = _ewma_timespec_ns(now) / 1000;
+    uint64_t last_us = _ewma_timespec_ns(&state->cgroup_last_sample) / 1000;
+    if (now_us > last_us
+        && usage_us >= state->cgroup_last_usage_us
+        && stall_us >= state->cgroup_last_stall_us) {
+        uint64_t busy_us = (usage_us - state->cgroup_last_usage_us)
+            + (stall_us - state->cgroup_last_stall_us);
+        uint64_t active = busy_us * EWMA_FIXED_1 / (now_us - last_us);
+        _ewma_sample(&state->cgroup_ewma, now, active);
+        state->cgroup_last_sample = *now;
+        state->cgroup_last_usage_us = usage_us;
+        state->cgroup_last_stall_us = stall_us;
+    }
+    _ewma_get(&state->cgroup_ewma, out_snapshot->load);
+    out_snapshot->fields = LOADAVGWATCH_SNAPSHOT_LOAD;
+    if (state->cgroup_pressure_fd != -1) {
+        out_snapshot->fields |= LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE;
+    }
+    return LOADAVGWATCH_OK;
+}
+
+static void close_cgroup(state_linux* impl_state)
+{
+    if (impl_state->cgroup_stat_fd != -1) {
+        close(impl_state->cgroup_stat_fd);
+    }
+    if (impl_state->cgroup_pressure_fd != -1) {
+        close(impl_state->cgroup_pressure_fd);
+    }
+    impl_state->cgroup_stat_fd = -1;
+    impl_state->cgroup_pressure_fd = -1;
+}
+
+/**
+ * Opens cpu.stat and cpu.pressure files of the cgroup and takes the
+ * first sample that the following polls are compared against.
+ */
+static loadavgwatch_status open_cgroup(
+    const loadavgwatch_state* state, state_linux* impl_state)
+{
+    if (impl_state->cgroup_stat_fd != -1) {
+        return LOADAVGWATCH_OK;
+    }
+    char cgroup_dir[PATH_MAX];
+    size_t root_length;
+    if (!find_cgroup_dir(cgroup_dir, sizeof(cgroup_dir), &root_length)) {
+        PRINT_LOG_MESSAGE(
+            state->log_error,
+            "Unable to find cgroup v2 of the process from /proc/self/cgroup!");
+        return LOADAVGWATCH_ERR_INIT;
+    }
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/cpu.stat", cgroup_dir);
+    impl_state->cgroup_stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (impl_state->cgroup_stat_fd == -1) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Unable to open %s for reading!", path);
+        return LOADAVGWATCH_ERR_INIT;
+    }
+    // Pressure stall information may be disabled in the kernel:
+    snprintf(path, sizeof(path), "%s/cpu.pressure", cgroup_dir);
+    impl_state->cgroup_pressure_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (impl_state->cgroup_pressure_fd == -1) {
+        PRINT_LOG_MESSAGE(
+            state->log_warning,
+            "Unable to open %s! Only CPU throttling is used to detect waiting.",
+            path);
+    }
+    loadavgwatch_load pressure[3];
+    loadavgwatch_status read_status = read_cgroup_cpu(
+        impl_state,
+        &impl_state->cgroup_last_usage_us,
+        &impl_state->cgroup_last_stall_us,
+        pressure);
+    if (read_status != LOADAVGWATCH_OK
+        || state->impl.clock(
+            state->impl_state, &impl_state->cgroup_last_sample) != 0) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Unable to read CPU usage of cgroup %s!", cgroup_dir);
+        close_cgroup(impl_state);
+        return LOADAVGWATCH_ERR_INIT;
+    }
+    return LOADAVGWATCH_OK;
+}
+
+static void close_proc_stat(state_linux* impl_state)
+{
+    if (impl_state->stat_fd != -1) {
+        close(impl_state->stat_fd);
+    }
+    free(impl_state->stat_buffer);
+    impl_state->stat_fd = -1;
+    impl_state->stat_buffer = NULL;
+    impl_state->stat_buffer_size = 0;
+}
+
+static loadavgwatch_status open_proc_stat(
+    const loadavgwatch_state* state, state_linux* impl_state)
+{
+    if (impl_state->stat_fd != -1) {
+        return LOADAVGWATCH_OK;
+    }
+    int stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+    if (stat_fd == -1) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Unable to open /proc/stat for reading!");
+        return LOADAVGWATCH_ERR_INIT;
+    }
+    const size_t initial_size = 16384;
+    char* stat_buffer = malloc(initial_size);
+    if (stat_buffer == NULL) {
+        close(stat_fd);
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    impl_state->stat_fd = stat_fd;
+    impl_state->stat_buffer = stat_buffer;
+    impl_state->stat_buffer_size = initial_size;
+    size_t stat_size;
+    loadavgwatch_status read_status = read_proc_stat(impl_state, &stat_size);
+    if (read_status != LOADAVGWATCH_OK) {
+        PRINT_LOG_MESSAGE(state->log_error, "Unable to read /proc/stat!");
+        close_proc_stat(impl_state);
+        return read_status;
+    }
+    uint32_t running;
+    uint32_t blocked;
+    loadavgwatch_status parse_status = _parse_proc_stat_procs(
+        impl_state->stat_buffer, stat_size, &running, &blocked);
+    if (parse_status != LOADAVGWATCH_OK) {
+        PRINT_LOG_MESSAGE(
+            state->log_error,
+            "Unable to find running and blocked processes from /proc/stat!");
+        close_proc_stat(impl_state);
+    }
+    return parse_status;
+}
+
+static loadavgwatch_status set_source(
+    const loadavgwatch_state* state,
+    state_linux* impl_state,
+    const char* source)
+{
+    if (strcmp(source, "loadavg") == 0) {
+        if (impl_state->loadavg_fd == -1) {
+            PRINT_LOG_MESSAGE(
+                state->log_error, "Unable to open /proc/loadavg for reading!");
+            return LOADAVGWATCH_ERR_INIT;
+        }
+        impl_state->get_load_average = get_load_average_proc_loadavg;
+        return LOADAVGWATCH_OK;
+    }
+    if (strcmp(source, "sysinfo") == 0) {
+        loadavgwatch_snapshot snapshot;
+        loadavgwatch_status sysinfo_result = get_load_average_sysinfo(
+            impl_state, NULL, &snapshot);
+        if (sysinfo_result != LOADAVGWATCH_OK) {
+            PRINT_LOG_MESSAGE(
+                state->log_error, "Unable to use sysinfo load average method!");
+            return sysinfo_result;
+        }
+        impl_state->get_load_average = get_load_average_sysinfo;
+        return LOADAVGWATCH_OK;
+    }
+    if (strcmp(source, "stat") == 0) {
+        loadavgwatch_status open_status = open_proc_stat(state, impl_state);
+        if (open_status != LOADAVGWATCH_OK) {
+            return open_status;
+        }
+        impl_state->get_load_average = get_load_average_proc_stat;
+        return LOADAVGWATCH_OK;
+    }
+    if (strcmp(source, "cgroup") == 0) {
+        loadavgwatch_status open_status = open_cgroup(state, impl_state);
+        if (open_status != LOADAVGWATCH_OK) {
+            return open_status;
+        }
+        impl_state->get_load_average = get_load_average_cgroup;
+        return LOADAVGWATCH_OK;
+    }
+    if (strcmp(source, "psi") == 0) {
+        if (impl_state->loadavg_fd == -1) {
+            PRINT_LOG_MESSAGE(
+                state->log_error, "Unable to open /proc/loadavg for reading!");
+            return LOADAVGWATCH_ERR_INIT;
+        }
+        if (open_pressure(state, impl_state) != LOADAVGWATCH_OK) {
+            PRINT_LOG_MESSAGE(
+                state->log_warning,
+                "Pressure stall information is not available! "
+                "Falling back on loadavg method.");
+            impl_state->get_load_average = get_load_average_proc_loadavg;
+            return LOADAVGWATCH_OK;
+        }
+        impl_state->get_load_average = get_load_average_pressure;
+        return LOADAVGWATCH_OK;
+    }
+    PRINT_LOG_MESSAGE(state->log_error, "Unknown load source '%s'!", source);
+    return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+}
+
+static loadavgwatch_status set_stat_time_constants(
+    const loadavgwatch_state* state,
+    state_linux* impl_state,
+    const struct timespec* time_constants)
+{
+    for (int i = 0; i < EWMA_AVERAGES; ++i) {
+        if (time_constants[i].tv_sec == 0 && time_constants[i].tv_nsec == 0) {
+            PRINT_LOG_MESSAGE(
+                state->log_error, "Time constants must be larger than zero!");
+            return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+        }
+        impl_state->stat_ewma.time_constant_ns[i] = _ewma_timespec_ns(
+            &time_constants[i]);
+        impl_state->cgroup_ewma.time_constant_ns[i] = _ewma_timespec_ns(
+            &time_constants[i]);
+    }
+    return LOADAVGWATCH_OK;
+}
+
+static loadavgwatch_status set_psi_trigger(
+    const loadavgwatch_state* state,
+    state_linux* impl_state,
+    const char* trigger)
+{
+    if (strlen(trigger) >= sizeof(impl_state->psi_trigger)) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Pressure trigger '%s' is too long!", trigger);
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    // The trigger is registered on a new file descriptor so that the
+    // current trigger keeps working if the kernel rejects the new one:
+    int trigger_errno;
+    int pressure_fd = open_pressure_trigger(trigger, &trigger_errno);
+    bool replacing = impl_state->pressure_fd != -1;
+    // Without a pressure file that is already open, only triggers that
+    // the kernel considers invalid are rejected here. Other problems
+    // are reported when the psi source opens the file:
+    if ((replacing && (pressure_fd == -1 || trigger_errno != 0))
+        || (pressure_fd != -1 && trigger_errno == EINVAL)) {
+        PRINT_LOG_MESSAGE(
+            state->log_error,
+            "Unable to register pressure trigger '%s': %s",
+            trigger,
+            strerror(trigger_errno));
+        if (pressure_fd != -1) {
+            close(pressure_fd);
+        }
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    strcpy(impl_state->psi_trigger, trigger);
+    if (!replacing) {
+        if (pressure_fd != -1) {
+            close(pressure_fd);
+        }
+        return LOADAVGWATCH_OK;
+    }
+    close_pressure(impl_state);
+    impl_state->pressure_fd = pressure_fd;
+    impl_state->has_pressure_trigger = true;
     return LOADAVGWATCH_OK;
 }
 
@@ -98,6 +752,50 @@ static long get_ncpus_sysconf(void)
     return -1;
 }
 
+/**
+ * Calculates the number of CPUs that the cgroup of this process can
+ * use. This is the smaller of the CPU time quota of the cgroup and
+ * all its ancestors, rounded up, and the number of CPUs in its
+ * effective CPU set.
+ */
+static long get_ncpus_cgroup(void)
+{
+    char cgroup_dir[PATH_MAX];
+    size_t root_length;
+    if (!find_cgroup_dir(cgroup_dir, sizeof(cgroup_dir), &root_length)) {
+        return -1;
+    }
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/cpuset.cpus.effective", cgroup_dir);
+    long ncpus = get_ncpus_sys_devices(path);
+
+    // Root cgroup of the host has no cpu.max, but the root of a cgroup
+    // namespace has the quota of the whole container:
+    do {
+        snprintf(path, sizeof(path), "%s/cpu.max", cgroup_dir);
+        char cpu_max[64];
+        ssize_t read_bytes = read_small_file(path, cpu_max, sizeof(cpu_max));
+        uint64_t quota_us;
+        uint64_t period_us;
+        if (read_bytes > 0
+            && _parse_cgroup_cpu_max(
+                cpu_max, (size_t)read_bytes, &quota_us, &period_us)
+            == LOADAVGWATCH_OK
+            && quota_us > 0) {
+            long quota_cpus = (long)((quota_us + period_us - 1) / period_us);
+            if (ncpus <= 0 || quota_cpus < ncpus) {
+                ncpus = quota_cpus;
+            }
+        }
+    } while (_cgroup_parent_dir(cgroup_dir, root_length));
+    return ncpus;
+}
+
+/**
+ * Returns the number of CPUs that this process can use. Containers
+ * see all CPUs of the host in /proc/ and /sys/, so the CPU limits of
+ * the cgroup reduce the number that is found from them.
+ */
 long loadavgwatch_impl_get_ncpus(void)
 {
     // It's possible that neither /proc/ nor /sys/ are fully
@@ -115,6 +813,10 @@ long loadavgwatch_impl_get_ncpus(void)
             ncpus = ncpus_list[i];
         }
     }
+    long ncpus_cgroup = get_ncpus_cgroup();
+    if (ncpus_cgroup > 0 && (ncpus <= 0 || ncpus_cgroup < ncpus)) {
+        ncpus = ncpus_cgroup;
+    }
     return ncpus;
 }
 
@@ -125,22 +827,35 @@ loadavgwatch_status loadavgwatch_impl_open(
     if (impl_state == NULL) {
         return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
     }
-    FILE* loadavg_fp = fopen("/proc/loadavg", "r");
-    if (loadavg_fp == NULL) {
+    impl_state->loadavg_fd = -1;
+    impl_state->stat_fd = -1;
+    impl_state->pressure_fd = -1;
+    impl_state->cgroup_stat_fd = -1;
+    impl_state->cgroup_pressure_fd = -1;
+    // 150 ms of CPU stall in a 1 second window:
+    strcpy(impl_state->psi_trigger, "some 150000 1000000");
+    // Time constants of the kernel's 1, 5 and 15 minute load averages:
+    const struct timespec default_time_constants[EWMA_AVERAGES] = {
+        {60, 0}, {5 * 60, 0}, {15 * 60, 0}
+    };
+    _ewma_init(&impl_state->stat_ewma, default_time_constants);
+    _ewma_init(&impl_state->cgroup_ewma, default_time_constants);
+    int loadavg_fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC);
+    if (loadavg_fd == -1) {
         PRINT_LOG_MESSAGE(
             state->log_warning,
             "Unable to open /proc/loadavg for reading! "
             "Falling back on sysinfo method.");
     } else {
-        impl_state->loadavg_fp = loadavg_fp;
+        impl_state->loadavg_fd = loadavg_fd;
         impl_state->get_load_average = get_load_average_proc_loadavg;
         *out_impl_state = impl_state;
         return LOADAVGWATCH_OK;
     }
 
-    float sysinfo_loadavg;
+    loadavgwatch_snapshot sysinfo_snapshot;
     loadavgwatch_status sysinfo_result = get_load_average_sysinfo(
-        impl_state, &sysinfo_loadavg);
+        impl_state, NULL, &sysinfo_snapshot);
     if (sysinfo_result != LOADAVGWATCH_OK) {
         PRINT_LOG_MESSAGE(
             state->log_error,
@@ -155,11 +870,47 @@ loadavgwatch_status loadavgwatch_impl_open(
     return sysinfo_result;
 }
 
+loadavgwatch_status loadavgwatch_impl_set_parameter(
+    const loadavgwatch_state* state,
+    void* impl_state,
+    const loadavgwatch_parameter* parameter)
+{
+    state_linux* linux_state = (state_linux*)impl_state;
+    if (strcmp(parameter->key, "source") == 0) {
+        return set_source(state, linux_state, (const char*)parameter->value);
+    }
+    if (strcmp(parameter->key, "stat-time-constants") == 0) {
+        return set_stat_time_constants(
+            state, linux_state, (const struct timespec*)parameter->value);
+    }
+    if (strcmp(parameter->key, "psi-trigger") == 0) {
+        return set_psi_trigger(
+            state, linux_state, (const char*)parameter->value);
+    }
+    PRINT_LOG_MESSAGE(
+        state->log_error,
+        "Unsupported load source parameter '%s'!",
+        parameter->key);
+    return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+}
+
 loadavgwatch_status loadavgwatch_impl_get_load_average(
-    void* impl_state, float* out_loadavg)
+    void* impl_state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
 {
     state_linux* state = (state_linux*)impl_state;
-    return state->get_load_average(state, out_loadavg);
+    return state->get_load_average(state, now, out_snapshot);
+}
+
+int loadavgwatch_impl_get_event_fd(const void* impl_state)
+{
+    const state_linux* state = (const state_linux*)impl_state;
+    if (state->get_load_average != get_load_average_pressure
+        || !state->has_pressure_trigger) {
+        return -1;
+    }
+    return state->pressure_fd;
 }
 
 loadavgwatch_status loadavgwatch_impl_close(void* impl_state)
@@ -168,14 +919,32 @@ loadavgwatch_status loadavgwatch_impl_close(void* impl_state)
         return LOADAVGWATCH_OK;
     }
     state_linux* state = (state_linux*)impl_state;
-    if (state->loadavg_fp != NULL) {
-        fclose(state->loadavg_fp);
+    if (state->loadavg_fd != -1) {
+        close(state->loadavg_fd);
     }
+    close_proc_stat(state);
+    close_pressure(state);
+    close_cgroup(state);
     memset(state, 0, sizeof(*state));
     free(state);
     return LOADAVGWATCH_OK;
 }
 
+bool loadavgwatch_impl_get_update_interval(
+    const void* impl_state, struct timespec* out_interval)
+{
+    const state_linux* state = (const state_linux*)impl_state;
+    if (state->get_load_average != get_load_average_proc_loadavg
+        && state->get_load_average != get_load_average_sysinfo) {
+        return false;
+    }
+    // Kernel updates load averages every LOAD_FREQ, which is 5 seconds
+    // and 1 tick. Ticks are 1 to 10 milliseconds depending on the
+    // kernel configuration, so this is in the middle:
+    *out_interval = (struct timespec){5, 5000000};
+    return true;
+}
+
 const char* loadavgwatch_impl_get_system(void)
 {
     return "linux";
@@ -0,0 +1,240 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Estimates when a load source that updates its values on a fixed
+ * cadence does its updates.
+ *
+ * Two reads that are less than one update interval apart tell whether
+ * an update happened between them. The window of one known update is
+ * projected to later updates and narrowed with each such pair of
+ * reads. Projected windows widen by the uncertainty of the interval,
+ * which shrinks as narrow windows far apart measure the real interval.
+ */
+
+#include "loadavgwatch-impl.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Real update interval can differ from the one that the source tells
+// by this much, for example because of different kernel tick lengths:
+#define PHASE_UNCERTAINTY_NS 5000000
+// Measured intervals are not trusted to be more exact than this:
+#define PHASE_MIN_UNCERTAINTY_NS 100000
+// Windows that are narrower than this are not probed:
+#define PHASE_PRECISION_NS 100000000
+// Aligned polls happen this long after the update window so that the
+// updated values are visible:
+#define PHASE_MARGIN_NS 1000000
+
+static void _phase_reset(loadavgwatch_phase* phase, int64_t interval_ns)
+{
+    memset(phase, 0, sizeof(*phase));
+    phase->source_interval_ns = interval_ns;
+    phase->interval_ns = interval_ns;
+    phase->uncertainty_ns = PHASE_UNCERTAINTY_NS;
+}
+
+/**
+ * Projects the known update window over the given number of update
+ * intervals.
+ */
+static void _phase_project(
+    const loadavgwatch_phase* phase,
+    int64_t intervals,
+    int64_t* out_after_ns,
+    int64_t* out_before_ns)
+{
+    *out_after_ns = phase->update_after_ns
+        + intervals * (phase->interval_ns - phase->uncertainty_ns);
+    *out_before_ns = phase->update_before_ns
+        + intervals * (phase->interval_ns + phase->uncertainty_ns);
+}
+
+/**
+ * Returns the number of update intervals from the known update to the
+ * update that is nearest to the given time.
+ */
+static int64_t _phase_nearest(const loadavgwatch_phase* phase, int64_t time_ns)
+{
+    int64_t center_ns = phase->update_after_ns
+        + (phase->update_before_ns - phase->update_after_ns) / 2;
+    if (time_ns <= center_ns) {
+        return 0;
+    }
+    return (time_ns - center_ns + phase->interval_ns / 2) / phase->interval_ns;
+}
+
+/**
+ * Replaces the known update window with a window that is the given
+ * number of intervals later. Narrow windows measure the interval.
+ */
+static void _phase_set_window(
+    loadavgwatch_phase* phase,
+    int64_t intervals,
+    int64_t after_ns,
+    int64_t before_ns)
+{
+    phase->update_after_ns = after_ns;
+    phase->update_before_ns = before_ns;
+    phase->anchor_intervals += intervals;
+    if (before_ns - after_ns > PHASE_PRECISION_NS) {
+        return;
+    }
+    int64_t center_ns = after_ns + (before_ns - after_ns) / 2;
+    if (!phase->has_anchor) {
+        phase->has_anchor = true;
+        phase->anchor_ns = center_ns;
+        phase->anchor_intervals = 0;
+        return;
+    }
+    if (phase->anchor_intervals == 0) {
+        return;
+    }
+    // Both centers are at most half of the precision off:
+    int64_t uncertainty_ns = PHASE_PRECISION_NS / phase->anchor_intervals;
+    if (uncertainty_ns >= phase->uncertainty_ns) {
+        return;
+    }
+    phase->interval_ns = (center_ns - phase->anchor_ns)
+        / phase->anchor_intervals;
+    phase->uncertainty_ns = uncertainty_ns < PHASE_MIN_UNCERTAINTY_NS
+        ? PHASE_MIN_UNCERTAINTY_NS : uncertainty_ns;
+}
+
+/**
+ * Registers a read of load values. Returns true if the values differ
+ * from the previous read.
+ */
+static bool _phase_observe(
+    loadavgwatch_phase* phase,
+    int64_t now_ns,
+    const loadavgwatch_load load[3])
+{
+    bool changed = !phase->has_read
+        || memcmp(phase->read_load, load, sizeof(phase->read_load)) != 0;
+    int64_t after_ns = phase->read_ns;
+    bool informative = phase->has_read
+        && now_ns - after_ns < phase->interval_ns;
+    phase->has_read = true;
+    phase->read_ns = now_ns;
+    memcpy(phase->read_load, load, sizeof(phase->read_load));
+    if (!informative) {
+        return changed;
+    }
+    if (!phase->has_update) {
+        if (changed) {
+            phase->has_update = true;
+            _phase_set_window(phase, 0, after_ns, now_ns);
+        }
+        return changed;
+    }
+    int64_t intervals = _phase_nearest(
+        phase, after_ns + (now_ns - after_ns) / 2);
+    int64_t window_after_ns;
+    int64_t window_before_ns;
+    _phase_project(phase, intervals, &window_after_ns, &window_before_ns);
+    if (changed) {
+        if (window_after_ns < after_ns) {
+            window_after_ns = after_ns;
+        }
+        if (window_before_ns > now_ns) {
+            window_before_ns = now_ns;
+        }
+        // Update outside of the window means that the estimate was
+        // wrong, so start over from this update:
+        if (window_after_ns >= window_before_ns) {
+            phase->interval_ns = phase->source_interval_ns;
+            phase->uncertainty_ns = PHASE_UNCERTAINTY_NS;
+            phase->has_anchor = false;
+            intervals = 0;
+            window_after_ns = after_ns;
+            window_before_ns = now_ns;
+        }
+    } else {
+        // Values that did not change can cut the window only from its
+        // ends. Unchanged values can also mean that the load did not
+        // change, so a window that would become empty is kept:
+        if (after_ns <= window_after_ns && now_ns > window_after_ns) {
+            window_after_ns = now_ns;
+        } else if (now_ns >= window_before_ns && after_ns < window_before_ns) {
+            window_before_ns = after_ns;
+        }
+        if (window_after_ns >= window_before_ns) {
+            return changed;
+        }
+    }
+    _phase_set_window(phase, intervals, window_after_ns, window_before_ns);
+    return changed;
+}
+
+/**
+ * Returns the time just after the update that is nearest to the given
+ * poll time and after the given previous poll.
+ */
+static int64_t _phase_align(
+    const loadavgwatch_phase* phase, int64_t poll_ns, int64_t previous_ns)
+{
+    int64_t intervals = _phase_nearest(phase, poll_ns);
+    int64_t window_after_ns;
+    int64_t window_before_ns;
+    do {
+        _phase_project(phase, intervals++, &window_after_ns, &window_before_ns);
+    } while (window_before_ns + PHASE_MARGIN_NS <= previous_ns);
+    return window_before_ns + PHASE_MARGIN_NS;
+}
+
+/**
+ * Finds the time of a read that narrows the window of the last update
+ * before the poll time. Without a known window the read is one update
+ * interval before the poll, so that the poll itself finds the first
+ * window. Returns false if the read would not help.
+ */
+static bool _phase_probe_time(
+    const loadavgwatch_phase* phase, int64_t poll_ns, int64_t* out_probe_ns)
+{
+    if (!phase->has_update) {
+        *out_probe_ns = poll_ns - phase->interval_ns + PHASE_PRECISION_NS;
+        return !phase->has_read || phase->read_ns < *out_probe_ns;
+    }
+    int64_t intervals = _phase_nearest(phase, poll_ns);
+    int64_t window_after_ns;
+    int64_t window_before_ns;
+    _phase_project(phase, intervals, &window_after_ns, &window_before_ns);
+    if (window_before_ns >= poll_ns && intervals > 0) {
+        _phase_project(
+            phase, intervals - 1, &window_after_ns, &window_before_ns);
+    }
+    if (window_before_ns >= poll_ns
+        || window_before_ns - window_after_ns <= PHASE_PRECISION_NS) {
+        return false;
+    }
+    // The first read starts a pair that halves the window:
+    if (phase->read_ns < window_after_ns) {
+        *out_probe_ns = window_after_ns;
+        return true;
+    }
+    int64_t middle_ns = window_after_ns
+        + (window_before_ns - window_after_ns) / 2;
+    if (phase->read_ns < middle_ns) {
+        *out_probe_ns = middle_ns;
+        return true;
+    }
+    return false;
+}
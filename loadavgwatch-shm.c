@@ -0,0 +1,415 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Status of a state in a POSIX shared memory object.
+ *
+ * The status is protected with a sequence lock. The publisher makes
+ * the sequence number odd for the duration of an update and readers
+ * copy the status until they get a copy that started and ended with
+ * the same even sequence number. Readers never write to the segment,
+ * so any number of them can read without slowing the publisher down.
+ *
+ * Groups of states share the time of their latest start in another
+ * object. Starts are claimed with a compare-and-swap on that time, so
+ * only one member of the group can decide to start within an interval
+ * even if all of them poll at the same moment.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "loadavgwatch.h"
+#include "loadavgwatch-impl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC "LAWSTATS"
+#define SHM_NAME_PREFIX "/loadavgwatch."
+#define SHM_GROUP_MAGIC "LAWGROUP"
+#define SHM_GROUP_NAME_PREFIX "/loadavgwatch-group."
+// Updates take well under a microsecond, so this many failed copies
+// mean that the publisher stopped in the middle of an update:
+#define SHM_READ_ATTEMPTS 10000
+
+typedef struct shm_segment
+{
+    char magic[8];
+    uint32_t status_size;
+    // Odd while the status is being updated:
+    uint32_t sequence;
+    loadavgwatch_shared_status status;
+} shm_segment;
+
+struct _loadavgwatch_shm
+{
+    shm_segment* segment;
+    char* name;
+    // Holds the lock that keeps other publishers away:
+    int fd;
+};
+
+typedef struct shm_group_segment
+{
+    char magic[8];
+    // Monotonic time of the latest start of any member:
+    int64_t last_start_time_ns;
+} shm_group_segment;
+
+struct _loadavgwatch_group
+{
+    shm_group_segment* segment;
+};
+
+struct _loadavgwatch_status_reader
+{
+    const shm_segment* segment;
+};
+
+/**
+ * Builds the shared memory object name. Names can not contain slashes.
+ */
+static char* shm_prefixed_name(const char* prefix, const char* name)
+{
+    if (name == NULL || *name == '\0' || strchr(name, '/') != NULL) {
+        return NULL;
+    }
+    size_t size = strlen(prefix) + strlen(name) + 1;
+    char* object_name = malloc(size);
+    if (object_name != NULL) {
+        snprintf(object_name, size, "%s%s", prefix, name);
+    }
+    return object_name;
+}
+
+static char* shm_object_name(const char* name)
+{
+    return shm_prefixed_name(SHM_NAME_PREFIX, name);
+}
+
+loadavgwatch_shared_status* loadavgwatch_shm_begin_update(
+    loadavgwatch_shm* shm)
+{
+    shm_segment* segment = shm->segment;
+    __atomic_store_n(
+        &segment->sequence, segment->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return &segment->status;
+}
+
+void loadavgwatch_shm_end_update(loadavgwatch_shm* shm)
+{
+    shm_segment* segment = shm->segment;
+    __atomic_store_n(
+        &segment->sequence, segment->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void loadavgwatch_shm_close(loadavgwatch_shm** shm)
+{
+    if (*shm == NULL) {
+        return;
+    }
+    // Object is removed before the lock is released, so a new
+    // publisher never gets the object that is being removed:
+    shm_unlink((*shm)->name);
+    close((*shm)->fd);
+    munmap((*shm)->segment, sizeof(shm_segment));
+    free((*shm)->name);
+    free(*shm);
+    *shm = NULL;
+}
+
+loadavgwatch_status loadavgwatch_share_status(
+    loadavgwatch_state* state, const char* name)
+{
+    if (state->shm != NULL) {
+        PRINT_LOG_MESSAGE(state->log_error, "Status is already shared!");
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    char* object_name = shm_object_name(name);
+    if (object_name == NULL) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Invalid shared status name '%s'!", name);
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    loadavgwatch_shm* shm = calloc(1, sizeof(loadavgwatch_shm));
+    if (shm == NULL) {
+        free(object_name);
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    shm->name = object_name;
+    // Segment of an earlier publisher with the same name is reused so
+    // that its readers see the new status. Two publishers would break
+    // the sequence lock, so a publisher that is still running keeps
+    // the segment to itself with a lock. Systems that can not lock
+    // shared memory objects do without:
+    int fd = shm_open(object_name, O_RDWR | O_CREAT, 0644);
+    if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) != 0
+        && errno == EWOULDBLOCK) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Shared status name '%s' is in use!", name);
+        close(fd);
+        free(object_name);
+        free(shm);
+        return LOADAVGWATCH_ERR_INIT;
+    }
+    if (fd != -1) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    void* mapping = MAP_FAILED;
+    if (fd != -1 && ftruncate(fd, sizeof(shm_segment)) == 0) {
+        mapping = mmap(
+            NULL,
+            sizeof(shm_segment),
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED,
+            fd,
+            0);
+    }
+    if (mapping == MAP_FAILED) {
+        PRINT_LOG_MESSAGE(
+            state->log_error,
+            "Unable to create shared status '%s': %s",
+            object_name,
+            strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        free(object_name);
+        free(shm);
+        return LOADAVGWATCH_ERR_INIT;
+    }
+    shm->segment = mapping;
+    shm->fd = fd;
+    // Earlier publisher may have stopped in the middle of an update:
+    shm->segment->sequence &= ~(uint32_t)1;
+    loadavgwatch_shared_status* status = loadavgwatch_shm_begin_update(shm);
+    memset(status, 0, sizeof(*status));
+    status->version = LOADAVGWATCH_SHARED_STATUS_VERSION;
+    status->metric = state->metric;
+    status->start_load = state->start_load;
+    status->stop_load = state->stop_load;
+    memcpy(shm->segment->magic, SHM_MAGIC, sizeof(shm->segment->magic));
+    shm->segment->status_size = sizeof(loadavgwatch_shared_status);
+    loadavgwatch_shm_end_update(shm);
+    state->shm = shm;
+    return LOADAVGWATCH_OK;
+}
+
+loadavgwatch_status loadavgwatch_status_reader_open(
+    const char* name, loadavgwatch_status_reader** out_reader)
+{
+    char* object_name = shm_object_name(name);
+    if (object_name == NULL) {
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    int fd = shm_open(object_name, O_RDONLY, 0);
+    free(object_name);
+    if (fd == -1) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    struct stat object_stat;
+    if (fstat(fd, &object_stat) != 0) {
+        close(fd);
+        return LOADAVGWATCH_ERR_READ;
+    }
+    if (object_stat.st_size < (off_t)sizeof(shm_segment)) {
+        close(fd);
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    void* mapping = mmap(
+        NULL, sizeof(shm_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    const shm_segment* segment = mapping;
+    if (memcmp(segment->magic, SHM_MAGIC, sizeof(segment->magic)) != 0
+        || segment->status_size != sizeof(loadavgwatch_shared_status)) {
+        munmap(mapping, sizeof(shm_segment));
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    loadavgwatch_status_reader* reader = malloc(
+        sizeof(loadavgwatch_status_reader));
+    if (reader == NULL) {
+        munmap(mapping, sizeof(shm_segment));
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    reader->segment = segment;
+    *out_reader = reader;
+    return LOADAVGWATCH_OK;
+}
+
+loadavgwatch_status loadavgwatch_status_reader_read(
+    const loadavgwatch_status_reader* reader,
+    loadavgwatch_shared_status* out_status)
+{
+    const shm_segment* segment = reader->segment;
+    for (int attempt = 0; attempt < SHM_READ_ATTEMPTS; ++attempt) {
+        uint32_t before = __atomic_load_n(
+            &segment->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(out_status, &segment->status, sizeof(*out_status));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t after = __atomic_load_n(
+            &segment->sequence, __ATOMIC_RELAXED);
+        if (before != after) {
+            continue;
+        }
+        if (out_status->version != LOADAVGWATCH_SHARED_STATUS_VERSION) {
+            return LOADAVGWATCH_ERR_PARSE;
+        }
+        return LOADAVGWATCH_OK;
+    }
+    return LOADAVGWATCH_ERR_READ;
+}
+
+loadavgwatch_status loadavgwatch_status_reader_close(
+    loadavgwatch_status_reader** reader)
+{
+    if (*reader == NULL) {
+        return LOADAVGWATCH_OK;
+    }
+    munmap((void*)(*reader)->segment, sizeof(shm_segment));
+    free(*reader);
+    *reader = NULL;
+    return LOADAVGWATCH_OK;
+}
+
+bool loadavgwatch_group_claim_start(
+    loadavgwatch_group* group, int64_t now_ns, int64_t interval_ns)
+{
+    int64_t* last_start = &group->segment->last_start_time_ns;
+    int64_t last_start_ns = __atomic_load_n(last_start, __ATOMIC_ACQUIRE);
+    do {
+        if (now_ns - last_start_ns <= interval_ns) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(
+                 last_start,
+                 &last_start_ns,
+                 now_ns,
+                 false,
+                 __ATOMIC_ACQ_REL,
+                 __ATOMIC_ACQUIRE));
+    return true;
+}
+
+void loadavgwatch_group_register_start(
+    loadavgwatch_group* group, int64_t now_ns)
+{
+    int64_t* last_start = &group->segment->last_start_time_ns;
+    int64_t last_start_ns = __atomic_load_n(last_start, __ATOMIC_ACQUIRE);
+    // Later starts of other members are kept:
+    while (last_start_ns < now_ns
+           && !__atomic_compare_exchange_n(
+               last_start,
+               &last_start_ns,
+               now_ns,
+               false,
+               __ATOMIC_ACQ_REL,
+               __ATOMIC_ACQUIRE)) {
+    }
+}
+
+void loadavgwatch_group_close(loadavgwatch_group** group)
+{
+    if (*group == NULL) {
+        return;
+    }
+    munmap((*group)->segment, sizeof(shm_group_segment));
+    free(*group);
+    *group = NULL;
+}
+
+loadavgwatch_status loadavgwatch_join_group(
+    loadavgwatch_state* state, const char* name)
+{
+    if (state->group != NULL) {
+        PRINT_LOG_MESSAGE(state->log_error, "State is already in a group!");
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    char* object_name = shm_prefixed_name(SHM_GROUP_NAME_PREFIX, name);
+    if (object_name == NULL) {
+        PRINT_LOG_MESSAGE(state->log_error, "Invalid group name '%s'!", name);
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    loadavgwatch_group* group = calloc(1, sizeof(loadavgwatch_group));
+    if (group == NULL) {
+        free(object_name);
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    // The object outlives its members so that members that join later
+    // see the starts of the earlier ones. Objects are created zero
+    // filled, which is a group without starts:
+    int fd = shm_open(object_name, O_RDWR | O_CREAT, 0600);
+    void* mapping = MAP_FAILED;
+    struct stat object_stat;
+    if (fd != -1
+        && fstat(fd, &object_stat) == 0
+        && (object_stat.st_size >= (off_t)sizeof(shm_group_segment)
+            || ftruncate(fd, sizeof(shm_group_segment)) == 0)) {
+        mapping = mmap(
+            NULL,
+            sizeof(shm_group_segment),
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED,
+            fd,
+            0);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (mapping == MAP_FAILED) {
+        PRINT_LOG_MESSAGE(
+            state->log_error,
+            "Unable to join group '%s': %s",
+            object_name,
+            strerror(errno));
+        free(object_name);
+        free(group);
+        return LOADAVGWATCH_ERR_INIT;
+    }
+    free(object_name);
+    shm_group_segment* segment = mapping;
+    // Members write the same magic, so joining at the same time does
+    // not matter:
+    static const char no_magic[sizeof(segment->magic)] = {0};
+    if (memcmp(segment->magic, no_magic, sizeof(segment->magic)) == 0) {
+        memcpy(segment->magic, SHM_GROUP_MAGIC, sizeof(segment->magic));
+    } else if (memcmp(segment->magic, SHM_GROUP_MAGIC, sizeof(segment->magic))
+               != 0) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "'%s' is not a loadavgwatch group!", name);
+        munmap(mapping, sizeof(shm_group_segment));
+        free(group);
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    group->segment = segment;
+    state->group = group;
+    return LOADAVGWATCH_OK;
+}
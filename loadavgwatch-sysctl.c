@@ -25,6 +25,7 @@
 #include <sys/resource.h>
 #include <sys/sysctl.h>
 #include <stdlib.h>
+#include <string.h>
 
 typedef struct sysctl_mibs
 {
@@ -68,17 +69,46 @@ loadavgwatch_status loadavgwatch_impl_open(
         free(mibs);
         return LOADAVGWATCH_ERR_INIT;
     }
-    float load;
+    struct timespec now = {0, 0};
+    loadavgwatch_snapshot snapshot;
     loadavgwatch_status status = loadavgwatch_impl_get_load_average(
-        mibs, &load);
+        mibs, &now, &snapshot);
     if (status != LOADAVGWATCH_OK) {
         PRINT_LOG_MESSAGE(state->log_error, "Initial load reading failed!");
+        free(mibs);
         return status;
     }
     *out_impl_state = mibs;
     return LOADAVGWATCH_OK;
 }
 
+loadavgwatch_status loadavgwatch_impl_set_parameter(
+    const loadavgwatch_state* state,
+    void* impl_state,
+    const loadavgwatch_parameter* parameter)
+{
+    if (strcmp(parameter->key, "source") == 0
+        && strcmp((const char*)parameter->value, "sysctl") == 0) {
+        return LOADAVGWATCH_OK;
+    }
+    PRINT_LOG_MESSAGE(
+        state->log_error,
+        "Unsupported load source parameter '%s'!",
+        parameter->key);
+    return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+}
+
+int loadavgwatch_impl_get_event_fd(const void* impl_state)
+{
+    return -1;
+}
+
+bool loadavgwatch_impl_get_update_interval(
+    const void* impl_state, struct timespec* out_interval)
+{
+    return false;
+}
+
 loadavgwatch_status loadavgwatch_impl_close(void* impl_state)
 {
     free(impl_state);
@@ -86,7 +116,7 @@ loadavgwatch_status loadavgwatch_impl_close(void* impl_state)
 }
 
 loadavgwatch_status loadavgwatch_impl_get_load_average(
-    void* state, float* out_loadavg)
+    void* state, const struct timespec* now, loadavgwatch_snapshot* out_snapshot)
 {
     sysctl_mibs* mibs = (sysctl_mibs*)state;
     struct loadavg load;
@@ -99,6 +129,10 @@ loadavgwatch_status loadavgwatch_impl_get_load_average(
     if (read_result != 0) {
         return LOADAVGWATCH_ERR_READ;
     }
-    *out_loadavg = (float)load.ldavg[0] / load.fscale;
+    for (size_t i = 0; i < sizeof(load.ldavg) / sizeof(load.ldavg[0]); ++i) {
+        out_snapshot->load[i].load = load.ldavg[i];
+        out_snapshot->load[i].scale = load.fscale;
+    }
+    out_snapshot->fields = LOADAVGWATCH_SNAPSHOT_LOAD;
     return LOADAVGWATCH_OK;
 }
@@ -0,0 +1,380 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Load trace files, recording them and replaying them through the
+ * decision logic of a virtual state.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <assert.h>
+#include "loadavgwatch.h"
+#include "loadavgwatch-impl.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Trace files are read and written as raw structures, so make sure
+// that compilers do not add padding to them:
+typedef char trace_header_size_check[
+    sizeof(loadavgwatch_trace_header) == 32 ? 1 : -1];
+typedef char trace_record_size_check[
+    sizeof(loadavgwatch_trace_record) == 56 ? 1 : -1];
+
+// File is extended by this many records at a time. This is around a
+// day of polls with the default 20 second poll interval:
+#define RECORDER_GROW_RECORDS 4096
+
+struct _loadavgwatch_recorder
+{
+    int fd;
+    void* mapping;
+    size_t mapping_size;
+    loadavgwatch_trace_header* header;
+    loadavgwatch_trace_record* records;
+    uint64_t capacity;
+};
+
+struct _loadavgwatch_trace
+{
+    void* mapping;
+    size_t mapping_size;
+    const loadavgwatch_trace_header* header;
+    const loadavgwatch_trace_record* records;
+};
+
+static bool trace_header_is_valid(
+    const loadavgwatch_trace_header* header, size_t file_size)
+{
+    if (memcmp(header->magic, LOADAVGWATCH_TRACE_MAGIC, sizeof(header->magic))
+        != 0) {
+        return false;
+    }
+    if (header->version != LOADAVGWATCH_TRACE_VERSION
+        || header->record_size != sizeof(loadavgwatch_trace_record)) {
+        return false;
+    }
+    uint64_t max_records = (file_size - sizeof(*header)) / header->record_size;
+    return header->record_count <= max_records;
+}
+
+loadavgwatch_status loadavgwatch_trace_open(
+    const char* path, loadavgwatch_trace** out_trace)
+{
+    *out_trace = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        return LOADAVGWATCH_ERR_READ;
+    }
+    if (file_stat.st_size < (off_t)sizeof(loadavgwatch_trace_header)) {
+        close(fd);
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    size_t file_size = (size_t)file_stat.st_size;
+    // Records are only read once in order, so mapping the file avoids
+    // copying a possibly large trace through a read buffer:
+    void* mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    const loadavgwatch_trace_header* header = mapping;
+    if (!trace_header_is_valid(header, file_size)) {
+        munmap(mapping, file_size);
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    loadavgwatch_trace* trace = malloc(sizeof(loadavgwatch_trace));
+    if (trace == NULL) {
+        munmap(mapping, file_size);
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    trace->mapping = mapping;
+    trace->mapping_size = file_size;
+    trace->header = header;
+    trace->records = (const loadavgwatch_trace_record*)(header + 1);
+    *out_trace = trace;
+    return LOADAVGWATCH_OK;
+}
+
+const loadavgwatch_trace_header* loadavgwatch_trace_get_header(
+    const loadavgwatch_trace* trace)
+{
+    return trace->header;
+}
+
+const loadavgwatch_trace_record* loadavgwatch_trace_get_records(
+    const loadavgwatch_trace* trace, size_t* out_count)
+{
+    *out_count = (size_t)trace->header->record_count;
+    return trace->records;
+}
+
+loadavgwatch_status loadavgwatch_trace_close(loadavgwatch_trace** trace)
+{
+    assert(trace != NULL);
+    if (*trace == NULL) {
+        return LOADAVGWATCH_OK;
+    }
+    munmap((*trace)->mapping, (*trace)->mapping_size);
+    free(*trace);
+    *trace = NULL;
+    return LOADAVGWATCH_OK;
+}
+
+static size_t trace_file_size(uint64_t records)
+{
+    return sizeof(loadavgwatch_trace_header)
+        + (size_t)records * sizeof(loadavgwatch_trace_record);
+}
+
+/**
+ * Maps the whole file, including the preallocated records after the
+ * ones that the header counts.
+ */
+static bool recorder_map(loadavgwatch_recorder* recorder, size_t file_size)
+{
+    void* mapping = mmap(
+        NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, recorder->fd, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    recorder->mapping = mapping;
+    recorder->mapping_size = file_size;
+    recorder->header = mapping;
+    recorder->records = (loadavgwatch_trace_record*)(recorder->header + 1);
+    recorder->capacity = (file_size - sizeof(loadavgwatch_trace_header))
+        / sizeof(loadavgwatch_trace_record);
+    return true;
+}
+
+static bool recorder_grow(loadavgwatch_recorder* recorder)
+{
+    size_t file_size = trace_file_size(
+        recorder->capacity + RECORDER_GROW_RECORDS);
+    if (ftruncate(recorder->fd, (off_t)file_size) != 0) {
+        return false;
+    }
+    munmap(recorder->mapping, recorder->mapping_size);
+    recorder->mapping = NULL;
+    return recorder_map(recorder, file_size);
+}
+
+loadavgwatch_status loadavgwatch_recorder_open(
+    const char* path, long ncpus, loadavgwatch_recorder** out_recorder)
+{
+    *out_recorder = NULL;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        return LOADAVGWATCH_ERR_READ;
+    }
+    size_t file_size = (size_t)file_stat.st_size;
+    bool new_file = file_size == 0;
+    if (!new_file && file_size < sizeof(loadavgwatch_trace_header)) {
+        close(fd);
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    if (new_file) {
+        file_size = trace_file_size(RECORDER_GROW_RECORDS);
+        if (ftruncate(fd, (off_t)file_size) != 0) {
+            close(fd);
+            return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+        }
+    }
+    loadavgwatch_recorder* recorder = calloc(1, sizeof(loadavgwatch_recorder));
+    if (recorder == NULL) {
+        close(fd);
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    recorder->fd = fd;
+    if (!recorder_map(recorder, file_size)) {
+        close(fd);
+        free(recorder);
+        return LOADAVGWATCH_ERR_READ;
+    }
+    if (new_file) {
+        memcpy(recorder->header->magic,
+               LOADAVGWATCH_TRACE_MAGIC,
+               sizeof(recorder->header->magic));
+        recorder->header->version = LOADAVGWATCH_TRACE_VERSION;
+        recorder->header->record_size = sizeof(loadavgwatch_trace_record);
+        recorder->header->record_count = 0;
+        recorder->header->ncpus = ncpus > 0 ? (uint32_t)ncpus : 0;
+    } else if (!trace_header_is_valid(recorder->header, file_size)) {
+        // Do not truncate files that we did not write:
+        munmap(recorder->mapping, recorder->mapping_size);
+        close(fd);
+        free(recorder);
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+    *out_recorder = recorder;
+    return LOADAVGWATCH_OK;
+}
+
+loadavgwatch_status loadavgwatch_recorder_append(
+    loadavgwatch_recorder* recorder,
+    const struct timespec* now,
+    const loadavgwatch_snapshot* snapshot,
+    const loadavgwatch_poll_result* result)
+{
+    if (recorder->mapping == NULL) {
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    uint64_t count = recorder->header->record_count;
+    if (count == recorder->capacity && !recorder_grow(recorder)) {
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    loadavgwatch_trace_record* record = &recorder->records[count];
+    loadavgwatch_trace_record_from_snapshot(now, snapshot, record);
+    record->start_count = result->start_count;
+    record->stop_count = result->stop_count;
+    // Count is updated last so that readers of the file never see a
+    // partially written record:
+    recorder->header->record_count = count + 1;
+    return LOADAVGWATCH_OK;
+}
+
+loadavgwatch_status loadavgwatch_recorder_close(
+    loadavgwatch_recorder** recorder)
+{
+    assert(recorder != NULL);
+    if (*recorder == NULL) {
+        return LOADAVGWATCH_OK;
+    }
+    loadavgwatch_status status = LOADAVGWATCH_OK;
+    // Mapping is missing only if growing the file failed:
+    if ((*recorder)->mapping != NULL) {
+        uint64_t count = (*recorder)->header->record_count;
+        munmap((*recorder)->mapping, (*recorder)->mapping_size);
+        if (ftruncate((*recorder)->fd, (off_t)trace_file_size(count)) != 0) {
+            status = LOADAVGWATCH_ERR_READ;
+        }
+    }
+    close((*recorder)->fd);
+    free(*recorder);
+    *recorder = NULL;
+    return status;
+}
+
+static uint32_t rescale(const loadavgwatch_load* value, uint32_t scale)
+{
+    if (value->scale == scale) {
+        return value->load;
+    }
+    uint64_t rescaled = (uint64_t)value->load * scale / value->scale;
+    return rescaled > UINT32_MAX ? UINT32_MAX : (uint32_t)rescaled;
+}
+
+void loadavgwatch_trace_record_from_snapshot(
+    const struct timespec* now,
+    const loadavgwatch_snapshot* snapshot,
+    loadavgwatch_trace_record* out_record)
+{
+    memset(out_record, 0, sizeof(*out_record));
+    out_record->time_ns = (int64_t)now->tv_sec * 1000000000 + now->tv_nsec;
+    out_record->fields = snapshot->fields
+        & (LOADAVGWATCH_SNAPSHOT_LOAD
+           | LOADAVGWATCH_SNAPSHOT_RUNNING_TASKS
+           | LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE);
+    if (snapshot->fields & LOADAVGWATCH_SNAPSHOT_LOAD) {
+        out_record->load_scale = snapshot->load[0].scale;
+        for (size_t i = 0; i < 3; ++i) {
+            out_record->load[i] = rescale(
+                &snapshot->load[i], out_record->load_scale);
+        }
+    }
+    out_record->running_tasks = snapshot->running_tasks;
+    if (snapshot->fields & LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE) {
+        out_record->pressure_scale = snapshot->cpu_pressure[0].scale;
+        for (size_t i = 0; i < 3; ++i) {
+            out_record->cpu_pressure[i] = rescale(
+                &snapshot->cpu_pressure[i], out_record->pressure_scale);
+        }
+    }
+}
+
+void loadavgwatch_trace_record_to_snapshot(
+    const loadavgwatch_trace_record* record,
+    struct timespec* out_now,
+    loadavgwatch_snapshot* out_snapshot)
+{
+    out_now->tv_sec = (time_t)(record->time_ns / 1000000000);
+    out_now->tv_nsec = (long)(record->time_ns % 1000000000);
+    memset(out_snapshot, 0, sizeof(*out_snapshot));
+    out_snapshot->fields = record->fields;
+    for (size_t i = 0; i < 3; ++i) {
+        out_snapshot->load[i] = (loadavgwatch_load){
+            record->load[i], record->load_scale};
+        out_snapshot->cpu_pressure[i] = (loadavgwatch_load){
+            record->cpu_pressure[i], record->pressure_scale};
+    }
+    out_snapshot->running_tasks = record->running_tasks;
+}
+
+loadavgwatch_status loadavgwatch_replay(
+    loadavgwatch_state* state,
+    const loadavgwatch_trace_record* records,
+    size_t record_count,
+    loadavgwatch_replay_callback callback,
+    void* callback_data)
+{
+    assert(state != NULL && "Used uninitialized library!");
+    for (size_t i = 0; i < record_count; ++i) {
+        struct timespec now;
+        loadavgwatch_snapshot snapshot;
+        loadavgwatch_trace_record_to_snapshot(&records[i], &now, &snapshot);
+        loadavgwatch_status status = loadavgwatch_set_virtual_sample(
+            state, &now, &snapshot);
+        if (status != LOADAVGWATCH_OK) {
+            return status;
+        }
+        loadavgwatch_poll_result result;
+        status = loadavgwatch_poll(state, &result);
+        if (status != LOADAVGWATCH_OK) {
+            PRINT_LOG_MESSAGE(
+                state->log_error,
+                "Unable to replay trace record %zu!",
+                i);
+            return status;
+        }
+        if (result.start_count > 0) {
+            loadavgwatch_register_start(state);
+        }
+        if (result.stop_count > 0) {
+            loadavgwatch_register_stop(state);
+        }
+        if (callback != NULL) {
+            callback(&records[i], &result, callback_data);
+        }
+    }
+    return LOADAVGWATCH_OK;
+}
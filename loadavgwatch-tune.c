@@ -0,0 +1,798 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Offline tuner for load limits and intervals.
+ *
+ * Every combination of the given option values is simulated against
+ * recorded load traces with the same decision logic that loadavgwatch
+ * uses. Each started process is modeled as one more runnable task that
+ * the load averages follow with their time constants, and a stop
+ * removes one simulated process. Configurations are ranked by
+ * simulated throughput (process hours) against the time that the
+ * simulated load spent over the overload limit.
+ *
+ * Simulations are distributed to threads by splitting ranges of
+ * configuration indexes. A thread that runs out of work steals the
+ * upper half of the remaining range of another thread. Every thread
+ * reuses one virtual state, so simulations do not allocate memory.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include "loadavgwatch.h"
+#include "loadavgwatch-ewma.c"
+#include "main-parsers.c"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DIMENSION_COUNT 5
+
+typedef enum dimension_id
+{
+    DIMENSION_START_LOAD = 0,
+    DIMENSION_STOP_LOAD = 1,
+    DIMENSION_START_INTERVAL = 2,
+    DIMENSION_QUIET_OVER_START = 3,
+    DIMENSION_QUIET_OVER_STOP = 4
+} dimension_id;
+
+/**
+ * Values of one swept option. Loads are in hundredths and times in
+ * nanoseconds.
+ */
+typedef struct dimension
+{
+    const char* option;
+    bool is_load;
+    int64_t* values;
+    size_t count;
+} dimension;
+
+typedef struct simulation_result
+{
+    bool valid;
+    double process_seconds;
+    double overload_seconds;
+    uint64_t starts;
+    uint64_t stops;
+} simulation_result;
+
+typedef struct tune_context
+{
+    dimension dimensions[DIMENSION_COUNT];
+    size_t config_count;
+    loadavgwatch_trace** traces;
+    size_t trace_count;
+    long ncpus;
+    loadavgwatch_load overload;
+    struct timespec time_constants[EWMA_AVERAGES];
+    simulation_result* results;
+} tune_context;
+
+typedef struct worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // Configuration indexes [next, end) that this worker has left:
+    size_t next;
+    size_t end;
+    size_t index;
+    struct worker* workers;
+    size_t worker_count;
+    const tune_context* context;
+    loadavgwatch_state* state;
+} worker;
+
+static void log_ignore(const char* message, void* data)
+{
+}
+
+static void log_stderr(const char* message, void* data)
+{
+    fprintf(stderr, "%s\n", message);
+}
+
+static struct timespec ns_to_timespec(int64_t value)
+{
+    return (struct timespec){
+        .tv_sec = (time_t)(value / 1000000000),
+        .tv_nsec = (long)(value % 1000000000)
+    };
+}
+
+static int64_t timespec_to_ns(const struct timespec* value)
+{
+    return (int64_t)value->tv_sec * 1000000000 + value->tv_nsec;
+}
+
+static bool parse_value(const dimension* dimension, const char* str, int64_t* out)
+{
+    if (dimension->is_load) {
+        char* endptr = NULL;
+        double load = strtod(str, &endptr);
+        if (endptr == str || *endptr != '\0' || load < 0.0 || load >= 4e7) {
+            return false;
+        }
+        *out = (int64_t)(100 * load + 0.5);
+        return true;
+    }
+    struct timespec value;
+    if (!_string_to_timespec(str, &value)) {
+        return false;
+    }
+    *out = timespec_to_ns(&value);
+    return true;
+}
+
+static bool add_value(dimension* dimension, int64_t value)
+{
+    int64_t* values = realloc(
+        dimension->values, (dimension->count + 1) * sizeof(int64_t));
+    if (values == NULL) {
+        return false;
+    }
+    values[dimension->count] = value;
+    dimension->values = values;
+    ++dimension->count;
+    return true;
+}
+
+/**
+ * Parses a comma separated list where every item is either a value or
+ * a FROM:TO:STEP range.
+ */
+static bool parse_dimension(dimension* dimension, char* list_str)
+{
+    char* list_position = NULL;
+    for (char* item = strtok_r(list_str, ",", &list_position);
+         item != NULL;
+         item = strtok_r(NULL, ",", &list_position)) {
+        char* range_position = NULL;
+        char* parts[3] = {strtok_r(item, ":", &range_position), NULL, NULL};
+        parts[1] = strtok_r(NULL, ":", &range_position);
+        parts[2] = strtok_r(NULL, ":", &range_position);
+        int64_t from;
+        if (parts[0] == NULL || !parse_value(dimension, parts[0], &from)) {
+            return false;
+        }
+        if (parts[1] == NULL) {
+            if (!add_value(dimension, from)) {
+                return false;
+            }
+            continue;
+        }
+        int64_t to;
+        int64_t step;
+        if (parts[2] == NULL
+            || strtok_r(NULL, ":", &range_position) != NULL
+            || !parse_value(dimension, parts[1], &to)
+            || !parse_value(dimension, parts[2], &step)
+            || step <= 0
+            || to < from) {
+            return false;
+        }
+        for (int64_t value = from; value <= to; value += step) {
+            if (!add_value(dimension, value)) {
+                return false;
+            }
+        }
+    }
+    return dimension->count > 0;
+}
+
+static int64_t config_value(
+    const tune_context* context, size_t config, dimension_id id)
+{
+    for (int i = DIMENSION_COUNT - 1; i > id; --i) {
+        config /= context->dimensions[i].count;
+    }
+    const dimension* dimension = &context->dimensions[id];
+    return dimension->values[config % dimension->count];
+}
+
+static loadavgwatch_load config_load(
+    const tune_context* context, size_t config, dimension_id id)
+{
+    return (loadavgwatch_load){
+        (uint32_t)config_value(context, config, id), 100};
+}
+
+static struct timespec config_time(
+    const tune_context* context, size_t config, dimension_id id)
+{
+    return ns_to_timespec(config_value(context, config, id));
+}
+
+static void configure(
+    loadavgwatch_state* state, const tune_context* context, size_t config)
+{
+    loadavgwatch_load start_load = config_load(
+        context, config, DIMENSION_START_LOAD);
+    loadavgwatch_load stop_load = config_load(
+        context, config, DIMENSION_STOP_LOAD);
+    struct timespec start_interval = config_time(
+        context, config, DIMENSION_START_INTERVAL);
+    struct timespec quiet_over_start = config_time(
+        context, config, DIMENSION_QUIET_OVER_START);
+    struct timespec quiet_over_stop = config_time(
+        context, config, DIMENSION_QUIET_OVER_STOP);
+    loadavgwatch_set_start_load(state, &start_load);
+    loadavgwatch_set_stop_load(state, &stop_load);
+    loadavgwatch_set_start_interval(state, &start_interval);
+    loadavgwatch_set_quiet_period_over_start(state, &quiet_over_start);
+    loadavgwatch_set_quiet_period_over_stop(state, &quiet_over_stop);
+}
+
+/**
+ * Adds the simulated processes to the recorded load. Their share of
+ * the load averages is tracked with the time constants of the recorded
+ * load averages.
+ */
+static void add_simulated_load(
+    const ewma_state* process_ewma,
+    uint32_t processes,
+    loadavgwatch_snapshot* inout_snapshot)
+{
+    loadavgwatch_load process_loads[EWMA_AVERAGES];
+    _ewma_get(process_ewma, process_loads);
+    for (int i = 0; i < EWMA_AVERAGES; ++i) {
+        loadavgwatch_load* load = &inout_snapshot->load[i];
+        uint64_t added = ((uint64_t)process_loads[i].load * load->scale)
+            >> EWMA_SHIFT;
+        uint64_t total = load->load + added;
+        load->load = total > UINT32_MAX ? UINT32_MAX : (uint32_t)total;
+    }
+    inout_snapshot->running_tasks += processes;
+}
+
+static bool is_overloaded(
+    const loadavgwatch_load* load, const loadavgwatch_load* overload)
+{
+    return (uint64_t)load->load * overload->scale
+        > (uint64_t)overload->load * load->scale;
+}
+
+static void simulate_trace(
+    loadavgwatch_state* state,
+    const loadavgwatch_trace* trace,
+    const loadavgwatch_load* overload,
+    const struct timespec time_constants[EWMA_AVERAGES],
+    simulation_result* inout_result)
+{
+    size_t record_count;
+    const loadavgwatch_trace_record* records = loadavgwatch_trace_get_records(
+        trace, &record_count);
+    loadavgwatch_reset(state);
+    ewma_state process_ewma = {.initialized = false};
+    _ewma_init(&process_ewma, time_constants);
+    uint32_t processes = 0;
+    bool overloaded = false;
+    for (size_t i = 0; i < record_count; ++i) {
+        struct timespec now;
+        loadavgwatch_snapshot snapshot;
+        loadavgwatch_trace_record_to_snapshot(&records[i], &now, &snapshot);
+        if (i > 0) {
+            double elapsed = (records[i].time_ns - records[i - 1].time_ns) / 1e9;
+            inout_result->process_seconds += processes * elapsed;
+            if (overloaded) {
+                inout_result->overload_seconds += elapsed;
+            }
+        }
+        _ewma_sample(&process_ewma, &now, (uint64_t)processes << EWMA_SHIFT);
+        add_simulated_load(&process_ewma, processes, &snapshot);
+        overloaded = is_overloaded(&snapshot.load[0], overload);
+
+        loadavgwatch_set_virtual_sample(state, &now, &snapshot);
+        loadavgwatch_poll_result result;
+        if (loadavgwatch_poll(state, &result) != LOADAVGWATCH_OK) {
+            continue;
+        }
+        if (result.start_count > 0) {
+            loadavgwatch_register_start(state);
+            ++processes;
+            ++inout_result->starts;
+        }
+        if (result.stop_count > 0) {
+            loadavgwatch_register_stop(state);
+            if (processes > 0) {
+                --processes;
+            }
+            ++inout_result->stops;
+        }
+    }
+}
+
+static void simulate(worker* self, size_t config)
+{
+    const tune_context* context = self->context;
+    simulation_result* result = &context->results[config];
+    memset(result, 0, sizeof(*result));
+    // Library requires the start load to be at least one less than the
+    // stop load:
+    if (config_value(context, config, DIMENSION_START_LOAD) + 100
+        > config_value(context, config, DIMENSION_STOP_LOAD)) {
+        return;
+    }
+    configure(self->state, context, config);
+    for (size_t i = 0; i < context->trace_count; ++i) {
+        simulate_trace(
+            self->state,
+            context->traces[i],
+            &context->overload,
+            context->time_constants,
+            result);
+    }
+    result->valid = true;
+}
+
+static bool take_own_work(worker* self, size_t* out_config)
+{
+    bool found = false;
+    pthread_mutex_lock(&self->lock);
+    if (self->next < self->end) {
+        *out_config = self->next++;
+        found = true;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return found;
+}
+
+/**
+ * Takes the upper half of the remaining work of the first other worker
+ * that has any. Only one lock is held at a time.
+ */
+static bool steal_work(worker* self)
+{
+    for (size_t i = 1; i < self->worker_count; ++i) {
+        worker* victim = &self->workers[(self->index + i) % self->worker_count];
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->end - victim->next;
+        if (remaining == 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        size_t stolen_end = victim->end;
+        size_t stolen_next = victim->next + remaining / 2;
+        victim->end = stolen_next;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&self->lock);
+        self->next = stolen_next;
+        self->end = stolen_end;
+        pthread_mutex_unlock(&self->lock);
+        return true;
+    }
+    return false;
+}
+
+static void* run_worker(void* data)
+{
+    worker* self = (worker*)data;
+    size_t config;
+    do {
+        while (take_own_work(self, &config)) {
+            simulate(self, config);
+        }
+    } while (steal_work(self));
+    return NULL;
+}
+
+static bool run_workers(tune_context* context, size_t worker_count)
+{
+    worker* workers = calloc(worker_count, sizeof(worker));
+    if (workers == NULL) {
+        return false;
+    }
+    loadavgwatch_log_object log_error = {log_stderr, NULL};
+    loadavgwatch_log_object log_null = {log_ignore, NULL};
+    bool success = true;
+    for (size_t i = 0; i < worker_count; ++i) {
+        worker* current = &workers[i];
+        current->index = i;
+        current->workers = workers;
+        current->worker_count = worker_count;
+        current->context = context;
+        current->next = context->config_count * i / worker_count;
+        current->end = context->config_count * (i + 1) / worker_count;
+        pthread_mutex_init(&current->lock, NULL);
+        if (loadavgwatch_open_virtual(
+                &current->state, &log_null, &log_error, context->ncpus)
+            != LOADAVGWATCH_OK) {
+            success = false;
+        }
+    }
+    // Every worker needs to be ready before any of them tries to steal.
+    // Work of workers that could not be started is stolen by others:
+    size_t started = 0;
+    while (success && started < worker_count
+           && pthread_create(
+               &workers[started].thread, NULL, run_worker, &workers[started])
+           == 0) {
+        ++started;
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (size_t i = 0; i < worker_count; ++i) {
+        loadavgwatch_close(&workers[i].state);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+    free(workers);
+    return success && started > 0;
+}
+
+static const simulation_result* g_sort_results;
+
+/**
+ * Orders configurations by overload time and then by throughput from
+ * the highest to the lowest.
+ */
+static int compare_results(const void* left, const void* right)
+{
+    const simulation_result* left_result = &g_sort_results[*(const size_t*)left];
+    const simulation_result* right_result = &g_sort_results[*(const size_t*)right];
+    if (left_result->overload_seconds != right_result->overload_seconds) {
+        return left_result->overload_seconds < right_result->overload_seconds
+            ? -1 : 1;
+    }
+    if (left_result->process_seconds != right_result->process_seconds) {
+        return left_result->process_seconds > right_result->process_seconds
+            ? -1 : 1;
+    }
+    return 0;
+}
+
+static void print_value(const dimension* dimension, int64_t value)
+{
+    if (dimension->is_load) {
+        printf(" %9lld.%02lld",
+               (long long)(value / 100),
+               (long long)(value % 100));
+        return;
+    }
+    struct timespec time_value = ns_to_timespec(value);
+    char time_str[32];
+    _timespec_to_string(&time_value, time_str, sizeof(time_str));
+    printf(" %12s", time_str);
+}
+
+/**
+ * Prints the configurations where no other configuration has both
+ * higher throughput and lower overload time.
+ */
+static bool print_ranking(
+    const tune_context* context, double trace_seconds, size_t top)
+{
+    size_t* order = malloc(context->config_count * sizeof(size_t));
+    if (order == NULL) {
+        return false;
+    }
+    size_t valid = 0;
+    for (size_t i = 0; i < context->config_count; ++i) {
+        if (context->results[i].valid) {
+            order[valid++] = i;
+        }
+    }
+    g_sort_results = context->results;
+    qsort(order, valid, sizeof(size_t), compare_results);
+
+    printf("%12s %12s %12s %12s %12s %12s %10s %8s %8s\n",
+           "max-start",
+           "min-stop",
+           "start-int",
+           "quiet-start",
+           "quiet-stop",
+           "proc-hours",
+           "overload%",
+           "starts",
+           "stops");
+    double best_process_seconds = -1.0;
+    size_t printed = 0;
+    for (size_t i = 0; i < valid && printed < top; ++i) {
+        const simulation_result* result = &context->results[order[i]];
+        if (result->process_seconds <= best_process_seconds) {
+            continue;
+        }
+        best_process_seconds = result->process_seconds;
+        for (int id = 0; id < DIMENSION_COUNT; ++id) {
+            print_value(
+                &context->dimensions[id],
+                config_value(context, order[i], id));
+        }
+        printf(" %12.1f %10.2f %8llu %8llu\n",
+               result->process_seconds / 3600,
+               trace_seconds > 0
+               ? 100 * result->overload_seconds / trace_seconds : 0.0,
+               (unsigned long long)result->starts,
+               (unsigned long long)result->stops);
+        ++printed;
+    }
+    free(order);
+    return true;
+}
+
+static void show_help(char* argv[])
+{
+    printf("Usage: %s [options] <trace>...\n", argv[0]);
+    printf(
+"Simulate combinations of loadavgwatch options against recorded load traces\n"
+"(loadavgwatch --record) and show the ones with the best trade-off between\n"
+"throughput of started processes and time spent overloaded.\n"
+"\n"
+"Every option value is a comma separated list of values and FROM:TO:STEP ranges.\n"
+"Options that are not given use the loadavgwatch defaults.\n"
+"\n"
+"Options:\n"
+"  -h, --help           Show this help.\n"
+"  --max-start <loads>  Maximum loads where processes are still started.\n"
+"  --min-stop <loads>   Minimum loads where processes are stopped.\n"
+"  --start-interval <times>\n"
+"                       Times between subsequent starts.\n"
+"  --quiet-max-start <times>\n"
+"                       Quiet periods after exceeding the maximum start load.\n"
+"  --quiet-min-stop <times>\n"
+"                       Quiet periods after exceeding the minimum stop load.\n"
+"  --overload <load>    1 minute load that counts as overload (number of CPUs).\n"
+"  --time-constants <time>,<time>,<time>\n"
+"                       Load average time constants of the traces (1m,5m,15m).\n"
+"  --threads <count>    Number of simulation threads (number of online CPUs).\n"
+"  --top <count>        Show at most this many configurations.\n"
+);
+}
+
+static const char* option_value(
+    const char* name, int argc, char* argv[], int* inout_index)
+{
+    const char* argument = argv[*inout_index];
+    size_t name_length = strlen(name);
+    if (strncmp(argument, name, name_length) != 0) {
+        return NULL;
+    }
+    if (argument[name_length] == '=') {
+        return argument + name_length + 1;
+    }
+    if (argument[name_length] != '\0' || *inout_index + 1 >= argc) {
+        return NULL;
+    }
+    ++*inout_index;
+    return argv[*inout_index];
+}
+
+static bool parse_count(const char* str, size_t* out_count)
+{
+    char* endptr = NULL;
+    long long count = strtoll(str, &endptr, 10);
+    if (endptr == str || *endptr != '\0' || count <= 0) {
+        return false;
+    }
+    *out_count = (size_t)count;
+    return true;
+}
+
+/**
+ * Uses the defaults of a state with the same number of CPUs for the
+ * options that were not given.
+ */
+static bool add_defaults(tune_context* context)
+{
+    loadavgwatch_log_object log_null = {log_ignore, NULL};
+    loadavgwatch_state* state = NULL;
+    if (loadavgwatch_open_virtual(&state, &log_null, &log_null, context->ncpus)
+        != LOADAVGWATCH_OK) {
+        return false;
+    }
+    loadavgwatch_load start_load = loadavgwatch_get_start_load(state);
+    loadavgwatch_load stop_load = loadavgwatch_get_stop_load(state);
+    struct timespec start_interval = loadavgwatch_get_start_interval(state);
+    struct timespec quiet_over_start =
+        loadavgwatch_get_quiet_period_over_start(state);
+    struct timespec quiet_over_stop =
+        loadavgwatch_get_quiet_period_over_stop(state);
+    loadavgwatch_close(&state);
+    const int64_t defaults[DIMENSION_COUNT] = {
+        (int64_t)start_load.load * 100 / start_load.scale,
+        (int64_t)stop_load.load * 100 / stop_load.scale,
+        timespec_to_ns(&start_interval),
+        timespec_to_ns(&quiet_over_start),
+        timespec_to_ns(&quiet_over_stop),
+    };
+    context->config_count = 1;
+    for (int i = 0; i < DIMENSION_COUNT; ++i) {
+        dimension* dimension = &context->dimensions[i];
+        if (dimension->count == 0 && !add_value(dimension, defaults[i])) {
+            return false;
+        }
+        if (context->config_count > SIZE_MAX / dimension->count) {
+            return false;
+        }
+        context->config_count *= dimension->count;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    tune_context context = {
+        .dimensions = {
+            {"--max-start", true, NULL, 0},
+            {"--min-stop", true, NULL, 0},
+            {"--start-interval", false, NULL, 0},
+            {"--quiet-max-start", false, NULL, 0},
+            {"--quiet-min-stop", false, NULL, 0},
+        },
+        .time_constants = {{60, 0}, {5 * 60, 0}, {15 * 60, 0}},
+    };
+    const char* overload_str = NULL;
+    size_t thread_count = 0;
+    size_t top = SIZE_MAX;
+    const char** trace_paths = calloc(argc, sizeof(const char*));
+    if (trace_paths == NULL) {
+        return EXIT_FAILURE;
+    }
+    for (int argument = 1; argument < argc; ++argument) {
+        const char* current = argv[argument];
+        if (strcmp(current, "--help") == 0 || strcmp(current, "-h") == 0) {
+            show_help(argv);
+            return EXIT_SUCCESS;
+        }
+        if (strncmp(current, "--", 2) != 0) {
+            trace_paths[context.trace_count++] = current;
+            continue;
+        }
+        bool known_option = false;
+        for (int i = 0; i < DIMENSION_COUNT && !known_option; ++i) {
+            dimension* dimension = &context.dimensions[i];
+            char* value = (char*)option_value(
+                dimension->option, argc, argv, &argument);
+            if (value == NULL) {
+                continue;
+            }
+            known_option = true;
+            if (!parse_dimension(dimension, value)) {
+                fprintf(stderr, "Invalid %s value!\n", dimension->option);
+                return EXIT_FAILURE;
+            }
+        }
+        if (known_option) {
+            continue;
+        }
+        const char* value;
+        if ((value = option_value("--overload", argc, argv, &argument))) {
+            overload_str = value;
+        } else if ((value = option_value(
+                        "--time-constants", argc, argv, &argument))) {
+            if (!_string_to_timespec_list(
+                    value, context.time_constants, EWMA_AVERAGES)
+                || _ewma_timespec_ns(&context.time_constants[0]) == 0
+                || _ewma_timespec_ns(&context.time_constants[1]) == 0
+                || _ewma_timespec_ns(&context.time_constants[2]) == 0) {
+                fprintf(stderr, "Invalid --time-constants value '%s'!\n", value);
+                return EXIT_FAILURE;
+            }
+        } else if ((value = option_value("--threads", argc, argv, &argument))) {
+            if (!parse_count(value, &thread_count)) {
+                fprintf(stderr, "Invalid --threads value '%s'!\n", value);
+                return EXIT_FAILURE;
+            }
+        } else if ((value = option_value("--top", argc, argv, &argument))) {
+            if (!parse_count(value, &top)) {
+                fprintf(stderr, "Invalid --top value '%s'!\n", value);
+                return EXIT_FAILURE;
+            }
+        } else {
+            fprintf(stderr, "Unknown argument '%s'!\n", current);
+            return EXIT_FAILURE;
+        }
+    }
+    if (context.trace_count == 0) {
+        fprintf(stderr, "No load traces given! See --help.\n");
+        return EXIT_FAILURE;
+    }
+
+    context.traces = calloc(context.trace_count, sizeof(loadavgwatch_trace*));
+    if (context.traces == NULL) {
+        return EXIT_FAILURE;
+    }
+    double trace_seconds = 0;
+    for (size_t i = 0; i < context.trace_count; ++i) {
+        if (loadavgwatch_trace_open(trace_paths[i], &context.traces[i])
+            != LOADAVGWATCH_OK) {
+            fprintf(stderr, "Unable to read load trace '%s'!\n", trace_paths[i]);
+            return EXIT_FAILURE;
+        }
+        long ncpus = loadavgwatch_trace_get_header(context.traces[i])->ncpus;
+        // Default limits and overload depend on the number of CPUs:
+        if (i > 0 && ncpus != context.ncpus) {
+            fprintf(stderr,
+                    "Load trace '%s' has %ld CPUs instead of %ld! "
+                    "Tune machines with different CPU counts separately.\n",
+                    trace_paths[i],
+                    ncpus,
+                    context.ncpus);
+            return EXIT_FAILURE;
+        }
+        context.ncpus = ncpus;
+        size_t record_count;
+        const loadavgwatch_trace_record* records =
+            loadavgwatch_trace_get_records(context.traces[i], &record_count);
+        if (record_count > 1) {
+            trace_seconds += (records[record_count - 1].time_ns
+                              - records[0].time_ns) / 1e9;
+        }
+    }
+
+    context.overload = (loadavgwatch_load){
+        context.ncpus > 0 ? (uint32_t)context.ncpus * 100 : 100, 100};
+    if (overload_str != NULL) {
+        dimension overload_dimension = {"--overload", true, NULL, 0};
+        int64_t overload;
+        if (!parse_value(&overload_dimension, overload_str, &overload)) {
+            fprintf(stderr, "Invalid --overload value '%s'!\n", overload_str);
+            return EXIT_FAILURE;
+        }
+        context.overload.load = (uint32_t)overload;
+    }
+    if (!add_defaults(&context)) {
+        fprintf(stderr, "Too many configurations!\n");
+        return EXIT_FAILURE;
+    }
+    context.results = calloc(context.config_count, sizeof(simulation_result));
+    if (context.results == NULL) {
+        fprintf(stderr, "Out of memory for %zu results!\n", context.config_count);
+        return EXIT_FAILURE;
+    }
+    if (thread_count == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = online > 0 ? (size_t)online : 1;
+    }
+    if (thread_count > context.config_count) {
+        thread_count = context.config_count;
+    }
+
+    fprintf(stderr,
+            "Simulating %zu configurations over %zu traces with %zu threads.\n",
+            context.config_count,
+            context.trace_count,
+            thread_count);
+    if (!run_workers(&context, thread_count)) {
+        fprintf(stderr, "Unable to start simulation threads!\n");
+        return EXIT_FAILURE;
+    }
+    if (!print_ranking(&context, trace_seconds, top)) {
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < context.trace_count; ++i) {
+        loadavgwatch_trace_close(&context.traces[i]);
+    }
+    for (int i = 0; i < DIMENSION_COUNT; ++i) {
+        free(context.dimensions[i].values);
+    }
+    free(context.traces);
+    free(context.results);
+    free(trace_paths);
+    return EXIT_SUCCESS;
+}
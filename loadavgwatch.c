@@ -21,6 +21,8 @@
 #include <assert.h>
 #include "loadavgwatch.h"
 #include "loadavgwatch-impl.h"
+#include "loadavgwatch-history.c"
+#include "loadavgwatch-phase.c"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +46,16 @@ static void log_stderr(const char* message, void* data __attribute__((unused)))
     fwrite("\n", sizeof("\n") - 1, 1, stderr);
 }
 
+static const char* METRIC_NAMES[] = {
+    "1 minute load average",
+    "5 minute load average",
+    "15 minute load average",
+    "Running tasks",
+    "10 second CPU pressure",
+    "60 second CPU pressure",
+    "300 second CPU pressure",
+};
+
 static struct {
     loadavgwatch_log_object warning;
     loadavgwatch_log_object error;
@@ -52,24 +64,110 @@ static struct {
     .error = {log_stderr, NULL}
 };
 
+/**
+ * Compares two fixed point load values exactly.
+ *
+ * Returns a negative value if left is smaller than right, zero if
+ * they are equal, and a positive value if left is bigger than right.
+ */
+static int load_compare(
+    const loadavgwatch_load* left, const loadavgwatch_load* right)
+{
+    uint64_t left_scaled = (uint64_t)left->load * right->scale;
+    uint64_t right_scaled = (uint64_t)right->load * left->scale;
+    if (left_scaled < right_scaled) {
+        return -1;
+    }
+    if (right_scaled < left_scaled) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Calculates floor(bigger - smaller) + 1 without converting the
+ * values to floating point.
+ *
+ * This is the number of processes that fit under (or should be
+ * removed over) a load limit.
+ */
+static uint32_t load_difference_count(
+    const loadavgwatch_load* bigger, const loadavgwatch_load* smaller)
+{
+    uint64_t bigger_scaled = (uint64_t)bigger->load * smaller->scale;
+    uint64_t smaller_scaled = (uint64_t)smaller->load * bigger->scale;
+    if (bigger_scaled < smaller_scaled) {
+        return 0;
+    }
+    uint64_t common_scale = (uint64_t)bigger->scale * smaller->scale;
+    uint64_t difference = (bigger_scaled - smaller_scaled) / common_scale;
+    if (difference >= UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    return (uint32_t)difference + 1;
+}
+
+/**
+ * Formats fixed point load value with two decimals for log messages.
+ */
+static void load_to_string(
+    const loadavgwatch_load* load, char* out_buffer, size_t buffer_size)
+{
+    uint32_t whole = load->load / load->scale;
+    uint32_t hundredths = (uint32_t)(
+        (uint64_t)(load->load % load->scale) * 100 / load->scale);
+    snprintf(out_buffer, buffer_size, "%u.%02u", whole, hundredths);
+}
+
 static void adjust_start_stop_loads(loadavgwatch_state* inout_state)
 {
     // Everything is OK, no adjustment needed.
-    if (inout_state->start_load + 1.0 <= inout_state->stop_load) {
+    loadavgwatch_load start_plus_one = {
+        .load = inout_state->start_load.load + inout_state->start_load.scale,
+        .scale = inout_state->start_load.scale
+    };
+    if (start_plus_one.load > inout_state->start_load.load
+        && load_compare(&start_plus_one, &inout_state->stop_load) <= 0) {
         return;
     }
     assert(false && "TODO revamp this whole assumption!");
-    float new_start_load = inout_state->start_load - 1.0;
+    loadavgwatch_load new_start_load = inout_state->start_load;
+    if (new_start_load.load > new_start_load.scale) {
+        new_start_load.load -= new_start_load.scale;
+    } else {
+        new_start_load.load = 0;
+    }
+    char start_str[24];
+    char stop_str[24];
+    char new_start_str[24];
+    load_to_string(&inout_state->start_load, start_str, sizeof(start_str));
+    load_to_string(&inout_state->stop_load, stop_str, sizeof(stop_str));
+    load_to_string(&new_start_load, new_start_str, sizeof(new_start_str));
     PRINT_LOG_MESSAGE(
         inout_state->log_warning,
-        "Start load (%0.2f) must be at least one less than the stop "
-        "load (%0.2f). Forcing start load to be %0.2f.",
-        inout_state->start_load,
-        inout_state->stop_load,
-        new_start_load);
+        "Start load (%s) must be at least one less than the stop "
+        "load (%s). Forcing start load to be %s.",
+        start_str,
+        stop_str,
+        new_start_str);
     inout_state->start_load = new_start_load;
-    inout_state->start_load_fixed.scale = 256;
-    inout_state->start_load_fixed.load = inout_state->start_load * inout_state->start_load_fixed.scale;
+}
+
+static loadavgwatch_status check_load_set(
+    loadavgwatch_state* state,
+    const char* type,
+    const loadavgwatch_load* load,
+    loadavgwatch_load* destination)
+{
+    if (load->scale == 0) {
+        PRINT_LOG_MESSAGE(
+            state->log_error,
+            "Refusing to set %s with zero fixed point scale!",
+            type);
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    *destination = *load;
+    return LOADAVGWATCH_OK;
 }
 
 loadavgwatch_status loadavgwatch_set_log_info(
@@ -96,19 +194,53 @@ loadavgwatch_status loadavgwatch_set_log_error(
 loadavgwatch_status loadavgwatch_set_start_load(
     loadavgwatch_state* state, const loadavgwatch_load* load)
 {
-    state->start_load = (double)load->load / load->scale;
-    state->start_load_fixed = *load;
+    return check_load_set(state, "start load", load, &state->start_load);
+}
+
+loadavgwatch_status loadavgwatch_set_metric(
+    loadavgwatch_state* state, loadavgwatch_metric metric)
+{
+    if ((int)metric < LOADAVGWATCH_METRIC_LOAD_1MIN
+        || (int)metric > LOADAVGWATCH_METRIC_CPU_PRESSURE_300S) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Refusing to set unknown metric %d!", metric);
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    state->metric = metric;
+    // History of the previous metric does not apply to the new one:
+    _history_clear(&state->history);
     return LOADAVGWATCH_OK;
 }
 
+loadavgwatch_metric loadavgwatch_get_metric(const loadavgwatch_state* state)
+{
+    return state->metric;
+}
+
+loadavgwatch_status loadavgwatch_set_parameter(
+    loadavgwatch_state* state, const loadavgwatch_parameter* parameter)
+{
+    return state->impl.set_parameter(state, state->impl_state, parameter);
+}
+
 const char* loadavgwatch_get_system(const loadavgwatch_state* state)
 {
     return state->impl.get_system();
 }
 
+long loadavgwatch_get_ncpus(const loadavgwatch_state* state)
+{
+    return state->ncpus;
+}
+
+int loadavgwatch_get_event_fd(const loadavgwatch_state* state)
+{
+    return state->impl.get_event_fd(state->impl_state);
+}
+
 loadavgwatch_load loadavgwatch_get_start_load(const loadavgwatch_state* state)
 {
-    return state->start_load_fixed;
+    return state->start_load;
 }
 
 struct timespec loadavgwatch_get_start_interval(
@@ -117,6 +249,11 @@ struct timespec loadavgwatch_get_start_interval(
     return state->start_interval;
 }
 
+uint32_t loadavgwatch_get_start_burst(const loadavgwatch_state* state)
+{
+    return state->start_burst;
+}
+
 struct timespec loadavgwatch_get_quiet_period_over_start(
     const loadavgwatch_state* state)
 {
@@ -125,7 +262,7 @@ struct timespec loadavgwatch_get_quiet_period_over_start(
 
 loadavgwatch_load loadavgwatch_get_stop_load(const loadavgwatch_state* state)
 {
-    return state->stop_load_fixed;
+    return state->stop_load;
 }
 
 struct timespec loadavgwatch_get_stop_interval(
@@ -165,6 +302,18 @@ loadavgwatch_status loadavgwatch_set_start_interval(
         state, "start interval", interval, &state->start_interval);
 }
 
+loadavgwatch_status loadavgwatch_set_start_burst(
+    loadavgwatch_state* state, uint32_t burst)
+{
+    if (burst == 0) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Refusing to set zero start burst!");
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    state->start_burst = burst;
+    return LOADAVGWATCH_OK;
+}
+
 loadavgwatch_status loadavgwatch_set_quiet_period_over_start(
     loadavgwatch_state* state, const struct timespec* interval)
 {
@@ -178,9 +327,7 @@ loadavgwatch_status loadavgwatch_set_quiet_period_over_start(
 loadavgwatch_status loadavgwatch_set_stop_load(
     loadavgwatch_state* state, const loadavgwatch_load* load)
 {
-    state->stop_load = (double)load->load / load->scale;
-    state->stop_load_fixed = *load;
-    return LOADAVGWATCH_OK;
+    return check_load_set(state, "stop load", load, &state->stop_load);
 }
 
 loadavgwatch_status loadavgwatch_set_stop_interval(
@@ -200,19 +347,123 @@ loadavgwatch_status loadavgwatch_set_quiet_period_over_stop(
         &state->quiet_period_over_stop);
 }
 
+loadavgwatch_status loadavgwatch_set_prediction_horizon(
+    loadavgwatch_state* state, const struct timespec* horizon)
+{
+    return check_max_interval_set(
+        state, "prediction horizon", horizon, &state->prediction_horizon);
+}
+
+struct timespec loadavgwatch_get_prediction_horizon(
+    const loadavgwatch_state* state)
+{
+    return state->prediction_horizon;
+}
+
 /**
  * If there is a system that does not support clock_gettime(), make
  * this target implementation specific function.
  */
-static int loadavgwatch_impl_clock(struct timespec* now)
+static int loadavgwatch_impl_clock(void* impl_state, struct timespec* now)
 {
     return clock_gettime(CLOCK_MONOTONIC, now);
 }
 
-loadavgwatch_status loadavgwatch_open_logging(
+/**
+ * Load source whose time and values are given by the library user
+ * with loadavgwatch_set_virtual_sample(). This makes it possible to
+ * run the same decision logic against recorded data as fast as
+ * possible.
+ */
+typedef struct virtual_source
+{
+    struct timespec now;
+    loadavgwatch_snapshot snapshot;
+} virtual_source;
+
+static int virtual_clock(void* impl_state, struct timespec* now)
+{
+    *now = ((const virtual_source*)impl_state)->now;
+    return 0;
+}
+
+static const char* virtual_get_system(void)
+{
+    return "virtual";
+}
+
+static long virtual_get_ncpus(void)
+{
+    return -1;
+}
+
+static loadavgwatch_status virtual_open(
+    const loadavgwatch_state* state, void** out_impl_state)
+{
+    virtual_source* source = calloc(1, sizeof(virtual_source));
+    if (source == NULL) {
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    *out_impl_state = source;
+    return LOADAVGWATCH_OK;
+}
+
+static loadavgwatch_status virtual_close(void* impl_state)
+{
+    free(impl_state);
+    return LOADAVGWATCH_OK;
+}
+
+static loadavgwatch_status virtual_set_parameter(
+    const loadavgwatch_state* state,
+    void* impl_state,
+    const loadavgwatch_parameter* parameter)
+{
+    PRINT_LOG_MESSAGE(
+        state->log_error,
+        "Virtual load source does not support parameter '%s'!",
+        parameter->key);
+    return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+}
+
+static loadavgwatch_status virtual_get_load_average(
+    void* impl_state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
+{
+    *out_snapshot = ((const virtual_source*)impl_state)->snapshot;
+    return LOADAVGWATCH_OK;
+}
+
+static int virtual_get_event_fd(const void* impl_state)
+{
+    return -1;
+}
+
+static bool virtual_get_update_interval(
+    const void* impl_state, struct timespec* out_interval)
+{
+    return false;
+}
+
+static const loadavgwatch_callbacks VIRTUAL_CALLBACKS = {
+    .clock = virtual_clock,
+    .get_system = virtual_get_system,
+    .get_ncpus = virtual_get_ncpus,
+    .open = virtual_open,
+    .close = virtual_close,
+    .set_parameter = virtual_set_parameter,
+    .get_load_average = virtual_get_load_average,
+    .get_event_fd = virtual_get_event_fd,
+    .get_update_interval = virtual_get_update_interval,
+};
+
+static loadavgwatch_status open_with_callbacks(
     loadavgwatch_state** out_state,
     loadavgwatch_log_object* log_warning,
-    loadavgwatch_log_object* log_error)
+    loadavgwatch_log_object* log_error,
+    const loadavgwatch_callbacks* callbacks,
+    long ncpus)
 {
     *out_state = NULL;
     loadavgwatch_state* state = calloc(1, sizeof(loadavgwatch_state));
@@ -246,45 +497,48 @@ loadavgwatch_status loadavgwatch_open_logging(
         .tv_sec = 2 * 60,
         .tv_nsec = 0
     };
+    state->start_burst = 1;
 
-    // Defaults that mainly tests should be interested in overwriting:
-    state->impl.clock = loadavgwatch_impl_clock;
-    state->impl.get_system = loadavgwatch_impl_get_system;
-    state->impl.get_ncpus = loadavgwatch_impl_get_ncpus;
-    state->impl.open = loadavgwatch_impl_open;
-    state->impl.close = loadavgwatch_impl_close;
-    state->impl.get_load_average = loadavgwatch_impl_get_load_average;
-
-    long ncpus = state->impl.get_ncpus();
+    state->impl = *callbacks;
+    state->ncpus = ncpus;
+
+    // Default load limits are in hundredths, as that is the
+    // precision that the load average is usually displayed in:
+    state->start_load.scale = 100;
     if (ncpus > 0) {
-        state->start_load = (float)(ncpus - 1) + 0.02;
+        state->start_load.load = (uint32_t)(ncpus - 1) * 100 + 2;
     } else {
-        state->start_load = 0.02;
+        state->start_load.load = 2;
         PRINT_LOG_MESSAGE(
             state->log_warning,
             "Could not detect the number of CPUs. "
             "Using the default start load value for 1 CPU! "
             "Please set load limits manually!");
     }
-    state->start_load_fixed.scale = 256;
-    state->start_load_fixed.load = state->start_load * state->start_load_fixed.scale;
 
+    state->stop_load.scale = 100;
     if (ncpus > 0) {
-        state->stop_load = (float)(ncpus) + 0.12;
+        state->stop_load.load = (uint32_t)ncpus * 100 + 12;
     } else {
-        state->stop_load = 1.12;
+        state->stop_load.load = 112;
         PRINT_LOG_MESSAGE(
             state->log_warning,
             "Could not detect the number of CPUs. "
             "Using the default stop load value for 1 CPU! "
             "Please set load limits manually!");
     }
-    state->stop_load_fixed.scale = 256;
-    state->stop_load_fixed.load = state->stop_load * state->stop_load_fixed.scale;
+
+    if (!_history_allocate(
+            &state->history, LOADAVGWATCH_DEFAULT_HISTORY_CAPACITY)) {
+        free(state);
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
 
     void* impl_state = NULL;
     loadavgwatch_status impl_open_result = state->impl.open(state, &impl_state);
     if (impl_open_result != LOADAVGWATCH_OK) {
+        _history_free(&state->history);
+        free(state);
         return impl_open_result;
     }
     state->impl_state = impl_state;
@@ -293,6 +547,54 @@ loadavgwatch_status loadavgwatch_open_logging(
     return LOADAVGWATCH_OK;
 }
 
+loadavgwatch_status loadavgwatch_open_logging(
+    loadavgwatch_state** out_state,
+    loadavgwatch_log_object* log_warning,
+    loadavgwatch_log_object* log_error)
+{
+    // Defaults that mainly tests should be interested in overwriting:
+    const loadavgwatch_callbacks callbacks = {
+        .clock = loadavgwatch_impl_clock,
+        .get_system = loadavgwatch_impl_get_system,
+        .get_ncpus = loadavgwatch_impl_get_ncpus,
+        .open = loadavgwatch_impl_open,
+        .close = loadavgwatch_impl_close,
+        .set_parameter = loadavgwatch_impl_set_parameter,
+        .get_load_average = loadavgwatch_impl_get_load_average,
+        .get_event_fd = loadavgwatch_impl_get_event_fd,
+        .get_update_interval = loadavgwatch_impl_get_update_interval,
+    };
+    return open_with_callbacks(
+        out_state, log_warning, log_error, &callbacks, callbacks.get_ncpus());
+}
+
+loadavgwatch_status loadavgwatch_open_virtual(
+    loadavgwatch_state** out_state,
+    loadavgwatch_log_object* log_warning,
+    loadavgwatch_log_object* log_error,
+    long ncpus)
+{
+    return open_with_callbacks(
+        out_state, log_warning, log_error, &VIRTUAL_CALLBACKS, ncpus);
+}
+
+loadavgwatch_status loadavgwatch_set_virtual_sample(
+    loadavgwatch_state* state,
+    const struct timespec* now,
+    const loadavgwatch_snapshot* snapshot)
+{
+    if (state->impl.open != virtual_open) {
+        PRINT_LOG_MESSAGE(
+            state->log_error,
+            "Samples can only be given to a virtual load source!");
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    virtual_source* source = (virtual_source*)state->impl_state;
+    source->now = *now;
+    source->snapshot = *snapshot;
+    return LOADAVGWATCH_OK;
+}
+
 loadavgwatch_status loadavgwatch_open(loadavgwatch_state** out_state)
 {
     return loadavgwatch_open_logging(
@@ -305,12 +607,29 @@ loadavgwatch_status loadavgwatch_close(loadavgwatch_state** state)
         return LOADAVGWATCH_OK;
     }
     (*state)->impl.close((*state)->impl_state);
+    _history_free(&(*state)->history);
+    loadavgwatch_shm_close(&(*state)->shm);
+    loadavgwatch_group_close(&(*state)->group);
     memset((*state), 0, sizeof(loadavgwatch_state));
     free(*state);
     *state = NULL;
     return LOADAVGWATCH_OK;
 }
 
+loadavgwatch_status loadavgwatch_reset(loadavgwatch_state* state)
+{
+    assert(state != NULL && "Used uninitialized library!");
+    state->last_start_time = (struct timespec){0, 0};
+    state->last_stop_time = (struct timespec){0, 0};
+    state->start_bucket_empty_ns = 0;
+    state->last_over_start_load = (struct timespec){0, 0};
+    state->last_over_stop_load = (struct timespec){0, 0};
+    _history_clear(&state->history);
+    _phase_reset(&state->phase, 0);
+    state->has_polled = false;
+    return LOADAVGWATCH_OK;
+}
+
 
 static bool time_less_than(
     const struct timespec* left, const struct timespec* right)
@@ -348,8 +667,228 @@ static struct timespec time_difference(
     return result;
 }
 
+/**
+ * Picks the value that limits are compared against from the snapshot.
+ */
+static bool snapshot_metric_value(
+    const loadavgwatch_snapshot* snapshot,
+    loadavgwatch_metric metric,
+    loadavgwatch_load* out_value)
+{
+    switch (metric) {
+    case LOADAVGWATCH_METRIC_LOAD_1MIN:
+    case LOADAVGWATCH_METRIC_LOAD_5MIN:
+    case LOADAVGWATCH_METRIC_LOAD_15MIN:
+        if (!(snapshot->fields & LOADAVGWATCH_SNAPSHOT_LOAD)) {
+            return false;
+        }
+        *out_value = snapshot->load[metric];
+        return true;
+    case LOADAVGWATCH_METRIC_RUNNING_TASKS:
+        if (!(snapshot->fields & LOADAVGWATCH_SNAPSHOT_RUNNING_TASKS)) {
+            return false;
+        }
+        out_value->load = snapshot->running_tasks;
+        out_value->scale = 1;
+        return true;
+    case LOADAVGWATCH_METRIC_CPU_PRESSURE_10S:
+    case LOADAVGWATCH_METRIC_CPU_PRESSURE_60S:
+    case LOADAVGWATCH_METRIC_CPU_PRESSURE_300S:
+        if (!(snapshot->fields & LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE)) {
+            return false;
+        }
+        *out_value = snapshot->cpu_pressure[
+            metric - LOADAVGWATCH_METRIC_CPU_PRESSURE_10S];
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Extrapolates the current value along the least squares slope of the
+ * latest samples.
+ *
+ * Times are in milliseconds relative to the current poll, so the sums
+ * fit into 64 bits even for loads in thousands and samples that are
+ * days apart.
+ */
+static loadavgwatch_load trend_predict(
+    const loadavgwatch_state* state,
+    const struct timespec* now,
+    const loadavgwatch_load* current)
+{
+    const loadavgwatch_history* history = &state->history;
+    size_t samples = history->count < LOADAVGWATCH_TREND_SAMPLES
+        ? history->count : LOADAVGWATCH_TREND_SAMPLES;
+    if (samples < 2) {
+        return *current;
+    }
+    int64_t now_ns = _history_timespec_ns(now);
+    int64_t n = (int64_t)samples;
+    int64_t sum_x = 0;
+    int64_t sum_y = 0;
+    int64_t sum_xx = 0;
+    int64_t sum_xy = 0;
+    for (size_t age = 0; age < samples; ++age) {
+        size_t index = _history_index(history, age);
+        int64_t x = (history->time_ns[index] - now_ns) / 1000000;
+        int64_t y = (int64_t)history->value[index];
+        sum_x += x;
+        sum_y += y;
+        sum_xx += x * x;
+        sum_xy += x * y;
+    }
+    int64_t denominator = n * sum_xx - sum_x * sum_x;
+    if (denominator <= 0) {
+        return *current;
+    }
+    int64_t horizon_ms = (int64_t)state->prediction_horizon.tv_sec * 1000
+        + state->prediction_horizon.tv_nsec / 1000000;
+    // Slope is multiplied with the horizon in whole and fractional
+    // parts. Precision of the fractional part is reduced only as much
+    // as needed to keep it from overflowing:
+    int64_t numerator = n * sum_xy - sum_x * sum_y;
+    int64_t whole = numerator / denominator;
+    int64_t remainder = numerator % denominator;
+    while (horizon_ms > 0
+           && (remainder > INT64_MAX / horizon_ms
+               || remainder < -(INT64_MAX / horizon_ms))) {
+        remainder /= 2;
+        denominator /= 2;
+    }
+    int64_t change = whole * horizon_ms + remainder * horizon_ms / denominator;
+    int64_t predicted = ((int64_t)current->load << HISTORY_SHIFT)
+        / current->scale + change;
+    if (predicted < 0) {
+        predicted = 0;
+    }
+    if (predicted > (int64_t)UINT32_MAX) {
+        predicted = UINT32_MAX;
+    }
+    return (loadavgwatch_load){
+        .load = (uint32_t)predicted,
+        .scale = 1 << HISTORY_SHIFT
+    };
+}
+
+/**
+ * Returns the update interval of the compared metric in nanoseconds,
+ * or zero if the source calculates its values on every read or the
+ * metric is not a load average.
+ */
+static int64_t compared_update_interval_ns(const loadavgwatch_state* state)
+{
+    if ((int)state->metric > LOADAVGWATCH_METRIC_LOAD_15MIN) {
+        return 0;
+    }
+    struct timespec interval;
+    if (!state->impl.get_update_interval(state->impl_state, &interval)) {
+        return 0;
+    }
+    return _history_timespec_ns(&interval);
+}
+
+static void observe_update_phase(
+    loadavgwatch_state* state,
+    const struct timespec* now,
+    const loadavgwatch_snapshot* snapshot)
+{
+    int64_t interval_ns = compared_update_interval_ns(state);
+    // Phase of another source or metric does not apply:
+    if (interval_ns != state->phase.source_interval_ns) {
+        _phase_reset(&state->phase, interval_ns);
+    }
+    if (interval_ns == 0 || !(snapshot->fields & LOADAVGWATCH_SNAPSHOT_LOAD)) {
+        return;
+    }
+    _phase_observe(&state->phase, _history_timespec_ns(now), snapshot->load);
+}
+
+static struct timespec timespec_from_ns(int64_t value_ns)
+{
+    return (struct timespec){
+        .tv_sec = value_ns / 1000000000,
+        .tv_nsec = value_ns % 1000000000
+    };
+}
+
+static int64_t quiet_period_end_ns(
+    const struct timespec* last_over, const struct timespec* quiet_period)
+{
+    if (last_over->tv_sec == 0 && last_over->tv_nsec == 0) {
+        return 0;
+    }
+    return _history_timespec_ns(last_over) + _history_timespec_ns(quiet_period);
+}
+
+/**
+ * Updates the shared status with the values and decisions of a poll.
+ */
+static void publish_poll(
+    loadavgwatch_state* state,
+    const struct timespec* now,
+    const loadavgwatch_load* value,
+    const loadavgwatch_poll_result* result)
+{
+    int64_t quiet_start_ns = quiet_period_end_ns(
+        &state->last_over_start_load, &state->quiet_period_over_start);
+    int64_t quiet_stop_ns = quiet_period_end_ns(
+        &state->last_over_stop_load, &state->quiet_period_over_stop);
+    loadavgwatch_shared_status* status = loadavgwatch_shm_begin_update(
+        state->shm);
+    status->metric = state->metric;
+    ++status->polls;
+    status->poll_time_ns = _history_timespec_ns(now);
+    status->quiet_until_ns = quiet_start_ns > quiet_stop_ns
+        ? quiet_start_ns : quiet_stop_ns;
+    status->snapshot = state->last_polled;
+    status->value = *value;
+    status->start_load = state->start_load;
+    status->stop_load = state->stop_load;
+    status->result = *result;
+    loadavgwatch_shm_end_update(state->shm);
+}
+
+/**
+ * Checks that a start fits in the start token bucket. The bucket gains
+ * a token every start interval after it was empty. With the burst of
+ * 1 this is the plain start interval since the last start.
+ */
+static bool start_bucket_has_token(
+    const loadavgwatch_state* state, const struct timespec* now)
+{
+    return _history_timespec_ns(now) - state->start_bucket_empty_ns
+        > _history_timespec_ns(&state->start_interval);
+}
+
+/**
+ * Takes a token from the start token bucket. The bucket holds at most
+ * a burst of tokens, and starts that are registered without a token
+ * leave it empty instead of borrowing from the future.
+ */
+static void start_bucket_take(
+    loadavgwatch_state* state, const struct timespec* now)
+{
+    int64_t now_ns = _history_timespec_ns(now);
+    int64_t interval_ns = _history_timespec_ns(&state->start_interval);
+    int64_t full_ns = now_ns - (int64_t)state->start_burst * interval_ns;
+    int64_t empty_ns = state->start_bucket_empty_ns > full_ns
+        ? state->start_bucket_empty_ns : full_ns;
+    empty_ns += interval_ns;
+    state->start_bucket_empty_ns = empty_ns < now_ns ? empty_ns : now_ns;
+}
+
 loadavgwatch_status loadavgwatch_poll(
     loadavgwatch_state* state, loadavgwatch_poll_result* out_result)
+{
+    loadavgwatch_snapshot snapshot;
+    return loadavgwatch_poll_snapshot(state, out_result, &snapshot);
+}
+
+loadavgwatch_status loadavgwatch_poll_snapshot(
+    loadavgwatch_state* state,
+    loadavgwatch_poll_result* out_result,
+    loadavgwatch_snapshot* out_snapshot)
 {
     assert(state != NULL && "Used uninitialized library!");
     adjust_start_stop_loads(state);
@@ -358,30 +897,64 @@ loadavgwatch_status loadavgwatch_poll(
     loadavgwatch_poll_result result = {
         .start_count = 0,
         .stop_count = 0,
+        .fresh = 0,
     };
 
-    float load_average;
+    // Poll time is read first so that load sources that calculate
+    // their own averages get the same time as the limit checks:
+    struct timespec now;
+    if (state->impl.clock(state->impl_state, &now) != 0) {
+        PRINT_LOG_MESSAGE(
+            state->log_warning, "Unable to read current poll time!");
+        *out_result = result;
+        return LOADAVGWATCH_ERR_CLOCK;
+    }
+    loadavgwatch_snapshot snapshot = {0};
     loadavgwatch_status read_status = state->impl.get_load_average(
-        state->impl_state, &load_average);
+        state->impl_state, &now, &snapshot);
     if (read_status != LOADAVGWATCH_OK) {
         PRINT_LOG_MESSAGE(
             state->log_warning, "Unable to read the current load average!");
         *out_result = result;
         return read_status;
     }
-    struct timespec now;
-    if (state->impl.clock(&now) != 0) {
+    *out_snapshot = snapshot;
+    observe_update_phase(state, &now, &snapshot);
+    result.fresh = !state->has_polled
+        || memcmp(state->last_polled.load, snapshot.load, sizeof(snapshot.load))
+        || memcmp(
+            state->last_polled.cpu_pressure,
+            snapshot.cpu_pressure,
+            sizeof(snapshot.cpu_pressure));
+    state->has_polled = true;
+    state->last_poll_fresh = result.fresh;
+    state->last_polled = snapshot;
+    loadavgwatch_load load_average;
+    if (!snapshot_metric_value(&snapshot, state->metric, &load_average)) {
         PRINT_LOG_MESSAGE(
-            state->log_warning, "Unable to read current poll time!");
+            state->log_warning,
+            "Load source does not provide the value for %s!",
+            METRIC_NAMES[state->metric]);
         *out_result = result;
-        return LOADAVGWATCH_ERR_CLOCK;
+        return LOADAVGWATCH_ERR_READ;
+    }
+    if (load_average.scale == 0) {
+        PRINT_LOG_MESSAGE(
+            state->log_warning, "Load average has zero fixed point scale!");
+        *out_result = result;
+        return LOADAVGWATCH_ERR_PARSE;
+    }
+
+    loadavgwatch_load current_value = load_average;
+    bool predicting = state->prediction_horizon.tv_sec != 0
+        || state->prediction_horizon.tv_nsec != 0;
+    _history_add(&state->history, &now, &current_value);
+    if (predicting) {
+        load_average = trend_predict(state, &now, &current_value);
     }
 
-    if (load_average < state->start_load) {
-        struct timespec start_difference = time_difference(
-            &now, &state->last_start_time);
-        bool start_not_too_often = time_less_than(
-            &state->start_interval, &start_difference);
+    if (load_compare(&load_average, &state->start_load) < 0) {
+        bool start_not_too_often = start_bucket_has_token(state, &now);
         struct timespec quiet_difference_start = time_difference(
             &now, &state->last_over_start_load);
         bool start_not_in_over_start_quiet_period = time_less_than(
@@ -390,54 +963,309 @@ loadavgwatch_status loadavgwatch_poll(
             &now, &state->last_over_stop_load);
         bool start_not_in_over_stop_quiet_period = time_less_than(
             &state->quiet_period_over_stop, &quiet_difference_stop);
+        // Group is asked last, as claiming counts as a start of the
+        // group:
         if (start_not_too_often
             && start_not_in_over_start_quiet_period
-            && start_not_in_over_stop_quiet_period) {
-            result.start_count = (uint32_t)(state->start_load - load_average) + 1;
+            && start_not_in_over_stop_quiet_period
+            && (state->group == NULL
+                || loadavgwatch_group_claim_start(
+                    state->group,
+                    _history_timespec_ns(&now),
+                    _history_timespec_ns(&state->start_interval)))) {
+            result.start_count = load_difference_count(
+                &state->start_load, &load_average);
         }
     } else {
         state->last_over_start_load = now;
     }
 
-    if (load_average > state->stop_load) {
+    if (load_compare(&load_average, &state->stop_load) > 0) {
         struct timespec stop_difference = time_difference(
             &now, &state->last_stop_time);
         bool stop_not_too_often = time_less_than(
             &state->stop_interval, &stop_difference);
         if (stop_not_too_often) {
-            result.stop_count = (uint32_t)(load_average - state->stop_load) + 1;
+            result.stop_count = load_difference_count(
+                &load_average, &state->stop_load);
         }
         state->last_over_stop_load = now;
     }
 
-    PRINT_LOG_MESSAGE(
-        state->log_info,
-        "Load average: %0.2f, start %u, stop %u.",
-        load_average,
-        result.start_count,
-        result.stop_count);
     *out_result = result;
+    if (state->shm != NULL) {
+        publish_poll(state, &now, &load_average, &result);
+    }
+    // Formatting the poll summary costs more than the decisions, which
+    // matters when simulating many configurations:
+    if (state->log_info->log == log_null) {
+        return LOADAVGWATCH_OK;
+    }
+    char load_str[24];
+    load_to_string(&current_value, load_str, sizeof(load_str));
+    if (predicting) {
+        char predicted_str[24];
+        load_to_string(&load_average, predicted_str, sizeof(predicted_str));
+        PRINT_LOG_MESSAGE(
+            state->log_info,
+            "%s: %s, predicted %s, start %u, stop %u.",
+            METRIC_NAMES[state->metric],
+            load_str,
+            predicted_str,
+            result.start_count,
+            result.stop_count);
+    } else {
+        PRINT_LOG_MESSAGE(
+            state->log_info,
+            "%s: %s, start %u, stop %u.",
+            METRIC_NAMES[state->metric],
+            load_str,
+            result.start_count,
+            result.stop_count);
+    }
+    return LOADAVGWATCH_OK;
+}
+
+loadavgwatch_status loadavgwatch_set_history_capacity(
+    loadavgwatch_state* state, size_t capacity)
+{
+    if (capacity == 0 || capacity > SIZE_MAX / (3 * sizeof(uint64_t))) {
+        PRINT_LOG_MESSAGE(
+            state->log_error,
+            "Refusing to set history capacity of %zu samples!",
+            capacity);
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    if (!_history_resize(&state->history, capacity)) {
+        return LOADAVGWATCH_ERR_OUT_OF_MEMORY;
+    }
+    return LOADAVGWATCH_OK;
+}
+
+size_t loadavgwatch_get_history_capacity(const loadavgwatch_state* state)
+{
+    return state->history.capacity;
+}
+
+loadavgwatch_status loadavgwatch_history_summarize(
+    const loadavgwatch_state* state,
+    const struct timespec* window,
+    loadavgwatch_history_summary* out_summary)
+{
+    memset(out_summary, 0, sizeof(*out_summary));
+    struct timespec now;
+    if (state->impl.clock(state->impl_state, &now) != 0) {
+        return LOADAVGWATCH_ERR_CLOCK;
+    }
+    const loadavgwatch_history* history = &state->history;
+    size_t count = _history_window_count(history, &now, window);
+    if (count == 0) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    uint64_t sum = 0;
+    for (size_t age = 0; age < count; ++age) {
+        uint64_t value = history->value[_history_index(history, age)];
+        min = value < min ? value : min;
+        max = value > max ? value : max;
+        sum += value;
+    }
+    out_summary->samples = (uint32_t)count;
+    out_summary->min = _history_to_load(min);
+    out_summary->max = _history_to_load(max);
+    out_summary->mean = _history_to_load((sum + count / 2) / count);
+    return LOADAVGWATCH_OK;
+}
+
+loadavgwatch_status loadavgwatch_history_percentile(
+    loadavgwatch_state* state,
+    const struct timespec* window,
+    uint32_t percentile,
+    loadavgwatch_load* out_value)
+{
+    if (percentile > 100) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Percentile %u is over 100!", percentile);
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    struct timespec now;
+    if (state->impl.clock(state->impl_state, &now) != 0) {
+        return LOADAVGWATCH_ERR_CLOCK;
+    }
+    loadavgwatch_history* history = &state->history;
+    size_t count = _history_window_count(history, &now, window);
+    if (count == 0) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    for (size_t age = 0; age < count; ++age) {
+        history->scratch[age] = history->value[_history_index(history, age)];
+    }
+    // Nearest rank: the smallest value that has at least the given
+    // percentage of values at or below it:
+    size_t rank = ((uint64_t)percentile * count + 99) / 100;
+    size_t k = rank > 0 ? rank - 1 : 0;
+    *out_value = _history_to_load(_history_select(history->scratch, count, k));
+    return LOADAVGWATCH_OK;
+}
+
+/**
+ * Tells if the values from first to last come within band of the
+ * limit.
+ */
+static bool values_reach_limit(
+    uint64_t first, uint64_t last, uint64_t limit, uint64_t band)
+{
+    uint64_t low = first < last ? first : last;
+    uint64_t high = first < last ? last : first;
+    return low <= limit + band && (limit < band || high >= limit - band);
+}
+
+loadavgwatch_status loadavgwatch_suggest_poll_interval(
+    const loadavgwatch_state* state,
+    const loadavgwatch_load* band,
+    const struct timespec* min_interval,
+    const struct timespec* max_interval,
+    struct timespec* out_interval)
+{
+    assert(state != NULL && "Used uninitialized library!");
+    *out_interval = *min_interval;
+    if (band->scale == 0 || time_less_than(max_interval, min_interval)) {
+        PRINT_LOG_MESSAGE(
+            state->log_error, "Refusing to suggest from invalid limits!");
+        return LOADAVGWATCH_ERR_INVALID_PARAMETER;
+    }
+    const loadavgwatch_history* history = &state->history;
+    if (history->count < 2) {
+        return LOADAVGWATCH_OK;
+    }
+    size_t newest = _history_index(history, 0);
+    size_t previous = _history_index(history, 1);
+    int64_t gap_ns = history->time_ns[newest] - history->time_ns[previous];
+    int64_t min_ns = _history_timespec_ns(min_interval);
+    int64_t max_ns = _history_timespec_ns(max_interval);
+    int64_t interval_ns = gap_ns > max_ns / 2 ? max_ns : 2 * gap_ns;
+    if (interval_ns <= min_ns || gap_ns <= 0) {
+        return LOADAVGWATCH_OK;
+    }
+
+    // Value is extrapolated over the whole next interval so that fast
+    // changes far from the limits also shorten the interval:
+    uint64_t value = history->value[newest];
+    double change = ((double)value - (double)history->value[previous])
+        * interval_ns / gap_ns;
+    double extrapolated = (double)value + change;
+    uint64_t reached = extrapolated < 0.0 ? 0
+        : extrapolated >= (double)UINT64_MAX / 2 ? UINT64_MAX / 2
+        : (uint64_t)extrapolated;
+    uint64_t band_value = _history_from_load(band);
+    if (values_reach_limit(
+            value, reached, _history_from_load(&state->start_load), band_value)
+        || values_reach_limit(
+            value, reached, _history_from_load(&state->stop_load), band_value)) {
+        return LOADAVGWATCH_OK;
+    }
+    out_interval->tv_sec = interval_ns / 1000000000;
+    out_interval->tv_nsec = interval_ns % 1000000000;
+    return LOADAVGWATCH_OK;
+}
+
+loadavgwatch_status loadavgwatch_align_poll_time(
+    const loadavgwatch_state* state,
+    const struct timespec* poll_at,
+    struct timespec* out_poll_at)
+{
+    assert(state != NULL && "Used uninitialized library!");
+    *out_poll_at = *poll_at;
+    const loadavgwatch_phase* phase = &state->phase;
+    if (phase->source_interval_ns == 0
+        || phase->source_interval_ns != compared_update_interval_ns(state)
+        || !phase->has_update) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    int64_t previous_ns = INT64_MIN;
+    if (state->history.count > 0) {
+        previous_ns = state->history.time_ns[_history_index(&state->history, 0)];
+    }
+    *out_poll_at = timespec_from_ns(
+        _phase_align(phase, _history_timespec_ns(poll_at), previous_ns));
+    return LOADAVGWATCH_OK;
+}
+
+loadavgwatch_status loadavgwatch_get_probe_time(
+    const loadavgwatch_state* state,
+    const struct timespec* poll_at,
+    struct timespec* out_probe_at)
+{
+    assert(state != NULL && "Used uninitialized library!");
+    const loadavgwatch_phase* phase = &state->phase;
+    int64_t probe_ns;
+    // Values that do not change can not tell when they are updated:
+    if (!state->last_poll_fresh
+        || phase->source_interval_ns == 0
+        || phase->source_interval_ns != compared_update_interval_ns(state)
+        || !_phase_probe_time(phase, _history_timespec_ns(poll_at), &probe_ns)) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    *out_probe_at = timespec_from_ns(probe_ns);
+    return LOADAVGWATCH_OK;
+}
+
+loadavgwatch_status loadavgwatch_probe(loadavgwatch_state* state)
+{
+    assert(state != NULL && "Used uninitialized library!");
+    // Sources that calculate averages on each read would also change
+    // their state, so only sources with an update cadence are read:
+    if (compared_update_interval_ns(state) == 0) {
+        return LOADAVGWATCH_ERR_READ;
+    }
+    struct timespec now;
+    if (state->impl.clock(state->impl_state, &now) != 0) {
+        return LOADAVGWATCH_ERR_CLOCK;
+    }
+    loadavgwatch_snapshot snapshot = {0};
+    loadavgwatch_status read_status = state->impl.get_load_average(
+        state->impl_state, &now, &snapshot);
+    if (read_status != LOADAVGWATCH_OK) {
+        return read_status;
+    }
+    observe_update_phase(state, &now, &snapshot);
     return LOADAVGWATCH_OK;
 }
 
 loadavgwatch_status loadavgwatch_register_start(loadavgwatch_state* state)
 {
     assert(state != NULL && "Used uninitialized library!");
-    if (state->impl.clock(&state->last_start_time) != 0) {
+    if (state->impl.clock(state->impl_state, &state->last_start_time) != 0) {
         PRINT_LOG_MESSAGE(
             state->log_warning, "Unable to register command start time!");
         return LOADAVGWATCH_ERR_CLOCK;
     }
+    start_bucket_take(state, &state->last_start_time);
+    if (state->shm != NULL) {
+        loadavgwatch_shm_begin_update(state->shm)->last_start_time_ns =
+            _history_timespec_ns(&state->last_start_time);
+        loadavgwatch_shm_end_update(state->shm);
+    }
+    if (state->group != NULL) {
+        loadavgwatch_group_register_start(
+            state->group, _history_timespec_ns(&state->last_start_time));
+    }
     return LOADAVGWATCH_OK;
 }
 
 loadavgwatch_status loadavgwatch_register_stop(loadavgwatch_state* state)
 {
     assert(state != NULL && "Used uninitialized library!");
-    if (state->impl.clock(&state->last_stop_time) != 0) {
+    if (state->impl.clock(state->impl_state, &state->last_stop_time) != 0) {
         PRINT_LOG_MESSAGE(
             state->log_warning, "Unable to register command stop time!");
         return LOADAVGWATCH_ERR_CLOCK;
     }
+    if (state->shm != NULL) {
+        loadavgwatch_shm_begin_update(state->shm)->last_stop_time_ns =
+            _history_timespec_ns(&state->last_stop_time);
+        loadavgwatch_shm_end_update(state->shm);
+    }
     return LOADAVGWATCH_OK;
 }
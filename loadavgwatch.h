@@ -23,6 +23,7 @@
 extern "C" {
 #endif // #ifdef __cplusplus
 
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -39,6 +40,30 @@ typedef enum loadavgwatch_status
 
 typedef struct _loadavgwatch_state loadavgwatch_state;
 
+/**
+ * Generic parameter that is passed to the system specific load
+ * source. Known keys and their value types are:
+ *
+ * "source" (const char*): name of the load source to use. On Linux
+ *     this is one of "loadavg" (default), "sysinfo", "stat", "cgroup"
+ *     or "psi". "stat" samples the number of active tasks from
+ *     /proc/stat on every poll and calculates its own load averages
+ *     from them. "cgroup" does the same for the cgroup v2 of the
+ *     process based on the CPU time that the cgroup has used and
+ *     waited for. "psi" adds CPU pressure stall information to the values
+ *     from /proc/loadavg and registers a trigger that makes
+ *     loadavgwatch_get_event_fd() readable when the CPU pressure
+ *     rises. Without a trigger pressure values are still read on
+ *     every poll. "psi" falls back to "loadavg" if the kernel does not
+ *     support pressure stall information.
+ * "stat-time-constants" (const struct timespec[3]): time constants
+ *     of the load averages that the "stat" and "cgroup" sources
+ *     calculate. These
+ *     default to 1, 5 and 15 minutes.
+ * "psi-trigger" (const char*): trigger that the "psi" source writes
+ *     to /proc/pressure/cpu. This defaults to "some 150000 1000000"
+ *     for 150 milliseconds of CPU stall in 1 second.
+ */
 typedef struct loadavgwatch_parameter
 {
     const char* key;
@@ -51,12 +76,147 @@ typedef struct loadavgwatch_load
     uint32_t scale;
 } loadavgwatch_load;
 
+/**
+ * Bits in loadavgwatch_snapshot.fields that tell which values the
+ * load source was able to provide.
+ */
+typedef enum loadavgwatch_snapshot_field
+{
+    LOADAVGWATCH_SNAPSHOT_LOAD = 1 << 0,
+    LOADAVGWATCH_SNAPSHOT_RUNNING_TASKS = 1 << 1,
+    LOADAVGWATCH_SNAPSHOT_TOTAL_TASKS = 1 << 2,
+    LOADAVGWATCH_SNAPSHOT_LAST_PID = 1 << 3,
+    LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE = 1 << 4
+} loadavgwatch_snapshot_field;
+
+/**
+ * All values that were read from the load source in one poll.
+ *
+ * load has the 1, 5 and 15 minute load averages. running_tasks is
+ * the number of currently runnable tasks. On Linux this includes the
+ * process that does the polling. cpu_pressure has the percentages of
+ * time in the last 10, 60 and 300 seconds when some tasks were
+ * waiting for a CPU.
+ */
+typedef struct loadavgwatch_snapshot
+{
+    uint32_t fields;
+    loadavgwatch_load load[3];
+    uint32_t running_tasks;
+    uint32_t total_tasks;
+    uint32_t last_pid;
+    loadavgwatch_load cpu_pressure[3];
+} loadavgwatch_snapshot;
+
+/**
+ * Value in loadavgwatch_snapshot that start and stop loads are
+ * compared against.
+ */
+typedef enum loadavgwatch_metric
+{
+    LOADAVGWATCH_METRIC_LOAD_1MIN = 0,
+    LOADAVGWATCH_METRIC_LOAD_5MIN = 1,
+    LOADAVGWATCH_METRIC_LOAD_15MIN = 2,
+    LOADAVGWATCH_METRIC_RUNNING_TASKS = 3,
+    LOADAVGWATCH_METRIC_CPU_PRESSURE_10S = 4,
+    LOADAVGWATCH_METRIC_CPU_PRESSURE_60S = 5,
+    LOADAVGWATCH_METRIC_CPU_PRESSURE_300S = 6
+} loadavgwatch_metric;
+
+/**
+ * Statistics of the compared metric over the polls in a time window.
+ */
+typedef struct loadavgwatch_history_summary
+{
+    uint32_t samples;
+    loadavgwatch_load min;
+    loadavgwatch_load max;
+    loadavgwatch_load mean;
+} loadavgwatch_history_summary;
+
 typedef struct loadavgwatch_poll_result
 {
     uint32_t start_count;
     uint32_t stop_count;
+    // Non-zero when the load values differ from the previous poll.
+    // Sources that update their values on a fixed cadence return the
+    // same values until their next update:
+    uint32_t fresh;
 } loadavgwatch_poll_result;
 
+/**
+ * Load trace file consists of this header that is followed by
+ * record_count records. All values are in the native byte order of
+ * the machine that recorded the trace.
+ */
+#define LOADAVGWATCH_TRACE_MAGIC "LAWTRACE"
+#define LOADAVGWATCH_TRACE_VERSION 1
+
+typedef struct loadavgwatch_trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t record_count;
+    uint32_t ncpus;
+    uint32_t reserved;
+} loadavgwatch_trace_header;
+
+/**
+ * One polled snapshot in a load trace. time_ns is the monotonic poll
+ * time. Load averages share load_scale and CPU pressures share
+ * pressure_scale. fields tells which values are valid like in
+ * loadavgwatch_snapshot. start_count and stop_count are the decisions
+ * of the recorded poll.
+ */
+typedef struct loadavgwatch_trace_record
+{
+    int64_t time_ns;
+    uint32_t fields;
+    uint32_t load_scale;
+    uint32_t load[3];
+    uint32_t running_tasks;
+    uint32_t pressure_scale;
+    uint32_t cpu_pressure[3];
+    uint32_t start_count;
+    uint32_t stop_count;
+} loadavgwatch_trace_record;
+
+typedef struct _loadavgwatch_trace loadavgwatch_trace;
+typedef struct _loadavgwatch_recorder loadavgwatch_recorder;
+
+#define LOADAVGWATCH_SHARED_STATUS_VERSION 1
+
+/**
+ * View of a state that it publishes in shared memory for other
+ * processes. Times are CLOCK_MONOTONIC nanoseconds of the publisher
+ * and zero until there has been such an event. value is the compared
+ * metric value, predicted if prediction is on.
+ */
+typedef struct loadavgwatch_shared_status
+{
+    uint32_t version;
+    uint32_t metric;
+    uint64_t polls;
+    int64_t poll_time_ns;
+    int64_t last_start_time_ns;
+    int64_t last_stop_time_ns;
+    // Quiet periods hold back start decisions until this time:
+    int64_t quiet_until_ns;
+    loadavgwatch_snapshot snapshot;
+    loadavgwatch_load value;
+    loadavgwatch_load start_load;
+    loadavgwatch_load stop_load;
+    loadavgwatch_poll_result result;
+} loadavgwatch_shared_status;
+
+typedef struct _loadavgwatch_status_reader loadavgwatch_status_reader;
+
+typedef void(*loadavgwatch_replay_callback)(
+    const loadavgwatch_trace_record* record,
+    const loadavgwatch_poll_result* result,
+    void* data);
+
 typedef struct loadavgwatch_log_object
 {
     void(*log)(const char* message, void* data);
@@ -68,6 +228,26 @@ loadavgwatch_status loadavgwatch_open_logging(
     loadavgwatch_state** out_state,
     loadavgwatch_log_object* log_warning,
     loadavgwatch_log_object* log_error);
+/**
+ * Opens a state whose load source does not read the system. Time and
+ * load values for each loadavgwatch_poll() call are given with
+ * loadavgwatch_set_virtual_sample(), so recorded load data can be
+ * replayed through the same decision logic much faster than real
+ * time. Default start and stop loads are based on ncpus.
+ */
+loadavgwatch_status loadavgwatch_open_virtual(
+    loadavgwatch_state** out_state,
+    loadavgwatch_log_object* log_warning,
+    loadavgwatch_log_object* log_error,
+    long ncpus);
+/**
+ * Sets the monotonic time and load values that the next polls of a
+ * virtual state see. Start and stop registrations use the same time.
+ */
+loadavgwatch_status loadavgwatch_set_virtual_sample(
+    loadavgwatch_state* state,
+    const struct timespec* now,
+    const loadavgwatch_snapshot* snapshot);
 loadavgwatch_status loadavgwatch_set_log_info(
     loadavgwatch_state* state, loadavgwatch_log_object* log);
 loadavgwatch_status loadavgwatch_set_log_warning(
@@ -78,6 +258,15 @@ loadavgwatch_status loadavgwatch_set_start_load(
     loadavgwatch_state* state, const loadavgwatch_load* load);
 loadavgwatch_status loadavgwatch_set_start_interval(
     loadavgwatch_state* state, const struct timespec* interval);
+/**
+ * Allows up to burst start decisions in a row after a period without
+ * starts. Every start interval adds one start to the allowance, so the
+ * long term start rate stays one per start interval. Default burst of
+ * 1 allows one start per start interval. Members of a group still
+ * start only once per start interval in the group.
+ */
+loadavgwatch_status loadavgwatch_set_start_burst(
+    loadavgwatch_state* state, uint32_t burst);
 loadavgwatch_status loadavgwatch_set_quiet_period_over_start(
     loadavgwatch_state* state, const struct timespec* interval);
 loadavgwatch_status loadavgwatch_set_stop_load(
@@ -86,11 +275,37 @@ loadavgwatch_status loadavgwatch_set_stop_interval(
     loadavgwatch_state* state, const struct timespec* interval);
 loadavgwatch_status loadavgwatch_set_quiet_period_over_stop(
     loadavgwatch_state* state, const struct timespec* interval);
+loadavgwatch_status loadavgwatch_set_metric(
+    loadavgwatch_state* state, loadavgwatch_metric metric);
+/**
+ * Makes start and stop decisions based on where the compared metric is
+ * predicted to be after the given time instead of its current value.
+ * Prediction extrapolates the trend of the latest polls with a least
+ * squares fit. This compensates for the lag of load averages so that
+ * processes are not started when the load is already rising towards
+ * the start limit. Zero horizon (default) disables prediction.
+ */
+loadavgwatch_status loadavgwatch_set_prediction_horizon(
+    loadavgwatch_state* state, const struct timespec* horizon);
+loadavgwatch_status loadavgwatch_set_parameter(
+    loadavgwatch_state* state, const loadavgwatch_parameter* parameter);
 
 const char* loadavgwatch_get_system(const loadavgwatch_state* state);
+/**
+ * Returns the number of CPUs that default load limits are based on,
+ * or a non-positive value if it could not be detected.
+ */
+long loadavgwatch_get_ncpus(const loadavgwatch_state* state);
+/**
+ * Returns a file descriptor that signals POLLPRI when the load source
+ * has detected a load change that should be polled right away, or -1
+ * if the load source needs to be polled periodically.
+ */
+int loadavgwatch_get_event_fd(const loadavgwatch_state* state);
 loadavgwatch_load loadavgwatch_get_start_load(const loadavgwatch_state* state);
 struct timespec loadavgwatch_get_start_interval(
     const loadavgwatch_state* state);
+uint32_t loadavgwatch_get_start_burst(const loadavgwatch_state* state);
 struct timespec loadavgwatch_get_quiet_period_over_start(
     const loadavgwatch_state* state);
 loadavgwatch_load loadavgwatch_get_stop_load(const loadavgwatch_state* state);
@@ -98,13 +313,184 @@ struct timespec loadavgwatch_get_stop_interval(
     const loadavgwatch_state* state);
 struct timespec loadavgwatch_get_quiet_period_over_stop(
     const loadavgwatch_state* state);
+loadavgwatch_metric loadavgwatch_get_metric(const loadavgwatch_state* state);
+struct timespec loadavgwatch_get_prediction_horizon(
+    const loadavgwatch_state* state);
 
 loadavgwatch_status loadavgwatch_close(loadavgwatch_state** state);
+/**
+ * Forgets the times of registered starts and stops, load limit
+ * crossings and the history while keeping all settings. This makes it
+ * possible to run several simulations with one virtual state without
+ * allocating memory for each of them.
+ */
+loadavgwatch_status loadavgwatch_reset(loadavgwatch_state* state);
 loadavgwatch_status loadavgwatch_poll(
     loadavgwatch_state* state, loadavgwatch_poll_result* result);
+loadavgwatch_status loadavgwatch_poll_snapshot(
+    loadavgwatch_state* state,
+    loadavgwatch_poll_result* result,
+    loadavgwatch_snapshot* snapshot);
+/**
+ * Sets how many of the latest polled values of the compared metric
+ * are kept for history queries. The default is 256. Changing the
+ * metric clears the history.
+ */
+loadavgwatch_status loadavgwatch_set_history_capacity(
+    loadavgwatch_state* state, size_t capacity);
+size_t loadavgwatch_get_history_capacity(const loadavgwatch_state* state);
+/**
+ * Calculates the minimum, maximum and mean of the compared metric over
+ * the polls that happened at most window ago. Returns
+ * LOADAVGWATCH_ERR_READ if there are no polls in the window.
+ */
+loadavgwatch_status loadavgwatch_history_summarize(
+    const loadavgwatch_state* state,
+    const struct timespec* window,
+    loadavgwatch_history_summary* out_summary);
+/**
+ * Finds the nearest rank percentile (0-100) of the compared metric
+ * over the polls that happened at most window ago.
+ */
+loadavgwatch_status loadavgwatch_history_percentile(
+    loadavgwatch_state* state,
+    const struct timespec* window,
+    uint32_t percentile,
+    loadavgwatch_load* out_value);
+/**
+ * Suggests the time until the next poll based on the polled history.
+ * The interval is min_interval when the latest value is within band of
+ * the start or stop load or when the trend of the two latest polls
+ * would reach that band before the next poll. Otherwise the time
+ * between the two latest polls is doubled up to max_interval.
+ */
+loadavgwatch_status loadavgwatch_suggest_poll_interval(
+    const loadavgwatch_state* state,
+    const loadavgwatch_load* band,
+    const struct timespec* min_interval,
+    const struct timespec* max_interval,
+    struct timespec* out_interval);
+/**
+ * Moves the poll time to just after the update of the load source that
+ * is nearest to it, so that polls see new values as soon as possible.
+ * Returns LOADAVGWATCH_ERR_READ if the source does not update on a
+ * fixed cadence, the compared metric is not a load average or the
+ * phase of the updates is not known yet.
+ */
+loadavgwatch_status loadavgwatch_align_poll_time(
+    const loadavgwatch_state* state,
+    const struct timespec* poll_at,
+    struct timespec* out_poll_at);
+/**
+ * Finds the time when loadavgwatch_probe() should be called to learn
+ * the update phase of the load source before polling at the given
+ * time. Returns LOADAVGWATCH_ERR_READ if probing would not help.
+ */
+loadavgwatch_status loadavgwatch_get_probe_time(
+    const loadavgwatch_state* state,
+    const struct timespec* poll_at,
+    struct timespec* out_probe_at);
+/**
+ * Reads the load source only to learn its update phase. This does not
+ * affect decisions or the history.
+ */
+loadavgwatch_status loadavgwatch_probe(loadavgwatch_state* state);
 loadavgwatch_status loadavgwatch_register_start(loadavgwatch_state* state);
 loadavgwatch_status loadavgwatch_register_stop(loadavgwatch_state* state);
 
+/**
+ * Maps a load trace file to memory. Returns LOADAVGWATCH_ERR_PARSE if
+ * the file is not a trace of a supported version.
+ */
+loadavgwatch_status loadavgwatch_trace_open(
+    const char* path, loadavgwatch_trace** out_trace);
+const loadavgwatch_trace_header* loadavgwatch_trace_get_header(
+    const loadavgwatch_trace* trace);
+const loadavgwatch_trace_record* loadavgwatch_trace_get_records(
+    const loadavgwatch_trace* trace, size_t* out_count);
+loadavgwatch_status loadavgwatch_trace_close(loadavgwatch_trace** trace);
+void loadavgwatch_trace_record_from_snapshot(
+    const struct timespec* now,
+    const loadavgwatch_snapshot* snapshot,
+    loadavgwatch_trace_record* out_record);
+void loadavgwatch_trace_record_to_snapshot(
+    const loadavgwatch_trace_record* record,
+    struct timespec* out_now,
+    loadavgwatch_snapshot* out_snapshot);
+/**
+ * Opens a trace file for appending poll samples. Existing trace is
+ * continued and a new or empty file gets a header with the given
+ * number of CPUs. Records are written to a memory mapped region that
+ * is extended in large steps, so appending usually does not need any
+ * system calls. Returns LOADAVGWATCH_ERR_PARSE if the file has other
+ * content than a trace of a supported version.
+ */
+loadavgwatch_status loadavgwatch_recorder_open(
+    const char* path, long ncpus, loadavgwatch_recorder** out_recorder);
+loadavgwatch_status loadavgwatch_recorder_append(
+    loadavgwatch_recorder* recorder,
+    const struct timespec* now,
+    const loadavgwatch_snapshot* snapshot,
+    const loadavgwatch_poll_result* result);
+/**
+ * Removes the unused preallocated space from the end of the file.
+ */
+loadavgwatch_status loadavgwatch_recorder_close(
+    loadavgwatch_recorder** recorder);
+/**
+ * Polls a virtual state once for every record and registers a start
+ * or stop whenever the poll decides to start or stop processes, like
+ * a program that runs commands right after polling would. Callback,
+ * if given, is called with the decisions of every poll. Records need
+ * to be in time order.
+ */
+loadavgwatch_status loadavgwatch_replay(
+    loadavgwatch_state* state,
+    const loadavgwatch_trace_record* records,
+    size_t record_count,
+    loadavgwatch_replay_callback callback,
+    void* callback_data);
+/**
+ * Publishes the status of the state in POSIX shared memory object
+ * /loadavgwatch.<name> (/dev/shm/loadavgwatch.<name> on Linux). The
+ * status is updated on every poll and start or stop registration, and
+ * the object is removed when the state is closed. Returns
+ * LOADAVGWATCH_ERR_INIT if another state already publishes with the
+ * same name.
+ */
+loadavgwatch_status loadavgwatch_share_status(
+    loadavgwatch_state* state, const char* name);
+/**
+ * Makes the state coordinate its starts with the other states that
+ * join the same group, also in other processes. Polls decide to start
+ * only if no member of the group has started within the start interval
+ * of the polling state, and such a decision counts as a start of the
+ * group right away, so members that poll at the same moment do not
+ * all start. Groups are POSIX shared memory objects
+ * /loadavgwatch-group.<name> that stay after their members close.
+ */
+loadavgwatch_status loadavgwatch_join_group(
+    loadavgwatch_state* state, const char* name);
+/**
+ * Maps the status that a state publishes with the given name. Reads
+ * only access the mapped memory, so they do not need any system calls
+ * and never block the publisher. Returns LOADAVGWATCH_ERR_PARSE if the
+ * object is not a status segment.
+ */
+loadavgwatch_status loadavgwatch_status_reader_open(
+    const char* name, loadavgwatch_status_reader** out_reader);
+/**
+ * Copies a consistent status. Returns LOADAVGWATCH_ERR_READ if the
+ * publisher stopped in the middle of an update and
+ * LOADAVGWATCH_ERR_PARSE if it has not written a status of this
+ * version.
+ */
+loadavgwatch_status loadavgwatch_status_reader_read(
+    const loadavgwatch_status_reader* reader,
+    loadavgwatch_shared_status* out_status);
+loadavgwatch_status loadavgwatch_status_reader_close(
+    loadavgwatch_status_reader** reader);
+
 #ifdef __cplusplus
 }
 #endif // #ifdef __cplusplus
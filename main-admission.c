@@ -0,0 +1,418 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Admission control over a Unix domain socket.
+ *
+ * Every connection asks for one slot with a "request [priority]" line
+ * and waits until it gets a "granted" line. The slot is held until the
+ * client disconnects. Start decisions open slots up to a maximum and
+ * stop decisions close them and send "stop" lines to the clients that
+ * got their slots last. Waiters are granted slots whenever fewer than
+ * the open slots are held, so slots of disconnected clients go to the
+ * next waiters. Waiters are granted slots in the order of their
+ * priority (0-9, higher first) and in the order of their requests
+ * within the same priority.
+ *
+ * Clients are kept in a table that is indexed by their file
+ * descriptors and the queues are linked lists through that table, so
+ * every client takes a constant amount of memory and queue operations
+ * do not depend on the number of waiters.
+ */
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define ADMISSION_PRIORITIES 10
+#define ADMISSION_LINE_MAX 32
+#define ADMISSION_EVENTS 64
+
+typedef enum admission_client_state {
+    ADMISSION_UNUSED = 0,
+    ADMISSION_CONNECTED,
+    ADMISSION_WAITING,
+    ADMISSION_GRANTED,
+    // Still holds its slot after being asked to stop:
+    ADMISSION_STOPPING,
+} admission_client_state;
+
+typedef struct admission_client
+{
+    uint8_t state;
+    uint8_t priority;
+    uint8_t line_length;
+    char line[ADMISSION_LINE_MAX];
+    // Neighbors in the waiting or granted queue:
+    int previous;
+    int next;
+} admission_client;
+
+typedef struct admission_queue
+{
+    int head;
+    int tail;
+} admission_queue;
+
+typedef struct admission_server
+{
+    const char* path;
+    int listen_fd;
+    int epoll_fd;
+    admission_client* clients;
+    size_t capacity;
+    admission_queue waiting[ADMISSION_PRIORITIES];
+    admission_queue granted;
+    size_t waiting_count;
+    size_t granted_count;
+    // Granted clients that have been asked to stop:
+    size_t stopping_count;
+    // Slots that start decisions have opened:
+    uint32_t slots;
+    uint32_t max_slots;
+} admission_server;
+
+static void _admission_queue_push(
+    admission_server* server, admission_queue* queue, int fd)
+{
+    admission_client* client = &server->clients[fd];
+    client->previous = queue->tail;
+    client->next = -1;
+    if (queue->tail == -1) {
+        queue->head = fd;
+    } else {
+        server->clients[queue->tail].next = fd;
+    }
+    queue->tail = fd;
+}
+
+static void _admission_queue_remove(
+    admission_server* server, admission_queue* queue, int fd)
+{
+    admission_client* client = &server->clients[fd];
+    if (client->previous == -1) {
+        queue->head = client->next;
+    } else {
+        server->clients[client->previous].next = client->next;
+    }
+    if (client->next == -1) {
+        queue->tail = client->previous;
+    } else {
+        server->clients[client->next].previous = client->previous;
+    }
+}
+
+static void _admission_disconnect(admission_server* server, int fd)
+{
+    admission_client* client = &server->clients[fd];
+    if (client->state == ADMISSION_WAITING) {
+        _admission_queue_remove(
+            server, &server->waiting[client->priority], fd);
+        --server->waiting_count;
+    } else if (client->state == ADMISSION_GRANTED) {
+        _admission_queue_remove(server, &server->granted, fd);
+        --server->granted_count;
+    } else if (client->state == ADMISSION_STOPPING) {
+        --server->granted_count;
+        --server->stopping_count;
+    }
+    client->state = ADMISSION_UNUSED;
+    // Closing also removes the descriptor from epoll:
+    close(fd);
+}
+
+/**
+ * Sends a reply line. Clients that have gone away do not raise
+ * SIGPIPE.
+ */
+static bool _admission_send(int fd, const char* line)
+{
+    size_t length = strlen(line);
+    return send(fd, line, length, MSG_NOSIGNAL) == (ssize_t)length;
+}
+
+static bool _admission_set_nonblocking(int fd)
+{
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0
+        && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+/**
+ * Listens on the socket path. Stale sockets of earlier servers are
+ * replaced, other files are not.
+ */
+static bool _admission_open(
+    const char* path, uint32_t max_slots, admission_server* out_server)
+{
+    memset(out_server, 0, sizeof(*out_server));
+    out_server->path = path;
+    out_server->max_slots = max_slots;
+    out_server->listen_fd = -1;
+    out_server->epoll_fd = -1;
+    for (size_t i = 0; i < ADMISSION_PRIORITIES; ++i) {
+        out_server->waiting[i] = (admission_queue){-1, -1};
+    }
+    out_server->granted = (admission_queue){-1, -1};
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    struct stat path_stat;
+    if (lstat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+        unlink(path);
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        return false;
+    }
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.fd = listen_fd};
+    int epoll_fd = -1;
+    if (!_admission_set_nonblocking(listen_fd)
+        || bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listen_fd, SOMAXCONN) != 0
+        || (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) != 0) {
+        int saved_errno = errno;
+        if (epoll_fd != -1) {
+            close(epoll_fd);
+        }
+        close(listen_fd);
+        errno = saved_errno;
+        return false;
+    }
+    out_server->listen_fd = listen_fd;
+    out_server->epoll_fd = epoll_fd;
+    return true;
+}
+
+static void _admission_close(admission_server* server)
+{
+    if (server->listen_fd == -1) {
+        return;
+    }
+    for (size_t fd = 0; fd < server->capacity; ++fd) {
+        if (server->clients[fd].state != ADMISSION_UNUSED) {
+            _admission_disconnect(server, (int)fd);
+        }
+    }
+    free(server->clients);
+    server->clients = NULL;
+    server->capacity = 0;
+    close(server->epoll_fd);
+    close(server->listen_fd);
+    unlink(server->path);
+    server->listen_fd = -1;
+    server->epoll_fd = -1;
+}
+
+/**
+ * Parses "request" or "request <priority>". Returns false for other
+ * lines.
+ */
+static bool _admission_parse_request(const char* line, uint8_t* out_priority)
+{
+    if (strcmp(line, "request") == 0) {
+        *out_priority = 0;
+        return true;
+    }
+    if (strncmp(line, "request ", 8) == 0
+        && line[8] >= '0' && line[8] <= '9' && line[9] == '\0') {
+        *out_priority = (uint8_t)(line[8] - '0');
+        return true;
+    }
+    return false;
+}
+
+static void _admission_read(admission_server* server, int fd)
+{
+    admission_client* client = &server->clients[fd];
+    char buffer[ADMISSION_LINE_MAX];
+    ssize_t read_size = read(fd, buffer, sizeof(buffer));
+    if (read_size == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (read_size <= 0) {
+        _admission_disconnect(server, fd);
+        return;
+    }
+    for (ssize_t i = 0; i < read_size; ++i) {
+        if (buffer[i] != '\n') {
+            // Longer lines can not be valid requests:
+            if (client->line_length == ADMISSION_LINE_MAX - 1) {
+                _admission_disconnect(server, fd);
+                return;
+            }
+            client->line[client->line_length++] = buffer[i];
+            continue;
+        }
+        client->line[client->line_length] = '\0';
+        client->line_length = 0;
+        uint8_t priority;
+        // Every connection holds at most one slot:
+        if (client->state != ADMISSION_CONNECTED
+            || !_admission_parse_request(client->line, &priority)) {
+            _admission_send(fd, "error\n");
+            _admission_disconnect(server, fd);
+            return;
+        }
+        client->state = ADMISSION_WAITING;
+        client->priority = priority;
+        _admission_queue_push(server, &server->waiting[priority], fd);
+        ++server->waiting_count;
+    }
+}
+
+static void _admission_accept(admission_server* server)
+{
+    int fd;
+    while ((fd = accept(server->listen_fd, NULL, NULL)) != -1) {
+        if ((size_t)fd >= server->capacity) {
+            size_t capacity = server->capacity == 0 ? 64 : server->capacity;
+            while (capacity <= (size_t)fd) {
+                capacity *= 2;
+            }
+            admission_client* clients = realloc(
+                server->clients, capacity * sizeof(admission_client));
+            if (clients == NULL) {
+                close(fd);
+                continue;
+            }
+            memset(
+                clients + server->capacity,
+                0,
+                (capacity - server->capacity) * sizeof(admission_client));
+            server->clients = clients;
+            server->capacity = capacity;
+        }
+        struct epoll_event client_event = {.events = EPOLLIN, .data.fd = fd};
+        if (!_admission_set_nonblocking(fd)
+            || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &client_event) != 0) {
+            close(fd);
+            continue;
+        }
+        admission_client* client = &server->clients[fd];
+        memset(client, 0, sizeof(*client));
+        client->state = ADMISSION_CONNECTED;
+        // Clients often send their requests before being accepted:
+        _admission_read(server, fd);
+    }
+}
+
+/**
+ * Opens up to count slots without going over the maximum. Returns the
+ * number of opened slots.
+ */
+static uint32_t _admission_open_slots(admission_server* server, uint32_t count)
+{
+    uint32_t available = server->max_slots - server->slots;
+    uint32_t opened = count < available ? count : available;
+    server->slots += opened;
+    return opened;
+}
+
+/**
+ * Grants slots to waiters while fewer than the open slots are held.
+ * Returns the number of granted slots.
+ */
+static uint32_t _admission_grant(admission_server* server)
+{
+    uint32_t granted = 0;
+    for (int priority = ADMISSION_PRIORITIES - 1;
+         priority >= 0 && server->granted_count < server->slots;
+         --priority) {
+        admission_queue* queue = &server->waiting[priority];
+        while (queue->head != -1 && server->granted_count < server->slots) {
+            int fd = queue->head;
+            _admission_queue_remove(server, queue, fd);
+            --server->waiting_count;
+            server->clients[fd].state = ADMISSION_GRANTED;
+            _admission_queue_push(server, &server->granted, fd);
+            ++server->granted_count;
+            // Lines are much shorter than the socket buffer of a new
+            // connection:
+            if (!_admission_send(fd, "granted\n")) {
+                _admission_disconnect(server, fd);
+                continue;
+            }
+            ++granted;
+        }
+    }
+    return granted;
+}
+
+/**
+ * Accepts new clients and reads their requests without blocking. Open
+ * slots that are not held are granted to the waiters.
+ */
+static void _admission_handle(admission_server* server)
+{
+    struct epoll_event events[ADMISSION_EVENTS];
+    int event_count;
+    do {
+        event_count = epoll_wait(
+            server->epoll_fd, events, ADMISSION_EVENTS, 0);
+        for (int i = 0; i < event_count; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == server->listen_fd) {
+                _admission_accept(server);
+            } else if (server->clients[fd].state != ADMISSION_UNUSED) {
+                _admission_read(server, fd);
+            }
+        }
+    } while (event_count == ADMISSION_EVENTS);
+    _admission_grant(server);
+}
+
+/**
+ * Asks up to count clients that got their slots last to stop and
+ * closes their slots together with the slots that nobody holds. Asked
+ * clients hold their slots until they disconnect, but are not asked
+ * again. Returns the number of asked clients.
+ */
+static uint32_t _admission_stop(admission_server* server, uint32_t count)
+{
+    uint32_t stopped = 0;
+    while (server->granted.tail != -1 && stopped < count) {
+        int fd = server->granted.tail;
+        _admission_queue_remove(server, &server->granted, fd);
+        server->clients[fd].state = ADMISSION_STOPPING;
+        ++server->stopping_count;
+        if (!_admission_send(fd, "stop\n")) {
+            _admission_disconnect(server, fd);
+            continue;
+        }
+        ++stopped;
+    }
+    server->slots = (uint32_t)(server->granted_count - server->stopping_count);
+    return stopped;
+}
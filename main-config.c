@@ -0,0 +1,218 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Parser of rule configuration files:
+ *
+ *   # Comment
+ *   [light-jobs]
+ *   start-command = start-light-job
+ *   max-start = 4
+ *
+ * Every [name] section is a rule. Keys are the long command line
+ * options of one start and stop decision without the leading dashes,
+ * so each rule is turned into command line arguments of its own.
+ */
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Options that can differ between rules. Options without a value are
+// flags:
+static const struct {
+    const char* name;
+    bool has_value;
+} CONFIG_RULE_KEYS[] = {
+    {"start-command", true},
+    {"stop-command", true},
+    {"max-start", true},
+    {"min-stop", true},
+    {"start-interval", true},
+    {"start-burst", true},
+    {"stop-interval", true},
+    {"quiet-max-start", true},
+    {"quiet-min-stop", true},
+    {"predict", true},
+    {"metric", true},
+    {"max-per-decision", true},
+    {"honor-counts", false},
+};
+
+typedef struct config_rule
+{
+    // argv[0] is the rule name like a program name is for a program:
+    int argc;
+    char** argv;
+} config_rule;
+
+typedef struct config_rules
+{
+    config_rule* rules;
+    size_t count;
+} config_rules;
+
+static void _config_free(config_rules* rules)
+{
+    for (size_t i = 0; i < rules->count; ++i) {
+        for (int argument = 0; argument < rules->rules[i].argc; ++argument) {
+            free(rules->rules[i].argv[argument]);
+        }
+        free(rules->rules[i].argv);
+    }
+    free(rules->rules);
+    rules->rules = NULL;
+    rules->count = 0;
+}
+
+static char* _config_trim(char* text)
+{
+    while (isspace((unsigned char)*text)) {
+        ++text;
+    }
+    size_t length = strlen(text);
+    while (length > 0 && isspace((unsigned char)text[length - 1])) {
+        text[--length] = '\0';
+    }
+    return text;
+}
+
+static bool _config_add_argument(config_rule* rule, const char* argument)
+{
+    char** argv = realloc(rule->argv, (rule->argc + 2) * sizeof(char*));
+    if (argv == NULL) {
+        return false;
+    }
+    rule->argv = argv;
+    rule->argv[rule->argc] = strdup(argument);
+    if (rule->argv[rule->argc] == NULL) {
+        return false;
+    }
+    rule->argv[++rule->argc] = NULL;
+    return true;
+}
+
+/**
+ * Adds a new rule with an unique name.
+ */
+static bool _config_add_rule(config_rules* rules, const char* name)
+{
+    for (size_t i = 0; i < rules->count; ++i) {
+        if (strcmp(rules->rules[i].argv[0], name) == 0) {
+            return false;
+        }
+    }
+    config_rule* new_rules = realloc(
+        rules->rules, (rules->count + 1) * sizeof(config_rule));
+    if (new_rules == NULL) {
+        return false;
+    }
+    rules->rules = new_rules;
+    config_rule* rule = &rules->rules[rules->count++];
+    rule->argc = 0;
+    rule->argv = NULL;
+    return _config_add_argument(rule, name);
+}
+
+/**
+ * Turns a "key = value" line into a "--key=value" argument.
+ */
+static bool _config_add_setting(config_rule* rule, char* line)
+{
+    char* equal_sign = strchr(line, '=');
+    const char* value = NULL;
+    if (equal_sign != NULL) {
+        *equal_sign = '\0';
+        value = _config_trim(equal_sign + 1);
+    }
+    const char* key = _config_trim(line);
+    for (size_t i = 0; i < sizeof(CONFIG_RULE_KEYS) / sizeof(CONFIG_RULE_KEYS[0]); ++i) {
+        if (strcmp(CONFIG_RULE_KEYS[i].name, key) != 0) {
+            continue;
+        }
+        if (CONFIG_RULE_KEYS[i].has_value != (value != NULL)
+            || (value != NULL && *value == '\0')) {
+            return false;
+        }
+        size_t size = strlen(key) + (value ? strlen(value) : 0) + 4;
+        char* argument = malloc(size);
+        if (argument == NULL) {
+            return false;
+        }
+        snprintf(argument, size, value ? "--%s=%s" : "--%s", key, value);
+        bool added = _config_add_argument(rule, argument);
+        free(argument);
+        return added;
+    }
+    return false;
+}
+
+/**
+ * Parses the rules of a configuration file. The text is modified.
+ *
+ * Returns false with the number of the first invalid line, or with
+ * line 0 if there are no rules or if memory runs out.
+ */
+static bool _config_parse(
+    char* text, config_rules* out_rules, size_t* out_error_line)
+{
+    out_rules->rules = NULL;
+    out_rules->count = 0;
+    size_t line_number = 0;
+    char* line = text;
+    while (line != NULL) {
+        ++line_number;
+        char* line_end = strchr(line, '\n');
+        if (line_end != NULL) {
+            *line_end = '\0';
+        }
+        char* content = _config_trim(line);
+        line = line_end != NULL ? line_end + 1 : NULL;
+        if (*content == '\0' || *content == '#') {
+            continue;
+        }
+        size_t length = strlen(content);
+        bool valid;
+        if (content[0] == '[') {
+            valid = length > 2 && content[length - 1] == ']';
+            content[length - 1] = '\0';
+            const char* name = _config_trim(content + 1);
+            valid = valid && *name != '\0' && _config_add_rule(out_rules, name);
+        } else {
+            valid = out_rules->count > 0
+                && _config_add_setting(
+                    &out_rules->rules[out_rules->count - 1], content);
+        }
+        if (!valid) {
+            *out_error_line = line_number;
+            _config_free(out_rules);
+            return false;
+        }
+    }
+    if (out_rules->count == 0) {
+        *out_error_line = 0;
+        return false;
+    }
+    return true;
+}
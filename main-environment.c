@@ -0,0 +1,100 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Environment variables that tell the started instances of a command
+ * apart.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char INSTANCE_VARIABLE[] = "LOADAVGWATCH_INSTANCE=";
+static const char INSTANCES_VARIABLE[] = "LOADAVGWATCH_INSTANCES=";
+
+/**
+ * Environment for the instances of one command: the given environment
+ * without earlier LOADAVGWATCH_INSTANCE and LOADAVGWATCH_INSTANCES
+ * variables, followed by these variables for the current instance.
+ * The environment of this process is not modified.
+ */
+typedef struct instance_environment
+{
+    char** envp;
+    char instance[sizeof(INSTANCE_VARIABLE) + 10];
+    char instances[sizeof(INSTANCES_VARIABLE) + 10];
+} instance_environment;
+
+/**
+ * Returns false if there is no memory for the environment.
+ */
+static bool _instance_environment_init(
+    instance_environment* out_environment, char* const* base_envp)
+{
+    size_t base_count = 0;
+    while (base_envp[base_count] != NULL) {
+        ++base_count;
+    }
+    char** envp = malloc((base_count + 3) * sizeof(char*));
+    if (envp == NULL) {
+        return false;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < base_count; ++i) {
+        if (strncmp(base_envp[i],
+                    INSTANCE_VARIABLE,
+                    sizeof(INSTANCE_VARIABLE) - 1) == 0
+            || strncmp(base_envp[i],
+                       INSTANCES_VARIABLE,
+                       sizeof(INSTANCES_VARIABLE) - 1) == 0) {
+            continue;
+        }
+        envp[count++] = base_envp[i];
+    }
+    out_environment->instance[0] = '\0';
+    out_environment->instances[0] = '\0';
+    envp[count++] = out_environment->instance;
+    envp[count++] = out_environment->instances;
+    envp[count] = NULL;
+    out_environment->envp = envp;
+    return true;
+}
+
+static void _instance_environment_set(
+    instance_environment* environment, uint32_t instance, uint32_t instances)
+{
+    snprintf(environment->instance,
+             sizeof(environment->instance),
+             "%s%u",
+             INSTANCE_VARIABLE,
+             instance);
+    snprintf(environment->instances,
+             sizeof(environment->instances),
+             "%s%u",
+             INSTANCES_VARIABLE,
+             instances);
+}
+
+static void _instance_environment_free(instance_environment* environment)
+{
+    free(environment->envp);
+    environment->envp = NULL;
+}
@@ -0,0 +1,176 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * GNU make compatible jobserver in a named pipe.
+ *
+ * Every byte in the pipe is a token that lets a client run one job in
+ * addition to the one that it always may run. Clients read a token
+ * before starting a job and write it back when the job finishes, so
+ * tokens can be added at any time and reclaimed only when they are in
+ * the pipe. Tokens that are held by running jobs are reclaimed when
+ * they are returned.
+ */
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define JOBSERVER_TOKEN '+'
+
+typedef struct jobserver
+{
+    const char* path;
+    int read_fd;
+    int write_fd;
+    // Tokens that have been added and not reclaimed yet:
+    uint32_t tokens;
+    uint32_t max_tokens;
+    // Tokens to reclaim when clients return them:
+    uint32_t withheld;
+} jobserver;
+
+/**
+ * Creates the named pipe. Both ends are kept open so that the pipe and
+ * its tokens stay alive between clients.
+ */
+static bool _jobserver_open(
+    const char* path, uint32_t max_tokens, jobserver* out_jobserver)
+{
+    out_jobserver->path = path;
+    out_jobserver->read_fd = -1;
+    out_jobserver->write_fd = -1;
+    out_jobserver->tokens = 0;
+    out_jobserver->max_tokens = max_tokens;
+    out_jobserver->withheld = 0;
+    if (mkfifo(path, 0600) != 0) {
+        return false;
+    }
+    out_jobserver->read_fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (out_jobserver->read_fd != -1) {
+        out_jobserver->write_fd = open(path, O_WRONLY | O_NONBLOCK);
+    }
+    if (out_jobserver->write_fd == -1
+        || fcntl(out_jobserver->read_fd, F_SETFD, FD_CLOEXEC) != 0
+        || fcntl(out_jobserver->write_fd, F_SETFD, FD_CLOEXEC) != 0) {
+        int saved_errno = errno;
+        if (out_jobserver->read_fd != -1) {
+            close(out_jobserver->read_fd);
+        }
+        unlink(path);
+        errno = saved_errno;
+        return false;
+    }
+    return true;
+}
+
+static void _jobserver_close(jobserver* jobserver)
+{
+    if (jobserver->read_fd == -1) {
+        return;
+    }
+    close(jobserver->read_fd);
+    close(jobserver->write_fd);
+    unlink(jobserver->path);
+    jobserver->read_fd = -1;
+    jobserver->write_fd = -1;
+}
+
+/**
+ * Reads up to count tokens that are in the pipe. Returns the number of
+ * tokens read.
+ */
+static uint32_t _jobserver_take(jobserver* jobserver, uint32_t count)
+{
+    uint32_t taken = 0;
+    char buffer[64];
+    while (taken < count) {
+        size_t wanted = count - taken < sizeof(buffer)
+            ? count - taken : sizeof(buffer);
+        ssize_t read_size = read(jobserver->read_fd, buffer, wanted);
+        if (read_size <= 0) {
+            break;
+        }
+        taken += (uint32_t)read_size;
+    }
+    return taken;
+}
+
+/**
+ * Reclaims withheld tokens that clients have returned. Returns the
+ * number of reclaimed tokens.
+ */
+static uint32_t _jobserver_collect(jobserver* jobserver)
+{
+    uint32_t taken = _jobserver_take(jobserver, jobserver->withheld);
+    jobserver->withheld -= taken;
+    jobserver->tokens -= taken;
+    return taken;
+}
+
+/**
+ * Adds up to count tokens without exceeding the maximum. Tokens that
+ * are still to be withheld are kept instead of adding new ones. Returns
+ * the number of tokens that became available.
+ */
+static uint32_t _jobserver_add(jobserver* jobserver, uint32_t count)
+{
+    uint32_t kept = count < jobserver->withheld ? count : jobserver->withheld;
+    jobserver->withheld -= kept;
+    count -= kept;
+    uint32_t room = jobserver->max_tokens - jobserver->tokens;
+    if (count > room) {
+        count = room;
+    }
+    char buffer[64];
+    memset(buffer, JOBSERVER_TOKEN, sizeof(buffer));
+    uint32_t added = 0;
+    while (added < count) {
+        size_t wanted = count - added < sizeof(buffer)
+            ? count - added : sizeof(buffer);
+        ssize_t written = write(jobserver->write_fd, buffer, wanted);
+        if (written <= 0) {
+            break;
+        }
+        added += (uint32_t)written;
+    }
+    jobserver->tokens += added;
+    return kept + added;
+}
+
+/**
+ * Withholds up to count tokens that have been added. They are
+ * reclaimed by _jobserver_collect() as they appear in the pipe.
+ * Returns the number of newly withheld tokens.
+ */
+static uint32_t _jobserver_withhold(jobserver* jobserver, uint32_t count)
+{
+    uint32_t available = jobserver->tokens - jobserver->withheld;
+    uint32_t withheld = count < available ? count : available;
+    jobserver->withheld += withheld;
+    return withheld;
+}
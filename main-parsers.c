@@ -132,3 +132,34 @@ static bool _string_to_timespec(
         current_seconds - out_result->tv_sec + 0.0000000005);
     return true;
 }
+
+/**
+ * Parses a comma separated list of exactly result_count time values.
+ */
+static bool _string_to_timespec_list(
+    const char* list_str, struct timespec* out_results, size_t result_count)
+{
+    const char* item_start = list_str;
+    for (size_t i = 0; i < result_count; ++i) {
+        const char* item_end = strchr(item_start, ',');
+        bool is_last = i + 1 == result_count;
+        if (is_last != (item_end == NULL)) {
+            return false;
+        }
+        if (item_end == NULL) {
+            item_end = item_start + strlen(item_start);
+        }
+        char item[32];
+        size_t item_length = item_end - item_start;
+        if (item_length >= sizeof(item)) {
+            return false;
+        }
+        memcpy(item, item_start, item_length);
+        item[item_length] = '\0';
+        if (!_string_to_timespec(item, &out_results[i])) {
+            return false;
+        }
+        item_start = item_end + 1;
+    }
+    return true;
+}
@@ -0,0 +1,130 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Running of start and stop commands. These do not log anything so
+ * that they can be benchmarked and tested outside of the main program.
+ */
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <errno.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+extern char** environ;
+
+// Commands that consist only of these characters do not use any shell
+// features and are split to arguments at spaces. Everything else is
+// run with /bin/sh:
+static const char PLAIN_COMMAND_CHARACTERS[] =
+    "abcdefghijklmnopqrstuvwxyz"
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "0123456789"
+    " -_./,:+@%";
+
+#define PLAIN_COMMAND_MAX_ARGUMENTS 32
+#define PLAIN_COMMAND_MAX_LENGTH 1024
+
+/**
+ * Splits a command that does not need a shell to arguments.
+ *
+ * Returns false if the command needs a shell to be run correctly.
+ * Arguments point to out_buffer.
+ */
+static bool _split_plain_command(
+    const char* command,
+    char out_buffer[PLAIN_COMMAND_MAX_LENGTH],
+    char* out_argv[PLAIN_COMMAND_MAX_ARGUMENTS + 1])
+{
+    size_t length = strlen(command);
+    if (length >= PLAIN_COMMAND_MAX_LENGTH
+        || strspn(command, PLAIN_COMMAND_CHARACTERS) != length) {
+        return false;
+    }
+    memcpy(out_buffer, command, length + 1);
+    size_t argument_count = 0;
+    char* position = out_buffer;
+    while (true) {
+        while (*position == ' ') {
+            *position++ = '\0';
+        }
+        if (*position == '\0') {
+            break;
+        }
+        if (argument_count == PLAIN_COMMAND_MAX_ARGUMENTS) {
+            return false;
+        }
+        out_argv[argument_count++] = position;
+        while (*position != ' ' && *position != '\0') {
+            ++position;
+        }
+    }
+    out_argv[argument_count] = NULL;
+    return argument_count > 0;
+}
+
+/**
+ * Starts the command with /bin/sh and the given environment without
+ * waiting for it to finish.
+ *
+ * posix_spawn() does not copy the page tables of the calling process
+ * like fork() does, so starting commands does not get slower when
+ * the calling process uses a lot of memory.
+ *
+ * Returns false and sets errno if a new process could not be created.
+ */
+static bool _spawn_sh_command(
+    const char* command, char* const envp[], pid_t* out_pid)
+{
+    char* const child_args[] = {"/bin/sh", "-c", (char*)command, NULL};
+    int result = posix_spawn(
+        out_pid, "/bin/sh", NULL, NULL, child_args, envp);
+    if (result != 0) {
+        errno = result;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Starts the command with the given environment without waiting for it
+ * to finish. Commands that consist of plain words are executed directly
+ * from PATH and others with /bin/sh.
+ *
+ * Returns false and sets errno if a new process could not be created.
+ */
+static bool _spawn_command(
+    const char* command, char* const envp[], pid_t* out_pid)
+{
+    char buffer[PLAIN_COMMAND_MAX_LENGTH];
+    char* argv[PLAIN_COMMAND_MAX_ARGUMENTS + 1];
+    if (_split_plain_command(command, buffer, argv)
+        && posix_spawnp(out_pid, argv[0], NULL, NULL, argv, envp) == 0) {
+        return true;
+    }
+    // Shell builtins and programs that can not be found go through
+    // the shell so that they work and fail the same way as before:
+    return _spawn_sh_command(command, envp, out_pid);
+}
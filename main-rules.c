@@ -0,0 +1,87 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Settings of decision rules. Rules of a --config file default to the
+ * settings of the command line and reloaded rules continue from the
+ * library states of the rules that they replace.
+ */
+
+#include "loadavgwatch.h"
+#include <stdbool.h>
+#include <time.h>
+
+/**
+ * Copies load limits, intervals, quiet periods, prediction and the
+ * metric. Changing the metric clears the load history, so the metric is
+ * set only if it differs.
+ */
+static void _rules_copy_settings(
+    const loadavgwatch_state* from, loadavgwatch_state* to)
+{
+    loadavgwatch_load load = loadavgwatch_get_start_load(from);
+    loadavgwatch_set_start_load(to, &load);
+    load = loadavgwatch_get_stop_load(from);
+    loadavgwatch_set_stop_load(to, &load);
+    struct timespec time = loadavgwatch_get_start_interval(from);
+    loadavgwatch_set_start_interval(to, &time);
+    loadavgwatch_set_start_burst(to, loadavgwatch_get_start_burst(from));
+    time = loadavgwatch_get_stop_interval(from);
+    loadavgwatch_set_stop_interval(to, &time);
+    time = loadavgwatch_get_quiet_period_over_start(from);
+    loadavgwatch_set_quiet_period_over_start(to, &time);
+    time = loadavgwatch_get_quiet_period_over_stop(from);
+    loadavgwatch_set_quiet_period_over_stop(to, &time);
+    time = loadavgwatch_get_prediction_horizon(from);
+    loadavgwatch_set_prediction_horizon(to, &time);
+    if (loadavgwatch_get_metric(to) != loadavgwatch_get_metric(from)) {
+        loadavgwatch_set_metric(to, loadavgwatch_get_metric(from));
+    }
+}
+
+/**
+ * Replaces the state of a reloaded rule with the state of the rule
+ * that had the same name. The previous state takes the settings of the
+ * reloaded rule and keeps its start and stop times, quiet periods and
+ * load history, so new limits do not cause a burst of starts. The
+ * state of the reloaded rule is closed and the previous rule is left
+ * without a state.
+ */
+static void _rules_carry_over(
+    loadavgwatch_state** inout_state, loadavgwatch_state** inout_previous)
+{
+    _rules_copy_settings(*inout_state, *inout_previous);
+    loadavgwatch_close(inout_state);
+    *inout_state = *inout_previous;
+    *inout_previous = NULL;
+}
+
+/**
+ * Joins the --group if the rule starts processes. Members claim the
+ * starts of the group when their start conditions pass, so rules that
+ * only stop and dry runs would keep the other members from starting
+ * without starting anything themselves.
+ */
+static loadavgwatch_status _rules_join_group(
+    loadavgwatch_state* state, const char* group_name, bool starts_processes)
+{
+    if (group_name == NULL || !starts_processes) {
+        return LOADAVGWATCH_OK;
+    }
+    return loadavgwatch_join_group(state, group_name);
+}
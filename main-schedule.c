@@ -0,0 +1,59 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Poll scheduling on a fixed cadence. Deadlines are absolute monotonic
+ * times, so time spent in polling and acting does not accumulate.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+static int64_t _schedule_timespec_ns(const struct timespec* value)
+{
+    return (int64_t)value->tv_sec * 1000000000 + value->tv_nsec;
+}
+
+/**
+ * Returns the first time after now that is a whole number of intervals
+ * after the scheduled time. Scheduled times that are still ahead are
+ * returned as they are, and intervals that missed several slots skip
+ * them instead of catching up.
+ */
+static struct timespec _schedule_next_time(
+    const struct timespec* scheduled,
+    const struct timespec* interval,
+    const struct timespec* now)
+{
+    int64_t scheduled_ns = _schedule_timespec_ns(scheduled);
+    int64_t now_ns = _schedule_timespec_ns(now);
+    if (scheduled_ns > now_ns) {
+        return *scheduled;
+    }
+    int64_t interval_ns = _schedule_timespec_ns(interval);
+    if (interval_ns == 0) {
+        return *now;
+    }
+    int64_t next_ns = scheduled_ns
+        + ((now_ns - scheduled_ns) / interval_ns + 1) * interval_ns;
+    struct timespec next = {
+        .tv_sec = next_ns / 1000000000,
+        .tv_nsec = next_ns % 1000000000,
+    };
+    return next;
+}
@@ -19,6 +19,10 @@
 #define _XOPEN_SOURCE 600
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -29,8 +33,19 @@
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include "main-admission.c"
+#endif
+
 #include "loadavgwatch.h"
+#include "main-config.c"
+#include "main-environment.c"
+#include "main-jobserver.c"
 #include "main-parsers.c"
+#include "main-process.c"
+#include "main-rules.c"
+#include "main-schedule.c"
 
 static inline void PRINTF_LOG_MESSAGE(
     loadavgwatch_log_object* log_object, const char* format, ...)
@@ -56,6 +71,8 @@ typedef struct program_options
     loadavgwatch_load start_load;
     const char* arg_start_interval;
     struct timespec start_interval;
+    const char* arg_start_burst;
+    uint32_t start_burst;
     const char* arg_quiet_period_over_start;
     struct timespec quiet_period_over_start;
     const char* arg_stop_load;
@@ -64,13 +81,44 @@ typedef struct program_options
     struct timespec stop_interval;
     const char* arg_quiet_period_over_stop;
     struct timespec quiet_period_over_stop;
+    const char* arg_prediction_horizon;
+    struct timespec prediction_horizon;
+    const char* arg_metric;
+    loadavgwatch_metric metric;
+    const char* source;
+    const char* psi_trigger;
+    const char* arg_time_constants;
+    struct timespec time_constants[3];
+    const char* replay_file;
+    const char* record_file;
+    const char* status_name;
+    const char* group_name;
+    // Snapshot fields that the load source fills, or 0 when they are
+    // not known, as in replays:
+    uint32_t source_fields;
 
     // These values are used inside main() to do actions:
+    const char* config_file;
     const char* start_command;
     const char* stop_command;
+    bool honor_counts;
+    const char* arg_max_per_decision;
+    uint32_t max_per_decision;
+    const char* jobserver_path;
+    const char* arg_max_tokens;
+    uint32_t max_tokens;
+    const char* admission_socket;
+    const char* arg_max_slots;
+    uint32_t max_slots;
     bool has_timeout;
     const char* arg_timeout;
     struct timespec timeout;
+    const char* arg_poll_interval;
+    struct timespec poll_interval;
+    const char* arg_max_poll_interval;
+    struct timespec max_poll_interval;
+    const char* arg_poll_band;
+    loadavgwatch_load poll_band;
     bool dry_run;
     bool verbose;
 } program_options;
@@ -87,12 +135,43 @@ typedef struct option_argument {
     const char** previous_value;
 } option_argument;
 
+typedef struct metric_argument {
+    const char* name;
+    loadavgwatch_metric metric;
+    // Snapshot field that the load source must fill for this metric:
+    loadavgwatch_snapshot_field field;
+} metric_argument;
+
+static const metric_argument METRIC_ARGUMENTS[] = {
+    {"1min", LOADAVGWATCH_METRIC_LOAD_1MIN, LOADAVGWATCH_SNAPSHOT_LOAD},
+    {"5min", LOADAVGWATCH_METRIC_LOAD_5MIN, LOADAVGWATCH_SNAPSHOT_LOAD},
+    {"15min", LOADAVGWATCH_METRIC_LOAD_15MIN, LOADAVGWATCH_SNAPSHOT_LOAD},
+    {"running",
+     LOADAVGWATCH_METRIC_RUNNING_TASKS,
+     LOADAVGWATCH_SNAPSHOT_RUNNING_TASKS},
+    {"psi10",
+     LOADAVGWATCH_METRIC_CPU_PRESSURE_10S,
+     LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE},
+    {"psi60",
+     LOADAVGWATCH_METRIC_CPU_PRESSURE_60S,
+     LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE},
+    {"psi300",
+     LOADAVGWATCH_METRIC_CPU_PRESSURE_300S,
+     LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE},
+};
+
 typedef struct timespec_argument {
     const char* name;
     const char* value_str;
     struct timespec* destination;
 } timespec_argument;
 
+typedef struct count_argument {
+    const char* name;
+    const char* value_str;
+    uint32_t* destination;
+} count_argument;
+
 static void write_time_prefix(FILE* stream)
 {
     const char* format = "%H:%M:%S%z";
@@ -142,29 +221,80 @@ static struct {
     loadavgwatch_log_object* error;
 } g_log;
 
-static unsigned g_child_execution_warning_timeout;
-static const char* g_child_action;
-static const char* g_shortest_interval_name;
+typedef struct child_process
+{
+    pid_t pid;
+    const char* action;
+    struct timespec started;
+} child_process;
+
+/**
+ * Commands run in the background while polling continues. SIGCHLD
+ * handler writes to wake_pipe so that the wait between polls ends
+ * when a command finishes and the child can be reaped.
+ */
+static struct {
+    child_process* processes;
+    size_t count;
+    size_t capacity;
+    int wake_pipe[2];
+} g_children = {
+    .wake_pipe = {-1, -1}
+};
+
+static void sigchld_handler(int sig)
+{
+    int saved_errno = errno;
+    // Pipe is non-blocking. If it is full, there already is a pending
+    // wake up:
+    ssize_t written = write(g_children.wake_pipe[1], "c", 1);
+    (void)written;
+    errno = saved_errno;
+}
+
+/**
+ * SIGHUP asks to read the rules again. The handler ends the wait
+ * between polls through the same pipe as finished commands do.
+ */
+static volatile sig_atomic_t g_reload_requested = 0;
 
-static void
-alarm_handler(int sig, siginfo_t* info, void* ucontext)
+static void sighup_handler(int sig)
 {
-    static char warning_message[256];
-    snprintf(
-        warning_message,
-        sizeof(warning_message),
-        "Process for %s action took more that %u seconds to execute that is more than %s! "
-        "You might want to see the README for hints for using this program.",
-        g_child_action,
-        g_child_execution_warning_timeout,
-        g_shortest_interval_name);
-    log_warning(warning_message, stderr);
+    int saved_errno = errno;
+    g_reload_requested = 1;
+    ssize_t written = write(g_children.wake_pipe[1], "r", 1);
+    (void)written;
+    errno = saved_errno;
 }
 
-static int init_library(loadavgwatch_state** out_state)
+/**
+ * Timer that expires at absolute monotonic deadlines. Without it waits
+ * are rounded up to poll() timeout milliseconds.
+ */
+static int g_wait_timer_fd = -1;
+
+#ifdef __linux__
+/**
+ * Admission control server of --admission-socket. Its clients are
+ * served while waiting between polls.
+ */
+static admission_server* g_admission = NULL;
+#endif
+
+static int init_library(
+    loadavgwatch_state** out_state, const loadavgwatch_trace* replay_trace)
 {
-    loadavgwatch_status open_ret = loadavgwatch_open_logging(
-        out_state, g_log.warning, g_log.error);
+    loadavgwatch_status open_ret;
+    if (replay_trace != NULL) {
+        open_ret = loadavgwatch_open_virtual(
+            out_state,
+            g_log.warning,
+            g_log.error,
+            loadavgwatch_trace_get_header(replay_trace)->ncpus);
+    } else {
+        open_ret = loadavgwatch_open_logging(
+            out_state, g_log.warning, g_log.error);
+    }
     switch (open_ret) {
     case LOADAVGWATCH_ERR_OUT_OF_MEMORY:
         PRINT_LOG_MESSAGE(
@@ -203,6 +333,90 @@ static void show_version(const program_options* program_options)
     printf("There is NO WARRANTY, to the extent permitted by law.\n");
 }
 
+static void load_to_string(
+    const loadavgwatch_load* load, char* out_buffer, size_t buffer_size)
+{
+    uint32_t whole = load->load / load->scale;
+    uint32_t hundredths = (uint32_t)(
+        (uint64_t)(load->load % load->scale) * 100 / load->scale);
+    snprintf(out_buffer, buffer_size, "%u.%02u", whole, hundredths);
+}
+
+static const char* metric_to_string(loadavgwatch_metric metric)
+{
+    for (size_t i = 0;
+         i < sizeof(METRIC_ARGUMENTS) / sizeof(METRIC_ARGUMENTS[0]);
+         ++i) {
+        if (METRIC_ARGUMENTS[i].metric == metric) {
+            return METRIC_ARGUMENTS[i].name;
+        }
+    }
+    return "unknown";
+}
+
+static bool parse_metric_argument(
+    const char* argument_str, loadavgwatch_metric* out_metric)
+{
+    for (size_t i = 0;
+         i < sizeof(METRIC_ARGUMENTS) / sizeof(METRIC_ARGUMENTS[0]);
+         ++i) {
+        if (strcmp(METRIC_ARGUMENTS[i].name, argument_str) == 0) {
+            *out_metric = METRIC_ARGUMENTS[i].metric;
+            return true;
+        }
+    }
+    PRINTF_LOG_MESSAGE(
+        g_log.error, "Unknown --metric value '%s'!", argument_str);
+    return false;
+}
+
+/**
+ * Checks that the load source fills the value that the metric is read
+ * from. Metrics are accepted when the source is not known.
+ */
+static bool source_provides_metric(
+    const program_options* options, loadavgwatch_metric metric)
+{
+    for (size_t i = 0;
+         i < sizeof(METRIC_ARGUMENTS) / sizeof(METRIC_ARGUMENTS[0]);
+         ++i) {
+        if (METRIC_ARGUMENTS[i].metric != metric) {
+            continue;
+        }
+        if (options->source_fields == 0
+            || (options->source_fields & METRIC_ARGUMENTS[i].field)) {
+            return true;
+        }
+        PRINTF_LOG_MESSAGE(
+            g_log.error,
+            "Load source does not provide --metric=%s!",
+            METRIC_ARGUMENTS[i].name);
+        return false;
+    }
+    return false;
+}
+
+/**
+ * Polls the load source once to find out which values it provides, so
+ * that a metric that the source does not have is an error at startup
+ * instead of a failure on every poll. The poll is forgotten afterwards.
+ */
+static bool read_source_fields(
+    loadavgwatch_state* state, program_options* inout_options)
+{
+    loadavgwatch_poll_result result;
+    loadavgwatch_snapshot snapshot = {0};
+    loadavgwatch_status poll_status = loadavgwatch_poll_snapshot(
+        state, &result, &snapshot);
+    loadavgwatch_reset(state);
+    if (poll_status != LOADAVGWATCH_OK && snapshot.fields == 0) {
+        PRINT_LOG_MESSAGE(g_log.error, "Unable to read the load source!");
+        return false;
+    }
+    inout_options->source_fields = snapshot.fields;
+    return source_provides_metric(inout_options, inout_options->metric);
+}
+
 #define PROGRAM_OPTION_TIMESPEC_TO_STRING(option_name) \
     char option_name[32] = ""; \
     _timespec_to_string( \
@@ -214,6 +428,17 @@ static void show_help(const program_options* program_options, char* argv[])
     PROGRAM_OPTION_TIMESPEC_TO_STRING(quiet_period_over_stop);
     PROGRAM_OPTION_TIMESPEC_TO_STRING(start_interval);
     PROGRAM_OPTION_TIMESPEC_TO_STRING(stop_interval);
+    PROGRAM_OPTION_TIMESPEC_TO_STRING(poll_interval);
+    PROGRAM_OPTION_TIMESPEC_TO_STRING(prediction_horizon);
+    char poll_band[24];
+    load_to_string(&program_options->poll_band, poll_band, sizeof(poll_band));
+    char time_constants[3][32];
+    for (size_t i = 0; i < 3; ++i) {
+        _timespec_to_string(
+            &program_options->time_constants[i],
+            time_constants[i],
+            sizeof(time_constants[i]));
+    }
     printf("Usage: %s [options]\n", argv[0]);
     printf(
 "Execute actions based on the current machine load (1 minute load average).\n"
@@ -224,20 +449,40 @@ static void show_help(const program_options* program_options, char* argv[])
 "                       Command to run while we still are under the start load value.\n"
 "  -t, --stop-command <command>\n"
 "                       Command to run when we go over the stop load limit.\n"
+"  --config <file>      Read rules with their own commands, load limits, intervals and\n"
+"                       metrics from a file. Rules share one load sample per poll.\n"
+"  --honor-counts       Run as many commands per decision as there are processes that fit\n"
+"                       under the start load or exceed the stop load instead of one.\n"
+"  --max-per-decision <count>\n"
+"                       Maximum number of commands per decision with --honor-counts (%u).\n"
+"  --jobserver <path>   Create a GNU make jobserver fifo that gets a token for every process\n"
+"                       that fits under the start load and loses one for every process over\n"
+"                       the stop load. Builds use it with MAKEFLAGS=--jobserver-auth=fifo:<path>.\n"
+"  --max-tokens <count> Maximum number of tokens in the jobserver (%u).\n"
+"  --admission-socket <path>\n"
+"                       Listen on a Unix socket where clients request slots and get them\n"
+"                       when processes fit under the start load. Slots are held until the\n"
+"                       client disconnects and then go to the next waiting client.\n"
+"  --max-slots <count>  Maximum number of open admission slots (%u).\n",
+program_options->max_per_decision,
+program_options->max_tokens,
+program_options->max_slots
 );
-    float start_load = (double)program_options->start_load.load / program_options->start_load.scale;
-    float stop_load = (double)program_options->stop_load.load / program_options->stop_load.scale;
+    char start_load[24];
+    load_to_string(&program_options->start_load, start_load, sizeof(start_load));
+    char stop_load[24];
+    load_to_string(&program_options->stop_load, stop_load, sizeof(stop_load));
     printf(
-"  --max-start <value>  Maximum load value where we still execute the start command (%0.2f).\n"
-"  --min-stop <value>   Minimum load value where we start executing the stop command (%0.2f).\n",
+"  --max-start <value>  Maximum load value where we still execute the start command (%s).\n"
+"  --min-stop <value>   Minimum load value where we start executing the stop command (%s).\n",
 start_load,
 stop_load
 );
 printf(
 "  --quiet-max-start <time>\n"
-"                       Do not start new processes for this long (%s) when the maximum start load (%0.2f) has been exceeded.\n"
+"                       Do not start new processes for this long (%s) when the maximum start load (%s) has been exceeded.\n"
 "  --quiet-min-stop <time>\n"
-"                       Do not start new processes for this long (%s) when the minimum stop load (%0.2f) has been exceeded.\n",
+"                       Do not start new processes for this long (%s) when the minimum stop load (%s) has been exceeded.\n",
 quiet_period_over_start,
 start_load,
 quiet_period_over_stop,
@@ -246,13 +491,57 @@ stop_load
 printf(
 "  --start-interval <time>\n"
 "                       Time we wait between subsequent start commands (%s).\n"
+"  --start-burst <count>\n"
+"                       Number of start commands that can follow each other without waiting\n"
+"                       for the start interval after a period without starts (%u).\n"
 "  --stop-interval <time>\n"
-"                       Time we wait between subsequent stop commands (%s).\n",
+"                       Time we wait between subsequent stop commands (%s).\n"
+"  --predict <time>     Compare load limits against the load that the trend of recent polls\n"
+"                       predicts after this time. Zero disables prediction (%s).\n",
 start_interval,
-stop_interval
+program_options->start_burst,
+stop_interval,
+prediction_horizon
+);
+printf(
+"  --metric <name>      Value that the load limits are compared against: 1min, 5min, 15min,\n"
+"                       running for the number of currently running tasks, or psi10, psi60\n"
+"                       or psi300 for CPU pressure percentages (%s).\n",
+metric_to_string(program_options->metric)
+);
+printf(
+"  --source <name>      Where load values are read from. On Linux this is loadavg, sysinfo,\n"
+"                       stat to calculate load averages from /proc/stat on every poll,\n"
+"                       cgroup to calculate them from the CPU usage of the current cgroup,\n"
+"                       or psi to also wake up on CPU pressure stall notifications.\n"
+"  --psi-trigger <trigger>\n"
+"                       CPU pressure that wakes up psi source (some 150000 1000000).\n"
+"  --time-constants <time>,<time>,<time>\n"
+"                       Time constants of the load averages that stat and cgroup sources\n"
+"                       calculate (%s,%s,%s).\n"
+"  --poll-interval <time>\n"
+"                       Time between load polls when there are no commands to run (%s).\n"
+"  --max-poll-interval <time>\n"
+"                       Double the time between polls up to this while the load stays\n"
+"                       further than the poll band from the load limits. By default polls\n"
+"                       are not backed off.\n"
+"  --poll-band <value>  Poll every poll interval when the load is within this from the\n"
+"                       load limits or moves towards them (%s).\n",
+time_constants[0],
+time_constants[1],
+time_constants[2],
+poll_interval,
+poll_band
 );
 printf(
 "  --timeout <time>     Execute only for specified amount of time. Otherwise run until interrupted.\n"
+"  --record <file>      Append every polled load sample and decision to a binary load trace.\n"
+"  --status-name <name> Publish the load, limits and decisions of every poll in shared memory\n"
+"                       object /loadavgwatch.<name> for other processes to read.\n"
+"  --group <name>       Do not start processes within the start interval of a start of any\n"
+"                       other program or rule with the same group name on this machine.\n"
+"  --replay <file>      Replay a recorded load trace and show the start and stop decisions\n"
+"                       that the other options would result in. No commands are run.\n"
 "  --dry-run            Do not run any commands. Only show what would be done.\n"
 "  -v, --verbose        Show verbose output.\n"
 "  --version            Show version information.\n"
@@ -270,6 +559,8 @@ static void show_values(const program_options* program_options)
     PROGRAM_OPTION_TIMESPEC_TO_STRING(start_interval);
     PRINTF_LOG_MESSAGE(
         g_log.info, "start-interval=%s", start_interval);
+    PRINTF_LOG_MESSAGE(
+        g_log.info, "start-burst=%u", program_options->start_burst);
     PROGRAM_OPTION_TIMESPEC_TO_STRING(stop_interval);
     PRINTF_LOG_MESSAGE(
         g_log.info, "stop-interval=%s", stop_interval);
@@ -333,7 +624,14 @@ static bool parse_load_argument(
             g_log.error, "Invalid %s: %s", argument_name, argument_str);
         return false;
     }
-    out_load->load = 100 * load;
+    if (load * 100 >= UINT32_MAX) {
+        PRINTF_LOG_MESSAGE(
+            g_log.error, "%s is too large (%s)!", argument_name, argument_str);
+        return false;
+    }
+    // Round to the nearest hundredth so that values like 0.29 that
+    // do not have an exact binary representation don't get truncated:
+    out_load->load = (uint32_t)(100 * load + 0.5);
     out_load->scale = 100;
     return true;
 }
@@ -353,6 +651,55 @@ static bool argument_name_matches(
         wanted_name, current_argument, equal_sign - current_argument) == 0;
 }
 
+static struct timespec timespec_add(
+    const struct timespec* left, const struct timespec* right)
+{
+    struct timespec result = *left;
+    result.tv_sec += right->tv_sec;
+    result.tv_nsec += right->tv_nsec;
+    if (result.tv_nsec > 999999999) {
+        result.tv_nsec -= 1000000000;
+        result.tv_sec += 1;
+    }
+    return result;
+}
+
+static struct timespec timespec_sub(
+    const struct timespec* left, const struct timespec* right)
+{
+    assert(left->tv_sec >= right->tv_sec);
+    assert(!(left->tv_sec == right->tv_sec
+             && left->tv_nsec < right->tv_nsec));
+    struct timespec result = *left;
+    result.tv_sec -= right->tv_sec;
+    if (result.tv_nsec < right->tv_nsec) {
+        result.tv_sec -= 1;
+        result.tv_nsec += 1000000000;
+    }
+    result.tv_nsec -= right->tv_nsec;
+    return result;
+}
+
+typedef enum TimespecCmp {
+    TS_LEFT_SMALLER = -1,
+    TS_RIGHT_SMALLER = 1,
+} TimespecCmp;
+
+static TimespecCmp timespec_cmp(
+    const struct timespec* left, const struct timespec* right)
+{
+    if (left->tv_sec < right->tv_sec) {
+        return TS_LEFT_SMALLER;
+    }
+    if (right->tv_sec < left->tv_sec) {
+        return TS_RIGHT_SMALLER;
+    }
+    if (left->tv_nsec < right->tv_nsec) {
+        return TS_LEFT_SMALLER;
+    }
+    return TS_RIGHT_SMALLER;
+}
+
 static setup_options_result setup_options(
     loadavgwatch_state* state,
     int argc,
@@ -363,6 +710,8 @@ static setup_options_result setup_options(
     out_program_options->start_load = loadavgwatch_get_start_load(state);
     out_program_options->arg_start_interval = NULL;
     out_program_options->start_interval = loadavgwatch_get_start_interval(state);
+    out_program_options->arg_start_burst = NULL;
+    out_program_options->start_burst = loadavgwatch_get_start_burst(state);
     out_program_options->arg_quiet_period_over_start = NULL;
     out_program_options->quiet_period_over_start = loadavgwatch_get_quiet_period_over_start(state);
     out_program_options->arg_stop_load = NULL;
@@ -371,27 +720,80 @@ static setup_options_result setup_options(
     out_program_options->stop_interval = loadavgwatch_get_stop_interval(state);
     out_program_options->arg_quiet_period_over_stop = NULL;
     out_program_options->quiet_period_over_stop = loadavgwatch_get_quiet_period_over_stop(state);
+    out_program_options->arg_prediction_horizon = NULL;
+    out_program_options->prediction_horizon = loadavgwatch_get_prediction_horizon(state);
+    out_program_options->arg_metric = NULL;
+    out_program_options->source_fields = 0;
+    out_program_options->metric = loadavgwatch_get_metric(state);
+    out_program_options->source = NULL;
+    out_program_options->psi_trigger = NULL;
+    out_program_options->arg_time_constants = NULL;
+    out_program_options->time_constants[0] = (struct timespec){60, 0};
+    out_program_options->time_constants[1] = (struct timespec){5 * 60, 0};
+    out_program_options->time_constants[2] = (struct timespec){15 * 60, 0};
+    out_program_options->replay_file = NULL;
+    out_program_options->record_file = NULL;
+    out_program_options->status_name = NULL;
+    out_program_options->group_name = NULL;
 
     // Default values:
+    out_program_options->config_file = NULL;
     out_program_options->start_command = NULL;
     out_program_options->stop_command = NULL;
+    out_program_options->honor_counts = false;
+    out_program_options->arg_max_per_decision = NULL;
+    long ncpus = loadavgwatch_get_ncpus(state);
+    out_program_options->max_per_decision = ncpus > 0 ? (uint32_t)ncpus : 1;
+    out_program_options->jobserver_path = NULL;
+    out_program_options->arg_max_tokens = NULL;
+    out_program_options->max_tokens = out_program_options->max_per_decision;
+    out_program_options->admission_socket = NULL;
+    out_program_options->arg_max_slots = NULL;
+    out_program_options->max_slots = out_program_options->max_per_decision;
     out_program_options->has_timeout = false;
     out_program_options->arg_timeout = NULL;
+    // 3 pollings in 1 minute should result in high enough default
+    // polling rate to catch relatively soon 1 minute load average
+    // changes.
+    out_program_options->arg_poll_interval = NULL;
+    out_program_options->poll_interval = (struct timespec){20, 0};
+    out_program_options->arg_max_poll_interval = NULL;
+    out_program_options->arg_poll_band = NULL;
+    out_program_options->poll_band = (loadavgwatch_load){50, 100};
     out_program_options->dry_run = false;
     out_program_options->verbose = false;
 
     option_argument option_arguments[] = {
+        {"--config", &out_program_options->config_file},
         {"--start-command", &out_program_options->start_command},
         {"-s", &out_program_options->start_command},
         {"--stop-command", &out_program_options->stop_command},
         {"-t", &out_program_options->stop_command},
+        {"--max-per-decision", &out_program_options->arg_max_per_decision},
+        {"--jobserver", &out_program_options->jobserver_path},
+        {"--max-tokens", &out_program_options->arg_max_tokens},
+        {"--admission-socket", &out_program_options->admission_socket},
+        {"--max-slots", &out_program_options->arg_max_slots},
         {"--max-start", &out_program_options->arg_start_load},
         {"--start-interval", &out_program_options->arg_start_interval},
+        {"--start-burst", &out_program_options->arg_start_burst},
         {"--quiet-max-start", &out_program_options->arg_quiet_period_over_start},
         {"--min-stop", &out_program_options->arg_stop_load},
         {"--stop-interval", &out_program_options->arg_stop_interval},
         {"--quiet-min-stop", &out_program_options->arg_quiet_period_over_stop},
-        {"--timeout", &out_program_options->arg_timeout}
+        {"--predict", &out_program_options->arg_prediction_horizon},
+        {"--metric", &out_program_options->arg_metric},
+        {"--source", &out_program_options->source},
+        {"--psi-trigger", &out_program_options->psi_trigger},
+        {"--time-constants", &out_program_options->arg_time_constants},
+        {"--poll-interval", &out_program_options->arg_poll_interval},
+        {"--max-poll-interval", &out_program_options->arg_max_poll_interval},
+        {"--poll-band", &out_program_options->arg_poll_band},
+        {"--timeout", &out_program_options->arg_timeout},
+        {"--replay", &out_program_options->replay_file},
+        {"--record", &out_program_options->record_file},
+        {"--status-name", &out_program_options->status_name},
+        {"--group", &out_program_options->group_name}
     };
 
     for (int argument = 1; argument < argc; ++argument) {
@@ -409,6 +811,9 @@ static setup_options_result setup_options(
         } else if (strcmp(current_argument, "--dry-run") == 0) {
             out_program_options->dry_run = true;
             continue;
+        } else if (strcmp(current_argument, "--honor-counts") == 0) {
+            out_program_options->honor_counts = true;
+            continue;
         } else if (strcmp(current_argument, "--version") == 0) {
             show_version(out_program_options);
             return OPTIONS_VERSION;
@@ -453,6 +858,15 @@ static setup_options_result setup_options(
         {"--quiet-min-stop",
          out_program_options->arg_quiet_period_over_stop,
          &out_program_options->quiet_period_over_stop},
+        {"--predict",
+         out_program_options->arg_prediction_horizon,
+         &out_program_options->prediction_horizon},
+        {"--poll-interval",
+         out_program_options->arg_poll_interval,
+         &out_program_options->poll_interval},
+        {"--max-poll-interval",
+         out_program_options->arg_max_poll_interval,
+         &out_program_options->max_poll_interval},
         {"--timeout",
          out_program_options->arg_timeout,
          &out_program_options->timeout}
@@ -513,148 +927,1082 @@ static setup_options_result setup_options(
         loadavgwatch_set_quiet_period_over_stop(
             state, &out_program_options->quiet_period_over_stop);
     }
+    // Rules get the load limits of the command line for the ones that
+    // they do not set, so every combination is checked here:
+    const loadavgwatch_load* start_load = &out_program_options->start_load;
+    const loadavgwatch_load* stop_load = &out_program_options->stop_load;
+    if (((uint64_t)start_load->load + start_load->scale) * stop_load->scale
+        > (uint64_t)stop_load->load * start_load->scale) {
+        char start_str[24];
+        load_to_string(start_load, start_str, sizeof(start_str));
+        char stop_str[24];
+        load_to_string(stop_load, stop_str, sizeof(stop_str));
+        PRINTF_LOG_MESSAGE(
+            g_log.error,
+            "--max-start load %s must be at least one less than --min-stop load %s!",
+            start_str,
+            stop_str);
+        return OPTIONS_FAILURE;
+    }
+    if (out_program_options->arg_prediction_horizon != NULL) {
+        if (loadavgwatch_set_prediction_horizon(
+                state, &out_program_options->prediction_horizon)
+            != LOADAVGWATCH_OK) {
+            return OPTIONS_FAILURE;
+        }
+    }
+
+    if (out_program_options->arg_metric != NULL) {
+        if (!parse_metric_argument(
+                out_program_options->arg_metric,
+                &out_program_options->metric)) {
+            return OPTIONS_FAILURE;
+        }
+        loadavgwatch_set_metric(state, out_program_options->metric);
+    }
+
+    // Trigger needs to be known before the pressure file is opened:
+    if (out_program_options->psi_trigger != NULL) {
+        loadavgwatch_parameter psi_trigger = {
+            "psi-trigger", (void*)out_program_options->psi_trigger
+        };
+        if (loadavgwatch_set_parameter(state, &psi_trigger)
+            != LOADAVGWATCH_OK) {
+            return OPTIONS_FAILURE;
+        }
+    }
+    if (out_program_options->source != NULL) {
+        loadavgwatch_parameter source = {
+            "source", (void*)out_program_options->source
+        };
+        if (loadavgwatch_set_parameter(state, &source) != LOADAVGWATCH_OK) {
+            return OPTIONS_FAILURE;
+        }
+    }
+    if (out_program_options->arg_time_constants != NULL) {
+        if (!_string_to_timespec_list(
+                out_program_options->arg_time_constants,
+                out_program_options->time_constants,
+                3)) {
+            PRINTF_LOG_MESSAGE(
+                g_log.error,
+                "'%s' is not a valid --time-constants value!",
+                out_program_options->arg_time_constants);
+            return OPTIONS_FAILURE;
+        }
+        loadavgwatch_parameter time_constants = {
+            "stat-time-constants", out_program_options->time_constants
+        };
+        if (loadavgwatch_set_parameter(state, &time_constants)
+            != LOADAVGWATCH_OK) {
+            return OPTIONS_FAILURE;
+        }
+    }
+    if (out_program_options->poll_interval.tv_sec == 0
+        && out_program_options->poll_interval.tv_nsec == 0) {
+        PRINT_LOG_MESSAGE(g_log.error, "Poll interval can not be zero!");
+        return OPTIONS_FAILURE;
+    }
+    if (out_program_options->arg_max_poll_interval == NULL) {
+        out_program_options->max_poll_interval =
+            out_program_options->poll_interval;
+    } else if (timespec_cmp(
+                   &out_program_options->max_poll_interval,
+                   &out_program_options->poll_interval) == TS_LEFT_SMALLER) {
+        PRINT_LOG_MESSAGE(
+            g_log.error,
+            "Maximum poll interval can not be shorter than the poll interval!");
+        return OPTIONS_FAILURE;
+    }
+    if (out_program_options->arg_poll_band != NULL
+        && !parse_load_argument(
+            "--poll-band",
+            out_program_options->arg_poll_band,
+            &out_program_options->poll_band)) {
+        return OPTIONS_FAILURE;
+    }
 
     if (out_program_options->arg_timeout != NULL) {
         out_program_options->has_timeout = true;
     }
+    count_argument count_arguments[] = {
+        {"--max-per-decision",
+         out_program_options->arg_max_per_decision,
+         &out_program_options->max_per_decision},
+        {"--max-tokens",
+         out_program_options->arg_max_tokens,
+         &out_program_options->max_tokens},
+        {"--max-slots",
+         out_program_options->arg_max_slots,
+         &out_program_options->max_slots},
+        {"--start-burst",
+         out_program_options->arg_start_burst,
+         &out_program_options->start_burst},
+    };
+    for (size_t i = 0; i < sizeof(count_arguments) / sizeof(count_arguments[0]); ++i) {
+        if (count_arguments[i].value_str == NULL) {
+            continue;
+        }
+        char* endptr = NULL;
+        unsigned long count = strtoul(count_arguments[i].value_str, &endptr, 10);
+        if (*endptr != '\0'
+            || endptr == count_arguments[i].value_str
+            || count == 0
+            || count > UINT32_MAX) {
+            PRINTF_LOG_MESSAGE(
+                g_log.error,
+                "'%s' is not a valid %s value!",
+                count_arguments[i].value_str,
+                count_arguments[i].name);
+            return OPTIONS_FAILURE;
+        }
+        *count_arguments[i].destination = (uint32_t)count;
+    }
+    if (out_program_options->arg_start_burst != NULL) {
+        loadavgwatch_set_start_burst(state, out_program_options->start_burst);
+    }
+    if (out_program_options->arg_max_tokens == NULL) {
+        out_program_options->max_tokens = out_program_options->max_per_decision;
+    }
+    if (out_program_options->arg_max_slots == NULL) {
+        out_program_options->max_slots = out_program_options->max_per_decision;
+    }
+    if (out_program_options->config_file != NULL
+        && out_program_options->jobserver_path != NULL) {
+        PRINT_LOG_MESSAGE(
+            g_log.error, "--jobserver can not be used together with --config!");
+        return OPTIONS_FAILURE;
+    }
+    if (out_program_options->admission_socket != NULL) {
+#ifdef __linux__
+        if (out_program_options->config_file != NULL) {
+            PRINT_LOG_MESSAGE(
+                g_log.error,
+                "--admission-socket can not be used together with --config!");
+            return OPTIONS_FAILURE;
+        }
+        if (out_program_options->jobserver_path != NULL) {
+            PRINT_LOG_MESSAGE(
+                g_log.error,
+                "--admission-socket can not be used together with --jobserver!");
+            return OPTIONS_FAILURE;
+        }
+#else
+        PRINT_LOG_MESSAGE(
+            g_log.error, "--admission-socket is only supported on Linux!");
+        return OPTIONS_FAILURE;
+#endif
+    }
+    if (out_program_options->config_file != NULL
+        && (out_program_options->start_command != NULL
+            || out_program_options->stop_command != NULL)) {
+        PRINT_LOG_MESSAGE(
+            g_log.error,
+            "Commands are given in the rules of --config file instead of options!");
+        return OPTIONS_FAILURE;
+    }
+    if (out_program_options->replay_file != NULL
+        && out_program_options->record_file != NULL) {
+        PRINT_LOG_MESSAGE(
+            g_log.error, "--record can not be used together with --replay!");
+        return OPTIONS_FAILURE;
+    }
+    // Replayed starts would be in the time of the trace:
+    if (out_program_options->replay_file != NULL
+        && out_program_options->group_name != NULL) {
+        PRINT_LOG_MESSAGE(
+            g_log.error, "--group can not be used together with --replay!");
+        return OPTIONS_FAILURE;
+    }
 
     return OPTIONS_OK;
 }
 
-bool run_sh_command(const char* command)
+/**
+ * Sets up reaping of finished commands. SIGHUP reloads the rules only
+ * when there is a --config file to reload, otherwise it terminates the
+ * program as usual.
+ */
+static bool setup_children(bool reloadable)
 {
-    pid_t child_pid = fork();
-    if (child_pid == -1) {
-        PRINT_LOG_MESSAGE(
-            g_log.error,
-            "Unable to fork() a new process. This should never happen!");
+    if (pipe(g_children.wake_pipe) != 0) {
         return false;
     }
-    if (child_pid == 0) {
-        char* const child_args[] = {"/bin/sh", "-c", (char*)command, NULL};
-        int result = execv("/bin/sh", child_args);
-        if (result == -1) {
-            PRINT_LOG_MESSAGE(g_log.error, "Unable to execute /bin/sh");
+    for (int i = 0; i < 2; ++i) {
+        int fd = g_children.wake_pipe[i];
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0
+            || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
             return false;
         }
     }
-    int wait_status;
-    pid_t waited = -1;
-    // If we get a signal while we're in wait() function, it will
-    // result in -1 return value.
-    while (waited == -1) {
-        waited = wait(&wait_status);
-    }
-    assert(waited == child_pid);
+    struct sigaction child_action = {
+        .sa_handler = sigchld_handler,
+        .sa_flags = SA_RESTART | SA_NOCLDSTOP,
+    };
+    sigemptyset(&child_action.sa_mask);
+    struct sigaction reload_action = {
+        .sa_handler = sighup_handler,
+        .sa_flags = SA_RESTART,
+    };
+    sigemptyset(&reload_action.sa_mask);
+    return sigaction(SIGCHLD, &child_action, NULL) == 0
+        && (!reloadable || sigaction(SIGHUP, &reload_action, NULL) == 0);
+}
+
+static void setup_wait_timer(void)
+{
+#ifdef __linux__
+    g_wait_timer_fd = timerfd_create(
+        CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+#endif
+}
+
+static void log_child_exit(const child_process* child, int wait_status)
+{
     if (!WIFEXITED(wait_status)) {
-        PRINT_LOG_MESSAGE(
+        PRINTF_LOG_MESSAGE(
             g_log.warning,
-            "Child process did not exit normally!");
+            "Process %ld for %s action did not exit normally!",
+            (long)child->pid,
+            child->action);
     } else if (WEXITSTATUS(wait_status) != EXIT_SUCCESS) {
         PRINTF_LOG_MESSAGE(
             g_log.warning,
-            "Child process exited with non-successful code %d!",
+            "Process %ld for %s action exited with non-successful code %d!",
+            (long)child->pid,
+            child->action,
             WEXITSTATUS(wait_status));
     }
-    return true;
 }
 
-static void run_command(
-    const char* command,
-    const char* child_action,
-    const struct timespec* next_action_interval)
+/**
+ * Reaps all finished commands without blocking.
+ */
+static void reap_children(void)
 {
-    PRINTF_LOG_MESSAGE(g_log.info, "Running command: %s", command);
-    g_child_action = child_action;
-    g_child_execution_warning_timeout = next_action_interval->tv_sec + 1;
-    alarm(g_child_execution_warning_timeout);
-    if (!run_sh_command(command)) {
-        PRINT_LOG_MESSAGE(
-            g_log.error,
-            "Unable to run commands with /bin/sh! This should never happen");
-        abort();
+    char drained[64];
+    while (read(g_children.wake_pipe[0], drained, sizeof(drained)) > 0) {
+    }
+    int wait_status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wait_status, WNOHANG)) > 0) {
+        for (size_t i = 0; i < g_children.count; ++i) {
+            child_process* child = &g_children.processes[i];
+            if (child->pid != pid) {
+                continue;
+            }
+            log_child_exit(child, wait_status);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            PRINTF_LOG_MESSAGE(
+                g_log.info,
+                "Process %ld for %s action finished in %lds. %zu commands running.",
+                (long)pid,
+                child->action,
+                (long)(now.tv_sec - child->started.tv_sec),
+                g_children.count - 1);
+            // Order of the running commands does not matter:
+            *child = g_children.processes[--g_children.count];
+            break;
+        }
     }
-    alarm(0);
 }
 
-static struct timespec timespec_add(
-    const struct timespec* left, const struct timespec* right)
+/**
+ * Starts one of the instances of a command with the environment of the
+ * instance.
+ *
+ * Returns false and sets errno if a new process could not be created.
+ */
+static bool start_command(
+    const char* command, const char* action, char* const envp[])
 {
-    struct timespec result = *left;
-    result.tv_sec += right->tv_sec;
-    result.tv_nsec += right->tv_nsec;
-    if (result.tv_nsec > 999999999) {
-        result.tv_nsec -= 1000000000;
-        result.tv_sec += 1;
+    PRINTF_LOG_MESSAGE(g_log.info, "Running command: %s", command);
+    if (g_children.count == g_children.capacity) {
+        size_t capacity = g_children.capacity == 0
+            ? 8 : 2 * g_children.capacity;
+        child_process* processes = realloc(
+            g_children.processes, capacity * sizeof(child_process));
+        if (processes == NULL) {
+            PRINT_LOG_MESSAGE(
+                g_log.error, "Out of memory for tracking commands!");
+            abort();
+        }
+        g_children.processes = processes;
+        g_children.capacity = capacity;
     }
-    return result;
+    child_process* child = &g_children.processes[g_children.count];
+    if (!_spawn_command(command, envp, &child->pid)) {
+        return false;
+    }
+    child->action = action;
+    clock_gettime(CLOCK_MONOTONIC, &child->started);
+    ++g_children.count;
+    return true;
 }
 
-static struct timespec timespec_sub(
-    const struct timespec* left, const struct timespec* right)
+/**
+ * Runs the command once for a decision, or with --honor-counts once
+ * for every process that the decision counted. Commands can tell the
+ * instances apart with LOADAVGWATCH_INSTANCE (0 to instances - 1) and
+ * LOADAVGWATCH_INSTANCES environment variables.
+ *
+ * If a process can not be created, for example because of the process
+ * limit, the remaining instances of the decision are skipped.
+ */
+static void run_decision(
+    const program_options* options,
+    const char* command,
+    const char* action,
+    uint32_t count)
 {
-    assert(left->tv_sec >= right->tv_sec);
-    assert(!(left->tv_sec == right->tv_sec
-             && left->tv_nsec < right->tv_nsec));
-    struct timespec result = *left;
-    result.tv_sec -= right->tv_sec;
-    if (result.tv_nsec < right->tv_nsec) {
-        result.tv_sec -= 1;
-        result.tv_nsec += 1000000000;
-        result.tv_nsec -= right->tv_nsec;
+    if (command == NULL) {
+        return;
     }
-    return result;
+    uint32_t instances = 1;
+    if (options->honor_counts) {
+        instances = count < options->max_per_decision
+            ? count : options->max_per_decision;
+    }
+    if (options->dry_run) {
+        PRINTF_LOG_MESSAGE(
+            g_log.info, "Running %u times: %s", instances, command);
+        return;
+    }
+    instance_environment environment;
+    if (!_instance_environment_init(&environment, environ)) {
+        PRINT_LOG_MESSAGE(
+            g_log.error, "Out of memory for command environment!");
+        return;
+    }
+    for (uint32_t instance = 0; instance < instances; ++instance) {
+        _instance_environment_set(&environment, instance, instances);
+        if (!start_command(command, action, environment.envp)) {
+            PRINTF_LOG_MESSAGE(
+                g_log.error,
+                "Unable to start a new process: %s. Skipping %u of %u %s commands.",
+                strerror(errno),
+                instances - instance,
+                instances,
+                action);
+            break;
+        }
+    }
+    _instance_environment_free(&environment);
 }
 
-typedef enum TimespecCmp {
-    TS_LEFT_SMALLER = -1,
-    TS_RIGHT_SMALLER = 1,
-} TimespecCmp;
+/**
+ * Sleeps until the given monotonic time or until the load source
+ * signals a pressure event. NULL time sleeps until the event. Commands
+ * that finish meanwhile are reaped without ending the sleep. On Linux
+ * the deadline is an absolute timerfd expiration, so it is not rounded
+ * to milliseconds and interruptions do not move it.
+ *
+ * Returns false if the sleep ended early because of a pressure event
+ * or a reload request.
+ */
+static bool wait_for_next_action(int event_fd, const struct timespec* wake_at)
+{
+    int timer_fd = -1;
+#ifdef __linux__
+    if (wake_at != NULL && g_wait_timer_fd != -1) {
+        struct itimerspec expiration = {.it_value = *wake_at};
+        if (timerfd_settime(
+                g_wait_timer_fd, TFD_TIMER_ABSTIME, &expiration, NULL) == 0) {
+            timer_fd = g_wait_timer_fd;
+        }
+    }
+#endif
+    int admission_fd = -1;
+#ifdef __linux__
+    if (g_admission != NULL) {
+        admission_fd = g_admission->epoll_fd;
+    }
+#endif
+    while (true) {
+        if (g_reload_requested) {
+            return false;
+        }
+        int timeout_ms = -1;
+        if (wake_at != NULL) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (timespec_cmp(wake_at, &now) == TS_LEFT_SMALLER) {
+                return true;
+            }
+            struct timespec sleep_time = timespec_sub(wake_at, &now);
+            // Round up so that we do not wake up just before the deadline:
+            int64_t sleep_ms = (int64_t)sleep_time.tv_sec * 1000
+                + (sleep_time.tv_nsec + 999999) / 1000000;
+            timeout_ms = sleep_ms > INT_MAX ? INT_MAX : (int)sleep_ms;
+        }
+        if (timer_fd != -1) {
+            timeout_ms = -1;
+        }
+        // poll() ignores negative file descriptors, so the timer, the
+        // event and the admission clients can be left out by their
+        // values:
+        struct pollfd wait_polls[] = {
+            {.fd = g_children.wake_pipe[0], .events = POLLIN},
+            {.fd = timer_fd, .events = POLLIN},
+            {.fd = event_fd, .events = POLLPRI},
+            {.fd = admission_fd, .events = POLLIN},
+        };
+        int poll_return = poll(
+            wait_polls, sizeof(wait_polls) / sizeof(wait_polls[0]), timeout_ms);
+        if (poll_return == -1 && errno != EINTR) {
+            PRINTF_LOG_MESSAGE(
+                g_log.error,
+                "Unable to wait for load events: %s",
+                strerror(errno));
+            abort();
+        }
+        if (poll_return == 0) {
+            return true;
+        }
+        if (wait_polls[0].revents & POLLIN) {
+            reap_children();
+        }
+#ifdef __linux__
+        if (wait_polls[3].revents & POLLIN) {
+            _admission_handle(g_admission);
+        }
+#endif
+        if (wait_polls[1].revents & POLLIN) {
+            uint64_t expirations;
+            ssize_t read_size = read(timer_fd, &expirations, sizeof(expirations));
+            (void)read_size;
+            return true;
+        }
+        if (wait_polls[2].revents & (POLLERR | POLLNVAL)) {
+            PRINT_LOG_MESSAGE(g_log.error, "Load event trigger has gone away!");
+            abort();
+        }
+        if (wait_polls[2].revents & POLLPRI) {
+            PRINT_LOG_MESSAGE(g_log.info, "Woke up on a load event!");
+            return false;
+        }
+    }
+}
 
-static TimespecCmp timespec_cmp(
-    const struct timespec* left, const struct timespec* right)
+/**
+ * Waits for the commands that are still running when the program
+ * stops.
+ */
+static void wait_for_children(void)
 {
-    if (left->tv_sec < right->tv_sec) {
-        return TS_LEFT_SMALLER;
+    if (g_children.count > 0) {
+        PRINTF_LOG_MESSAGE(
+            g_log.info,
+            "Waiting for %zu running commands to finish.",
+            g_children.count);
     }
-    if (right->tv_sec < left->tv_sec) {
-        return TS_RIGHT_SMALLER;
+    while (g_children.count > 0) {
+        struct pollfd wake_poll = {
+            .fd = g_children.wake_pipe[0],
+            .events = POLLIN,
+        };
+        poll(&wake_poll, 1, -1);
+        reap_children();
     }
-    if (left->tv_nsec < right->tv_nsec) {
-        return TS_LEFT_SMALLER;
+}
+
+/**
+ * Start and stop decisions of one rule. Without --config the only rule
+ * decides with the state and the options of the program itself.
+ */
+typedef struct decision_rule
+{
+    const char* name;
+    loadavgwatch_state* state;
+    program_options options;
+    struct timespec next_start_at;
+    struct timespec next_stop_at;
+    loadavgwatch_poll_result result;
+    bool status_shared;
+} decision_rule;
+
+/**
+ * Rules are allocated once, so polls only go through this table.
+ */
+typedef struct decision_rules
+{
+    decision_rule* rules;
+    size_t count;
+    // Rules of a --config file have virtual states that are given the
+    // sample of the program state:
+    bool shared_sample;
+    config_rules config;
+} decision_rules;
+
+static bool read_config_file(const char* path, config_rules* out_config)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        PRINTF_LOG_MESSAGE(
+            g_log.error,
+            "Unable to read configuration file '%s': %s",
+            path,
+            strerror(errno));
+        return false;
     }
-    return TS_RIGHT_SMALLER;
+    char* text = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    bool read_ok = true;
+    while (read_ok) {
+        if (capacity - size < 1024) {
+            capacity = capacity == 0 ? 4096 : 2 * capacity;
+            char* new_text = realloc(text, capacity);
+            if (new_text == NULL) {
+                read_ok = false;
+                break;
+            }
+            text = new_text;
+        }
+        size_t read_size = fread(text + size, 1, capacity - size - 1, file);
+        size += read_size;
+        if (read_size == 0) {
+            read_ok = !ferror(file);
+            break;
+        }
+    }
+    fclose(file);
+    if (!read_ok) {
+        PRINTF_LOG_MESSAGE(
+            g_log.error, "Unable to read configuration file '%s'!", path);
+        free(text);
+        return false;
+    }
+    text[size] = '\0';
+    size_t error_line;
+    bool parsed = _config_parse(text, out_config, &error_line);
+    free(text);
+    if (!parsed && error_line == 0) {
+        PRINTF_LOG_MESSAGE(
+            g_log.error, "No rules in configuration file '%s'!", path);
+    } else if (!parsed) {
+        PRINTF_LOG_MESSAGE(
+            g_log.error,
+            "Invalid line %zu in configuration file '%s'!",
+            error_line,
+            path);
+    }
+    return parsed;
 }
 
-static int monitor_and_act(
-    loadavgwatch_state* state, program_options* options)
+static void close_rules(decision_rules* rules)
+{
+    for (size_t i = 0; rules->shared_sample && i < rules->count; ++i) {
+        loadavgwatch_close(&rules->rules[i].state);
+    }
+    free(rules->rules);
+    rules->rules = NULL;
+    rules->count = 0;
+    _config_free(&rules->config);
+}
+
+static bool setup_rule(
+    loadavgwatch_state* state,
+    const program_options* options,
+    char* argv[],
+    int argc,
+    decision_rule* out_rule)
+{
+    out_rule->name = argv[0];
+    if (loadavgwatch_open_virtual(
+            &out_rule->state,
+            g_log.warning,
+            g_log.error,
+            loadavgwatch_get_ncpus(state)) != LOADAVGWATCH_OK) {
+        out_rule->state = NULL;
+        return false;
+    }
+    _rules_copy_settings(state, out_rule->state);
+    if (options->verbose) {
+        loadavgwatch_set_log_info(out_rule->state, g_log.info);
+    }
+    program_options* rule_options = &out_rule->options;
+    if (setup_options(out_rule->state, argc, argv, rule_options)
+        != OPTIONS_OK) {
+        return false;
+    }
+    rule_options->honor_counts = rule_options->honor_counts
+        || options->honor_counts;
+    if (rule_options->arg_max_per_decision == NULL) {
+        rule_options->max_per_decision = options->max_per_decision;
+    }
+    rule_options->dry_run = options->dry_run;
+    rule_options->verbose = options->verbose;
+    rule_options->source_fields = options->source_fields;
+    // Rules decide from the sample of the program state:
+    if (!source_provides_metric(options, rule_options->metric)) {
+        return false;
+    }
+    if (rule_options->start_command == NULL
+        && rule_options->stop_command == NULL) {
+        PRINT_LOG_MESSAGE(g_log.error, "Rule has no start or stop command!");
+        return false;
+    }
+    // Rules of the same program coordinate with each other too:
+    return _rules_join_group(
+        out_rule->state,
+        options->group_name,
+        rule_options->start_command != NULL && !options->dry_run)
+        == LOADAVGWATCH_OK;
+}
+
+/**
+ * Sets up the rules of the --config file or the only rule of the
+ * command line options.
+ */
+static bool setup_rules(
+    loadavgwatch_state* state,
+    const program_options* options,
+    decision_rules* out_rules)
+{
+    memset(out_rules, 0, sizeof(*out_rules));
+    out_rules->shared_sample = options->config_file != NULL;
+    if (out_rules->shared_sample
+        && !read_config_file(options->config_file, &out_rules->config)) {
+        return false;
+    }
+    size_t count = out_rules->shared_sample ? out_rules->config.count : 1;
+    out_rules->rules = calloc(count, sizeof(decision_rule));
+    if (out_rules->rules == NULL) {
+        PRINT_LOG_MESSAGE(g_log.error, "Out of memory for rules!");
+        _config_free(&out_rules->config);
+        return false;
+    }
+    if (!out_rules->shared_sample) {
+        out_rules->rules[0].state = state;
+        out_rules->rules[0].options = *options;
+        out_rules->count = 1;
+        return true;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        config_rule* config = &out_rules->config.rules[i];
+        ++out_rules->count;
+        if (!setup_rule(
+                state,
+                options,
+                config->argv,
+                config->argc,
+                &out_rules->rules[i])) {
+            PRINTF_LOG_MESSAGE(
+                g_log.error,
+                "Invalid rule '%s' in configuration file '%s'!",
+                config->argv[0],
+                options->config_file);
+            if (out_rules->rules[i].state == NULL) {
+                --out_rules->count;
+            }
+            close_rules(out_rules);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads the --config file again. Rules that keep their name keep their
+ * library state, so their start and stop times, quiet periods and load
+ * history carry over and the new limits do not cause a burst of
+ * starts. Running commands stay tracked. On errors the current rules
+ * stay in use.
+ */
+static bool reload_rules(
+    loadavgwatch_state* state,
+    const program_options* options,
+    decision_rules* inout_rules)
+{
+    // New rules are first set up on their own states so that invalid
+    // rules do not change the rules in use:
+    decision_rules rules;
+    if (!setup_rules(state, options, &rules)) {
+        PRINTF_LOG_MESSAGE(
+            g_log.error,
+            "Keeping the current rules instead of '%s'!",
+            options->config_file);
+        return false;
+    }
+    for (size_t i = 0; i < rules.count; ++i) {
+        decision_rule* rule = &rules.rules[i];
+        for (size_t j = 0; j < inout_rules->count; ++j) {
+            decision_rule* previous = &inout_rules->rules[j];
+            // Group membership depends on the start command, so rules
+            // that gain or lose it start over:
+            if (previous->state == NULL
+                || strcmp(previous->name, rule->name) != 0
+                || (previous->options.start_command == NULL)
+                != (rule->options.start_command == NULL)) {
+                continue;
+            }
+            rule->next_start_at = previous->next_start_at;
+            rule->next_stop_at = previous->next_stop_at;
+            rule->status_shared = previous->status_shared;
+            _rules_carry_over(&rule->state, &previous->state);
+            break;
+        }
+    }
+    close_rules(inout_rules);
+    *inout_rules = rules;
+    PRINTF_LOG_MESSAGE(
+        g_log.info,
+        "Reloaded %zu rules from '%s'.",
+        rules.count,
+        options->config_file);
+    return true;
+}
+
+/**
+ * Publishes the status of every --config rule that does not publish it
+ * yet as <status name>.<rule name>. Reloaded rules are shared only
+ * after the rules that they replace have been closed, so that closing
+ * does not remove their shared memory objects.
+ */
+static void share_rule_status(
+    const program_options* options, decision_rules* rules)
+{
+    if (options->status_name == NULL || !rules->shared_sample) {
+        return;
+    }
+    for (size_t i = 0; i < rules->count; ++i) {
+        decision_rule* rule = &rules->rules[i];
+        if (rule->status_shared) {
+            continue;
+        }
+        char name[256];
+        snprintf(name, sizeof(name), "%s.%s", options->status_name, rule->name);
+        rule->status_shared = loadavgwatch_share_status(rule->state, name)
+            == LOADAVGWATCH_OK;
+    }
+}
+
+typedef struct replay_report
+{
+    const char* name;
+    int64_t first_time_ns;
+    uint64_t polls;
+    uint64_t starts;
+    uint64_t stops;
+} replay_report;
+
+static void report_replay_decision(
+    const loadavgwatch_trace_record* record,
+    const loadavgwatch_poll_result* result,
+    void* data)
+{
+    replay_report* report = (replay_report*)data;
+    if (report->polls == 0) {
+        report->first_time_ns = record->time_ns;
+    }
+    ++report->polls;
+    int64_t offset_ms = (record->time_ns - report->first_time_ns) / 1000000;
+    const char* name = report->name != NULL ? report->name : "";
+    const char* separator = report->name != NULL ? " " : "";
+    if (result->start_count > 0) {
+        ++report->starts;
+        printf(
+            "%s%s%lld.%03d start %u\n",
+            name,
+            separator,
+            (long long)(offset_ms / 1000),
+            (int)(offset_ms % 1000),
+            result->start_count);
+    }
+    if (result->stop_count > 0) {
+        ++report->stops;
+        printf(
+            "%s%s%lld.%03d stop %u\n",
+            name,
+            separator,
+            (long long)(offset_ms / 1000),
+            (int)(offset_ms % 1000),
+            result->stop_count);
+    }
+}
+
+/**
+ * Prints the time from the start of the trace and the number of
+ * processes for every poll that would have started or stopped
+ * processes. Decisions of named rules are prefixed with the name.
+ */
+static int replay_trace(
+    loadavgwatch_state* state,
+    const char* name,
+    const loadavgwatch_trace* trace)
+{
+    size_t record_count;
+    const loadavgwatch_trace_record* records = loadavgwatch_trace_get_records(
+        trace, &record_count);
+    replay_report report = {.name = name};
+    if (loadavgwatch_replay(
+            state, records, record_count, report_replay_decision, &report)
+        != LOADAVGWATCH_OK) {
+        return EXIT_FAILURE;
+    }
+    struct timespec duration = {0, 0};
+    if (record_count > 0) {
+        int64_t duration_ns = records[record_count - 1].time_ns
+            - records[0].time_ns;
+        duration.tv_sec = (time_t)(duration_ns / 1000000000);
+        duration.tv_nsec = (long)(duration_ns % 1000000000);
+    }
+    char duration_str[32];
+    _timespec_to_string(&duration, duration_str, sizeof(duration_str));
+    printf(
+        "%s%sReplayed %llu polls over %s: %llu starts, %llu stops.\n",
+        name != NULL ? name : "",
+        name != NULL ? ": " : "",
+        (unsigned long long)report.polls,
+        duration_str,
+        (unsigned long long)report.starts,
+        (unsigned long long)report.stops);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Replay needs the trace before the library is opened, so its file is
+ * looked up before the other options are parsed.
+ */
+static const char* find_replay_file(int argc, char* argv[])
+{
+    for (int argument = 1; argument < argc; ++argument) {
+        if (!argument_name_matches("--replay", argv[argument])) {
+            continue;
+        }
+        char* equal_sign = strchr(argv[argument], '=');
+        if (equal_sign != NULL) {
+            return equal_sign + 1;
+        }
+        return argument + 1 < argc ? argv[argument + 1] : NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Moves the next action earlier to a deadline that is set.
+ */
+static void limit_to_deadline(
+    const struct timespec* deadline,
+    struct timespec* inout_next_action_at,
+    bool* inout_has_next_action)
+{
+    if (deadline->tv_sec == 0) {
+        return;
+    }
+    if (!*inout_has_next_action
+        || timespec_cmp(inout_next_action_at, deadline) == TS_RIGHT_SMALLER) {
+        *inout_next_action_at = *deadline;
+        *inout_has_next_action = true;
+    }
+}
+
+/**
+ * Registers the decisions of a rule and runs its commands.
+ */
+static void act_on_rule(decision_rule* rule, const struct timespec* poll_end)
+{
+    const loadavgwatch_poll_result* result = &rule->result;
+    if (rule->name != NULL
+        && (result->start_count > 0 || result->stop_count > 0)) {
+        PRINTF_LOG_MESSAGE(
+            g_log.info,
+            "Rule %s decided to start %u and stop %u.",
+            rule->name,
+            result->start_count,
+            result->stop_count);
+    }
+    if (result->start_count > 0) {
+        loadavgwatch_register_start(rule->state);
+        run_decision(
+            &rule->options,
+            rule->options.start_command,
+            "start",
+            result->start_count);
+    }
+    if (result->stop_count > 0) {
+        loadavgwatch_register_stop(rule->state);
+        run_decision(
+            &rule->options,
+            rule->options.stop_command,
+            "stop",
+            result->stop_count);
+    }
+
+    if (result->start_count > 0) {
+        rule->next_start_at = timespec_add(
+            poll_end, &rule->options.start_interval);
+    } else if (timespec_cmp(&rule->next_start_at, poll_end) == TS_RIGHT_SMALLER) {
+        rule->next_start_at = (struct timespec){0, 0};
+    }
+    if (result->stop_count > 0) {
+        rule->next_stop_at = timespec_add(
+            poll_end, &rule->options.stop_interval);
+    } else if (timespec_cmp(&rule->next_stop_at, poll_end) == TS_RIGHT_SMALLER) {
+        rule->next_stop_at = (struct timespec){0, 0};
+    }
+}
+
+/**
+ * Finds the time between polls that makes it possible for every rule
+ * to start and stop processes as often as it is allowed to.
+ */
+static void rules_sleep_time(
+    const program_options* options,
+    const decision_rules* rules,
+    struct timespec* out_sleep_time,
+    bool* out_has_start_command)
 {
-    // 3 pollings in 1 minute should result in high enough default
-    // polling rate to catch relatively soon 1 minute load average
-    // changes.
-    static const struct timespec default_sleep_time = {
-        .tv_sec = 20,
-        .tv_nsec = 0
-    };
     // Make sure that we don't sleep more than what makes it possible
-    // to start new processes. TODO alternative algorithm to determine
-    // if we should start new processes or not based on load
-    // differential between previous measurement point:
-    g_shortest_interval_name = "the default sleep interval";
-    struct timespec sleep_time = default_sleep_time;
-    if (timespec_cmp(&sleep_time, &options->start_interval) == TS_RIGHT_SMALLER) {
-        g_shortest_interval_name = "the start interval";
-        sleep_time = options->start_interval;
-    }
-    if (timespec_cmp(&sleep_time, &options->stop_interval) == TS_RIGHT_SMALLER) {
-        g_shortest_interval_name = "the stop interval";
-        sleep_time = options->stop_interval;
-    }
-
-    struct sigaction alarm_action = {
-        .sa_sigaction = alarm_handler,
-    };
-    sigaction(SIGALRM, &alarm_action, NULL);
+    // to start new processes:
+    *out_sleep_time = options->poll_interval;
+    // Jobserver tokens and admission slots are given out like a start
+    // command is run:
+    *out_has_start_command = options->jobserver_path != NULL
+        || options->admission_socket != NULL;
+    for (size_t i = 0; i < rules->count; ++i) {
+        const program_options* rule_options = &rules->rules[i].options;
+        if (timespec_cmp(out_sleep_time, &rule_options->start_interval) == TS_RIGHT_SMALLER) {
+            *out_sleep_time = rule_options->start_interval;
+        }
+        if (timespec_cmp(out_sleep_time, &rule_options->stop_interval) == TS_RIGHT_SMALLER) {
+            *out_sleep_time = rule_options->stop_interval;
+        }
+        *out_has_start_command = *out_has_start_command
+            || rule_options->start_command != NULL;
+    }
+}
+
+/**
+ * Adds a jobserver token for every process that fits under the start
+ * load and withholds one for every process over the stop load, up to
+ * --max-per-decision tokens per decision.
+ */
+static void update_jobserver(
+    jobserver* jobserver,
+    const program_options* options,
+    const loadavgwatch_poll_result* result)
+{
+    uint32_t reclaimed = _jobserver_collect(jobserver);
+    if (reclaimed > 0) {
+        PRINTF_LOG_MESSAGE(
+            g_log.info,
+            "Reclaimed %u returned jobserver tokens. %u tokens left.",
+            reclaimed,
+            jobserver->tokens);
+    }
+    uint32_t start_count = result->start_count < options->max_per_decision
+        ? result->start_count : options->max_per_decision;
+    uint32_t stop_count = result->stop_count < options->max_per_decision
+        ? result->stop_count : options->max_per_decision;
+    if (options->dry_run) {
+        if (start_count > 0 || stop_count > 0) {
+            PRINTF_LOG_MESSAGE(
+                g_log.info,
+                "Would add %u and withhold %u jobserver tokens.",
+                start_count,
+                stop_count);
+        }
+        return;
+    }
+    uint32_t added = start_count > 0
+        ? _jobserver_add(jobserver, start_count) : 0;
+    if (added > 0) {
+        PRINTF_LOG_MESSAGE(
+            g_log.info,
+            "Added %u jobserver tokens. %u tokens are given out.",
+            added,
+            jobserver->tokens - jobserver->withheld);
+    }
+    uint32_t withheld = stop_count > 0
+        ? _jobserver_withhold(jobserver, stop_count) : 0;
+    if (withheld > 0) {
+        _jobserver_collect(jobserver);
+        PRINTF_LOG_MESSAGE(
+            g_log.info,
+            "Withholding %u jobserver tokens. %u tokens are given out.",
+            withheld,
+            jobserver->tokens - jobserver->withheld);
+    }
+}
+
+#ifdef __linux__
+/**
+ * Opens an admission slot for every process that fits under the start
+ * load, up to --max-slots open slots, and asks a client to stop for
+ * every process over the stop load, up to --max-per-decision clients
+ * per decision.
+ */
+static void update_admission(
+    admission_server* server,
+    const program_options* options,
+    const loadavgwatch_poll_result* result)
+{
+    // Requests that arrived during the poll are granted right away:
+    _admission_handle(server);
+    uint32_t start_count = result->start_count < options->max_per_decision
+        ? result->start_count : options->max_per_decision;
+    uint32_t stop_count = result->stop_count < options->max_per_decision
+        ? result->stop_count : options->max_per_decision;
+    if (options->dry_run) {
+        if (start_count > 0 || stop_count > 0) {
+            PRINTF_LOG_MESSAGE(
+                g_log.info,
+                "Would open %u admission slots and ask %u clients to stop.",
+                start_count,
+                stop_count);
+        }
+        return;
+    }
+    uint32_t opened = start_count > 0
+        ? _admission_open_slots(server, start_count) : 0;
+    uint32_t granted = _admission_grant(server);
+    if (opened > 0 || granted > 0) {
+        PRINTF_LOG_MESSAGE(
+            g_log.info,
+            "Opened %u and granted %u admission slots. %zu of %u slots are held and %zu clients wait.",
+            opened,
+            granted,
+            server->granted_count,
+            server->slots,
+            server->waiting_count);
+    }
+    uint32_t stopped = stop_count > 0
+        ? _admission_stop(server, stop_count) : 0;
+    if (stopped > 0) {
+        PRINTF_LOG_MESSAGE(
+            g_log.info,
+            "Asked %u admission clients to stop. %zu slots are held and %u are open.",
+            stopped,
+            server->granted_count,
+            server->slots);
+    }
+}
+#endif
+
+static int monitor_and_act(
+    loadavgwatch_state* state,
+    program_options* options,
+    decision_rules* rules,
+    jobserver* jobserver,
+    loadavgwatch_recorder* recorder)
+{
+    struct timespec sleep_time;
+    bool has_start_command;
+    rules_sleep_time(options, rules, &sleep_time, &has_start_command);
+    bool adaptive = timespec_cmp(
+        &sleep_time, &options->max_poll_interval) == TS_LEFT_SMALLER;
+
+    if (!setup_children(options->config_file != NULL)) {
+        PRINTF_LOG_MESSAGE(
+            g_log.error,
+            "Unable to set up tracking of commands: %s",
+            strerror(errno));
+        return EXIT_FAILURE;
+    }
+    setup_wait_timer();
 
     struct timespec start_time;
     if (clock_gettime(CLOCK_MONOTONIC, &start_time) != 0) {
@@ -668,23 +2016,47 @@ static int monitor_and_act(
     }
 
     struct {
-        struct timespec start_command;
-        struct timespec stop_command;
         struct timespec timeout;
+        // Cadence slot of the next poll and the time of the poll that
+        // may be moved to the nearest update of the load source:
         struct timespec sleep;
+        struct timespec poll;
     } next_action_time = {
-        .start_command = {0, 0},
-        .stop_command = {0, 0},
         .timeout = end_time,
-        .sleep = timespec_add(&start_time, &sleep_time)
+        .sleep = timespec_add(&start_time, &sleep_time),
+        .poll = timespec_add(&start_time, &sleep_time)
     };
 
+    // Pressure events only tell when the load rises. Periodic polls
+    // are needed only to notice that there is room to start commands:
+    int event_fd = loadavgwatch_get_event_fd(state);
+    bool event_driven = event_fd != -1 && !has_start_command;
+    if (event_driven) {
+        PRINT_LOG_MESSAGE(
+            g_log.info,
+            "No start command. Polling only on load events and deadlines.");
+    }
+
+    share_rule_status(options, rules);
     bool running = true;
     while (running) {
-        loadavgwatch_poll_result poll_result;
-        if (loadavgwatch_poll(state, &poll_result) != LOADAVGWATCH_OK) {
-            abort();
+        if (g_reload_requested) {
+            g_reload_requested = 0;
+            if (reload_rules(state, options, rules)) {
+                share_rule_status(options, rules);
+                rules_sleep_time(
+                    options, rules, &sleep_time, &has_start_command);
+                adaptive = timespec_cmp(
+                    &sleep_time, &options->max_poll_interval) == TS_LEFT_SMALLER;
+                event_driven = event_fd != -1 && !has_start_command;
+            }
         }
+        loadavgwatch_poll_result poll_result;
+        loadavgwatch_snapshot snapshot;
+        // Failed polls have already been logged and decide nothing. The
+        // source is read again on the next poll:
+        bool polled = loadavgwatch_poll_snapshot(
+            state, &poll_result, &snapshot) == LOADAVGWATCH_OK;
 
         // Register start/stop time before reading the current time so
         // that we end up better executing commands in correct
@@ -695,53 +2067,101 @@ static int monitor_and_act(
                 g_log.error, "Unable to register the current time!");
             return EXIT_FAILURE;
         }
-        next_action_time.sleep = timespec_add(&poll_end, &sleep_time);
-        if (poll_result.start_count > 0) {
-            loadavgwatch_register_start(state);
-            if (options->start_command != NULL) {
-                if (options->dry_run) {
-                    PRINTF_LOG_MESSAGE(
-                        g_log.info, "Running: %s", options->start_command);
-                } else {
-                    run_command(options->start_command, "start", &sleep_time);
+        // Every rule decides from the same sample, so the load source
+        // is read only once per poll:
+        if (rules->shared_sample) {
+            poll_result.start_count = 0;
+            poll_result.stop_count = 0;
+            for (size_t i = 0; i < rules->count; ++i) {
+                decision_rule* rule = &rules->rules[i];
+                rule->result = (loadavgwatch_poll_result){0};
+                if (polled
+                    && loadavgwatch_set_virtual_sample(
+                        rule->state, &poll_end, &snapshot) == LOADAVGWATCH_OK) {
+                    loadavgwatch_poll(rule->state, &rule->result);
                 }
+                poll_result.start_count += rule->result.start_count;
+                poll_result.stop_count += rule->result.stop_count;
             }
+        } else {
+            rules->rules[0].result = poll_result;
         }
-        if (poll_result.stop_count > 0) {
-            loadavgwatch_register_stop(state);
-            if (options->stop_command != NULL) {
-                if (options->dry_run) {
-                    PRINTF_LOG_MESSAGE(
-                        g_log.info, "Running: %s", options->stop_command);
-                } else {
-                    run_command(options->stop_command, "stop", &sleep_time);
-                }
+        // Polls are scheduled on a fixed cadence from the start time so
+        // that the time spent in polling and in running commands does
+        // not accumulate. Polls that were missed are skipped:
+        struct timespec poll_interval = options->max_poll_interval;
+        for (size_t i = 0; adaptive && i < rules->count; ++i) {
+            struct timespec rule_interval;
+            if (loadavgwatch_suggest_poll_interval(
+                    rules->rules[i].state,
+                    &options->poll_band,
+                    &sleep_time,
+                    &options->max_poll_interval,
+                    &rule_interval) != LOADAVGWATCH_OK) {
+                abort();
+            }
+            if (timespec_cmp(&rule_interval, &poll_interval) == TS_LEFT_SMALLER) {
+                poll_interval = rule_interval;
             }
         }
-
-        if (poll_result.start_count > 0) {
-            next_action_time.start_command = timespec_add(&poll_end, &options->start_interval);
-        } else if (timespec_cmp(&next_action_time.start_command, &poll_end) == TS_RIGHT_SMALLER) {
-            next_action_time.start_command = (struct timespec){0, 0};
+        if (!adaptive) {
+            poll_interval = sleep_time;
+        }
+        // Poll that was moved before its slot still takes the slot:
+        struct timespec slot_end = poll_end;
+        if (timespec_cmp(&poll_end, &next_action_time.poll) == TS_RIGHT_SMALLER
+            && timespec_cmp(&poll_end, &next_action_time.sleep) == TS_LEFT_SMALLER) {
+            slot_end = next_action_time.sleep;
         }
-        if (poll_result.stop_count > 0) {
-            next_action_time.stop_command = timespec_add(&poll_end, &options->stop_interval);
-        } else if (timespec_cmp(&next_action_time.stop_command, &poll_end) == TS_RIGHT_SMALLER) {
-            next_action_time.stop_command = (struct timespec){0, 0};
+        next_action_time.sleep = _schedule_next_time(
+            &next_action_time.sleep, &poll_interval, &slot_end);
+        // Shorter interval takes effect right away instead of after
+        // the backed off poll:
+        struct timespec soonest_poll = timespec_add(&slot_end, &poll_interval);
+        if (timespec_cmp(&soonest_poll, &next_action_time.sleep) == TS_LEFT_SMALLER) {
+            next_action_time.sleep = soonest_poll;
         }
-        struct timespec next_action_at = next_action_time.sleep;
-        if (next_action_time.timeout.tv_sec != 0
-            && timespec_cmp(&next_action_at, &next_action_time.timeout) == TS_RIGHT_SMALLER) {
-            next_action_at = next_action_time.timeout;
+        // Load averages that the source updates on a fixed cadence are
+        // polled just after the update that is nearest to the slot:
+        if (loadavgwatch_align_poll_time(
+                state, &next_action_time.sleep, &next_action_time.poll)
+            != LOADAVGWATCH_OK) {
+            next_action_time.poll = next_action_time.sleep;
         }
-        if (next_action_time.start_command.tv_sec != 0
-            && timespec_cmp(&next_action_at, &next_action_time.start_command) == TS_RIGHT_SMALLER) {
-            next_action_at = next_action_time.start_command;
+        if (recorder != NULL
+            && polled
+            && loadavgwatch_recorder_append(
+                recorder, &poll_end, &snapshot, &poll_result)
+            != LOADAVGWATCH_OK) {
+            // Losing the trace is not a reason to stop running commands:
+            PRINTF_LOG_MESSAGE(
+                g_log.error,
+                "Unable to extend load trace '%s'! Recording stopped.",
+                options->record_file);
+            recorder = NULL;
         }
-        if (next_action_time.stop_command.tv_sec != 0
-            && timespec_cmp(&next_action_at, &next_action_time.stop_command) == TS_RIGHT_SMALLER) {
-            next_action_at = next_action_time.stop_command;
+        // Without periodic polls we only wake up for events and for
+        // the deadlines that there are:
+        struct timespec next_action_at = next_action_time.poll;
+        bool has_next_action = !event_driven;
+        limit_to_deadline(
+            &next_action_time.timeout, &next_action_at, &has_next_action);
+        for (size_t i = 0; i < rules->count; ++i) {
+            decision_rule* rule = &rules->rules[i];
+            act_on_rule(rule, &poll_end);
+            limit_to_deadline(
+                &rule->next_start_at, &next_action_at, &has_next_action);
+            limit_to_deadline(
+                &rule->next_stop_at, &next_action_at, &has_next_action);
         }
+        if (jobserver != NULL) {
+            update_jobserver(jobserver, options, &rules->rules[0].result);
+        }
+#ifdef __linux__
+        if (g_admission != NULL) {
+            update_admission(g_admission, options, &rules->rules[0].result);
+        }
+#endif
 
         struct timespec now;
         if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
@@ -750,10 +2170,15 @@ static int monitor_and_act(
             return EXIT_FAILURE;
         }
         if (options->has_timeout
-            && end_time.tv_sec < now.tv_sec + sleep_time.tv_sec) {
+            && timespec_cmp(&end_time, &next_action_time.poll) == TS_LEFT_SMALLER) {
             PRINT_LOG_MESSAGE(g_log.info, "Timeout reached!");
             running = false;
         }
+        if (!has_next_action) {
+            PRINT_LOG_MESSAGE(g_log.info, "Sleeping until the next load event!");
+            wait_for_next_action(event_fd, NULL);
+            continue;
+        }
         // Do not sleep if we are up for the next action:
         if (timespec_cmp(&next_action_at, &now) == TS_LEFT_SMALLER) {
             continue;
@@ -764,11 +2189,22 @@ static int monitor_and_act(
             "Sleeping for %ld.%09lds!",
             sleep_remaining.tv_sec,
             sleep_remaining.tv_nsec);
-        int sleep_return = -1;
-        do {
-            sleep_return = nanosleep(&sleep_remaining, &sleep_remaining);
-        } while (sleep_return == -1);
+        // Short reads on the way learn when the source updates:
+        struct timespec probe_at;
+        bool woke_early = false;
+        while (!woke_early
+               && loadavgwatch_get_probe_time(state, &next_action_at, &probe_at)
+               == LOADAVGWATCH_OK) {
+            woke_early = !wait_for_next_action(event_fd, &probe_at);
+            if (!woke_early && loadavgwatch_probe(state) != LOADAVGWATCH_OK) {
+                break;
+            }
+        }
+        if (!woke_early) {
+            wait_for_next_action(event_fd, &next_action_at);
+        }
     }
+    wait_for_children();
     return EXIT_SUCCESS;
 }
 
@@ -784,16 +2220,36 @@ int main(int argc, char* argv[])
     g_log.error_obj.data = stderr;
     g_log.error = &g_log.error_obj;
 
-    if (!run_sh_command("exit 0")) {
+    // Checking is enough here. Starting a process would cost more:
+    if (access("/bin/sh", X_OK) != 0) {
         PRINT_LOG_MESSAGE(
             g_log.error,
             "Unable to run commands with /bin/sh! This should never happen");
         return EXIT_FAILURE;
     }
 
+    loadavgwatch_trace* replay = NULL;
+    const char* replay_file = find_replay_file(argc, argv);
+    if (replay_file != NULL) {
+        loadavgwatch_status trace_status = loadavgwatch_trace_open(
+            replay_file, &replay);
+        if (trace_status == LOADAVGWATCH_ERR_PARSE) {
+            PRINTF_LOG_MESSAGE(
+                g_log.error, "'%s' is not a valid load trace!", replay_file);
+            return EXIT_FAILURE;
+        } else if (trace_status != LOADAVGWATCH_OK) {
+            PRINTF_LOG_MESSAGE(
+                g_log.error,
+                "Unable to read load trace '%s': %s",
+                replay_file,
+                strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
     loadavgwatch_state* state;
     {
-        int result = init_library(&state);
+        int result = init_library(&state, replay);
         if (result != EXIT_SUCCESS) {
             return result;
         }
@@ -808,8 +2264,113 @@ int main(int argc, char* argv[])
             return EXIT_SUCCESS;
         }
     }
+    if (replay == NULL && !read_source_fields(state, &program_options)) {
+        return EXIT_FAILURE;
+    }
     show_values(&program_options);
-    int program_result = monitor_and_act(state, &program_options);
+    decision_rules rules;
+    if (!setup_rules(state, &program_options, &rules)) {
+        return EXIT_FAILURE;
+    }
+    int program_result = EXIT_SUCCESS;
+    if (replay != NULL) {
+        for (size_t i = 0;
+             i < rules.count && program_result == EXIT_SUCCESS;
+             ++i) {
+            program_result = replay_trace(
+                rules.rules[i].state, rules.rules[i].name, replay);
+        }
+        loadavgwatch_trace_close(&replay);
+    } else {
+        loadavgwatch_recorder* recorder = NULL;
+        if (program_options.record_file != NULL) {
+            loadavgwatch_status record_status = loadavgwatch_recorder_open(
+                program_options.record_file,
+                loadavgwatch_get_ncpus(state),
+                &recorder);
+            if (record_status == LOADAVGWATCH_ERR_PARSE) {
+                PRINTF_LOG_MESSAGE(
+                    g_log.error,
+                    "'%s' exists and is not a load trace!",
+                    program_options.record_file);
+                return EXIT_FAILURE;
+            } else if (record_status != LOADAVGWATCH_OK) {
+                PRINTF_LOG_MESSAGE(
+                    g_log.error,
+                    "Unable to open load trace '%s' for recording: %s",
+                    program_options.record_file,
+                    strerror(errno));
+                return EXIT_FAILURE;
+            }
+        }
+        if (program_options.status_name != NULL
+            && loadavgwatch_share_status(state, program_options.status_name)
+            != LOADAVGWATCH_OK) {
+            return EXIT_FAILURE;
+        }
+        bool starts_processes = (program_options.start_command != NULL
+                                 || program_options.jobserver_path != NULL
+                                 || program_options.admission_socket != NULL)
+            && !program_options.dry_run;
+        if (!rules.shared_sample
+            && _rules_join_group(
+                state, program_options.group_name, starts_processes)
+            != LOADAVGWATCH_OK) {
+            return EXIT_FAILURE;
+        }
+        jobserver jobserver;
+        if (program_options.jobserver_path != NULL) {
+            if (!_jobserver_open(
+                    program_options.jobserver_path,
+                    program_options.max_tokens,
+                    &jobserver)) {
+                PRINTF_LOG_MESSAGE(
+                    g_log.error,
+                    "Unable to create jobserver fifo '%s': %s",
+                    program_options.jobserver_path,
+                    strerror(errno));
+                return EXIT_FAILURE;
+            }
+            PRINTF_LOG_MESSAGE(
+                g_log.info,
+                "Jobserver clients use MAKEFLAGS=--jobserver-auth=fifo:%s",
+                program_options.jobserver_path);
+        }
+#ifdef __linux__
+        admission_server admission;
+        if (program_options.admission_socket != NULL) {
+            if (!_admission_open(
+                    program_options.admission_socket,
+                    program_options.max_slots,
+                    &admission)) {
+                PRINTF_LOG_MESSAGE(
+                    g_log.error,
+                    "Unable to listen on admission socket '%s': %s",
+                    program_options.admission_socket,
+                    strerror(errno));
+                return EXIT_FAILURE;
+            }
+            g_admission = &admission;
+        }
+#endif
+        program_result = monitor_and_act(
+            state,
+            &program_options,
+            &rules,
+            program_options.jobserver_path != NULL ? &jobserver : NULL,
+            recorder);
+        if (program_options.jobserver_path != NULL) {
+            _jobserver_close(&jobserver);
+        }
+#ifdef __linux__
+        if (g_admission != NULL) {
+            _admission_close(g_admission);
+            g_admission = NULL;
+        }
+#endif
+        loadavgwatch_recorder_close(&recorder);
+    }
+    close_rules(&rules);
 
     if (loadavgwatch_close(&state) != LOADAVGWATCH_OK) {
         PRINT_LOG_MESSAGE(
@@ -19,23 +19,13 @@
 #define _XOPEN_SOURCE 700
 
 #include <assert.h>
+#include "loadavgwatch-ewma.c"
 #include "loadavgwatch-linux-parsers.c"
-#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define ASSERT_CLOSE(expected, actual) \
-    { \
-    bool small_value_matches = fabs(actual) < 0.0001 && fabs((expected) - (actual)) < 0.0001; \
-    bool large_value_matches = fabs((expected) - (actual)) / fabs(actual) < 0.0001; \
-    if (!(small_value_matches || large_value_matches)) { \
-        fprintf(stderr, "Expected value " #expected " == %lf does not match the actual " #actual " == %lf!\n", (expected), (actual)); \
-        assert(false && #expected "!=" #actual); \
-    } \
-    }
-
 static FILE* memfile_from_string(const char* value)
 {
     size_t file_size = strlen(value);
@@ -44,32 +34,243 @@ static FILE* memfile_from_string(const char* value)
     return result;
 }
 
+#define ASSERT_PROC_LOADAVG_PARSE_ERROR(contents) \
+    { \
+        proc_loadavg_values values = {{{0, 0}}}; \
+        values.last_pid = 12345; \
+        assert(LOADAVGWATCH_OK != _parse_proc_loadavg( \
+                   (contents), strlen(contents), &values) \
+               && "Parsing should fail for: " contents); \
+        assert(values.last_pid == 12345 && "Values were modified"); \
+    }
 
 void test_valid_proc_loadavg_should_produce_expected_result(void)
 {
-    FILE* loadavg_fp = memfile_from_string("0.01 0.02 0.03 4/5 6");
-    float read_loadavg = -1.0;
-    assert(LOADAVGWATCH_OK == _get_load_average_proc_loadavg(
-               loadavg_fp, &read_loadavg));
-    fclose(loadavg_fp);
-    ASSERT_CLOSE(0.01, read_loadavg);
+    const char contents[] = "0.01 0.02 0.03 4/5 6\n";
+    proc_loadavg_values values;
+    assert(LOADAVGWATCH_OK == _parse_proc_loadavg(
+               contents, sizeof(contents) - 1, &values));
+    assert(values.load[0].load == 1 && values.load[0].scale == 100);
+    assert(values.load[1].load == 2 && values.load[1].scale == 100);
+    assert(values.load[2].load == 3 && values.load[2].scale == 100);
+    assert(values.running_tasks == 4);
+    assert(values.total_tasks == 5);
+    assert(values.last_pid == 6);
+}
+
+void test_proc_loadavg_should_parse_large_values_exactly(void)
+{
+    const char contents[] = "11.70 1.98 123.4 1/2143 2195";
+    proc_loadavg_values values;
+    assert(LOADAVGWATCH_OK == _parse_proc_loadavg(
+               contents, sizeof(contents) - 1, &values));
+    assert(values.load[0].load == 1170);
+    assert(values.load[1].load == 198);
+    assert(values.load[2].load == 12340);
+    assert(values.running_tasks == 1);
+    assert(values.total_tasks == 2143);
+    assert(values.last_pid == 2195);
+}
+
+void test_proc_loadavg_should_not_read_past_the_given_size(void)
+{
+    const char contents[] = "1.00 2.00 3.00 4/5 6789";
+    proc_loadavg_values values;
+    assert(LOADAVGWATCH_OK == _parse_proc_loadavg(
+               contents, sizeof(contents) - 3, &values));
+    assert(values.last_pid == 67);
+    assert(LOADAVGWATCH_OK != _parse_proc_loadavg(
+               contents, sizeof(contents) - 6, &values));
 }
 
 void test_invalid_proc_loadavg_should_produce_error_and_not_modify_result(void)
 {
-    FILE* loadavg_fp = memfile_from_string("asdf");
-    float read_loadavg = -1.0;
-    assert(LOADAVGWATCH_OK != _get_load_average_proc_loadavg(
-               loadavg_fp, &read_loadavg));
-    fclose(loadavg_fp);
-    ASSERT_CLOSE(-1.0, read_loadavg);
+    ASSERT_PROC_LOADAVG_PARSE_ERROR("");
+    ASSERT_PROC_LOADAVG_PARSE_ERROR("asdf");
+    ASSERT_PROC_LOADAVG_PARSE_ERROR("0.01 0.02 0.03");
+    ASSERT_PROC_LOADAVG_PARSE_ERROR("0.01 0.02 0.03 4 5");
+    ASSERT_PROC_LOADAVG_PARSE_ERROR("0.01 0.02 0.03 4/ 5");
+    ASSERT_PROC_LOADAVG_PARSE_ERROR("-1.00 0.02 0.03 4/5 6");
+    ASSERT_PROC_LOADAVG_PARSE_ERROR("1. 0.02 0.03 4/5 6");
+    ASSERT_PROC_LOADAVG_PARSE_ERROR("99999999.00 0.02 0.03 4/5 6");
+}
+
+void test_sys_devices_cpu_ranges_should_be_counted(void)
+{
+    FILE* online_fp = memfile_from_string("0-3,5,7-8\n");
+    assert(_get_ncpus_sys_devices(online_fp) == 7);
+    fclose(online_fp);
+}
+
+void test_proc_stat_procs_should_be_found_from_any_line(void)
+{
+    const char contents[] =
+        "cpu  1 2 3 4 5 6 7 0 0 0\n"
+        "intr 123 0 0 0\n"
+        "ctxt 1234\n"
+        "procs_running 12\n"
+        "procs_blocked 3\n"
+        "softirq 1 2 3\n";
+    uint32_t running = 0;
+    uint32_t blocked = 0;
+    assert(LOADAVGWATCH_OK == _parse_proc_stat_procs(
+               contents, sizeof(contents) - 1, &running, &blocked));
+    assert(running == 12 && blocked == 3);
+    assert(LOADAVGWATCH_OK != _parse_proc_stat_procs(
+               contents, strstr(contents, "procs_blocked") - contents,
+               &running, &blocked));
+    assert(LOADAVGWATCH_OK != _parse_proc_stat_procs(
+               "procs_running x\nprocs_blocked 1\n", 31, &running, &blocked));
+}
+
+void test_pressure_some_line_should_be_parsed(void)
+{
+    const char contents[] =
+        "some avg10=12.50 avg60=3.07 avg300=0.00 total=123456\n"
+        "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+    loadavgwatch_load averages[3];
+    uint64_t total_us = 0;
+    assert(LOADAVGWATCH_OK == _parse_pressure_some(
+               contents, sizeof(contents) - 1, averages, &total_us));
+    assert(averages[0].load == 1250 && averages[0].scale == 100);
+    assert(averages[1].load == 307 && averages[2].load == 0);
+    assert(total_us == 123456);
+    assert(LOADAVGWATCH_OK != _parse_pressure_some(
+               contents, strstr(contents, "avg300") - contents,
+               averages, &total_us));
+    assert(LOADAVGWATCH_OK != _parse_pressure_some(
+               contents + strlen("some "), 10, averages, &total_us));
+}
+
+void test_cgroup_files_should_be_parsed(void)
+{
+    uint64_t quota_us = 1;
+    uint64_t period_us = 0;
+    assert(LOADAVGWATCH_OK == _parse_cgroup_cpu_max(
+               "max 100000\n", 11, &quota_us, &period_us));
+    assert(quota_us == 0 && period_us == 100000);
+    assert(LOADAVGWATCH_OK == _parse_cgroup_cpu_max(
+               "150000 100000\n", 14, &quota_us, &period_us));
+    assert(quota_us == 150000 && period_us == 100000);
+    assert(LOADAVGWATCH_OK != _parse_cgroup_cpu_max(
+               "150000 0\n", 9, &quota_us, &period_us));
+
+    const char cpu_stat[] =
+        "usage_usec 8589934592123\n"
+        "user_usec 1\n"
+        "nr_throttled 2\n"
+        "throttled_usec 34\n";
+    uint64_t usage_us = 0;
+    uint64_t throttled_us = 0;
+    assert(LOADAVGWATCH_OK == _parse_cgroup_cpu_stat(
+               cpu_stat, sizeof(cpu_stat) - 1, &usage_us, &throttled_us));
+    assert(usage_us == 8589934592123u && throttled_us == 34);
+    assert(LOADAVGWATCH_OK == _parse_cgroup_cpu_stat(
+               cpu_stat, strstr(cpu_stat, "user_usec") - cpu_stat,
+               &usage_us, &throttled_us));
+    assert(throttled_us == 0);
+    assert(LOADAVGWATCH_OK != _parse_cgroup_cpu_stat(
+               "user_usec 1\n", 12, &usage_us, &throttled_us));
+
+    const char self_cgroup[] =
+        "1:name=systemd:/init.scope\n"
+        "0::/system.slice/loadavgwatch.service\n";
+    char path[64];
+    assert(LOADAVGWATCH_OK == _parse_proc_self_cgroup_v2(
+               self_cgroup, sizeof(self_cgroup) - 1, path, sizeof(path)));
+    assert(strcmp(path, "/system.slice/loadavgwatch.service") == 0);
+    assert(LOADAVGWATCH_OK != _parse_proc_self_cgroup_v2(
+               self_cgroup, sizeof(self_cgroup) - 1, path, 10));
+    assert(LOADAVGWATCH_OK != _parse_proc_self_cgroup_v2(
+               self_cgroup, strlen("1:name=systemd:/init.scope\n"),
+               path, sizeof(path)));
+}
+
+void test_cgroup_dir_walk_should_include_the_root(void)
+{
+    const size_t root_length = strlen("/sys/fs/cgroup");
+    char dir[64] = "/sys/fs/cgroup/kubepods.slice/pod.slice";
+    assert(_cgroup_parent_dir(dir, root_length));
+    assert(strcmp(dir, "/sys/fs/cgroup/kubepods.slice") == 0);
+    assert(_cgroup_parent_dir(dir, root_length));
+    assert(strcmp(dir, "/sys/fs/cgroup") == 0);
+    assert(!_cgroup_parent_dir(dir, root_length));
+
+    // Process at the root of its own cgroup namespace has the path "/"
+    // and the limits of its container are in the root directory:
+    char path[16];
+    assert(LOADAVGWATCH_OK == _parse_proc_self_cgroup_v2(
+               "0::/\n", 5, path, sizeof(path)));
+    assert(strcmp(path, "/") == 0);
+    strcpy(dir, "/sys/fs/cgroup");
+    size_t visited = 0;
+    do {
+        assert(strcmp(dir, "/sys/fs/cgroup") == 0);
+        ++visited;
+    } while (_cgroup_parent_dir(dir, root_length));
+    assert(visited == 1);
+}
+
+// Allows relative error of about one in a million:
+#define ASSERT_Q32_CLOSE(expected, actual) \
+    assert((actual) + ((uint64_t)(expected) >> 20) + 8 >= (uint64_t)(expected) \
+           && (actual) <= (uint64_t)(expected) + ((uint64_t)(expected) >> 20) + 8 \
+           && "Fixed point value " #actual " is not close to " #expected)
+
+void test_ewma_exp_should_match_known_values(void)
+{
+    ASSERT_Q32_CLOSE(EWMA_DECAY_1, _ewma_exp_q32(0, 1));
+    // e^-1 * 2^32:
+    ASSERT_Q32_CLOSE(1580030169u, _ewma_exp_q32(60, 60));
+    // e^(-5/60) * 2^32, the kernel's EXP_1 with more precision:
+    ASSERT_Q32_CLOSE(3951560672u, _ewma_exp_q32(5000000000u, 60000000000u));
+    // e^-10 * 2^32:
+    ASSERT_Q32_CLOSE(194991u, _ewma_exp_q32(600, 60));
+    assert(_ewma_exp_q32(33, 1) == 0);
+}
+
+void test_ewma_should_converge_to_constant_input(void)
+{
+    const struct timespec constants[EWMA_AVERAGES] = {{5, 0}, {15, 0}, {60, 0}};
+    ewma_state ewma;
+    _ewma_init(&ewma, constants);
+    struct timespec now = {100, 0};
+    _ewma_sample(&ewma, &now, 0);
+    for (int i = 0; i < 4 * 600; ++i) {
+        now.tv_nsec += 250000000;
+        if (now.tv_nsec >= 1000000000) {
+            now.tv_sec++;
+            now.tv_nsec -= 1000000000;
+        }
+        _ewma_sample(&ewma, &now, 3 * EWMA_FIXED_1);
+        if (i == 4 * 5 - 1) {
+            // After one time constant the average is at 1 - 1/e:
+            loadavgwatch_load loads[EWMA_AVERAGES];
+            _ewma_get(&ewma, loads);
+            assert(loads[0].scale == EWMA_FIXED_1);
+            assert(loads[0].load > 124280 - 16 && loads[0].load < 124280 + 16);
+        }
+    }
+    loadavgwatch_load loads[EWMA_AVERAGES];
+    _ewma_get(&ewma, loads);
+    assert(loads[0].load > 3 * EWMA_FIXED_1 - 8);
+    assert(loads[2].load > 3 * EWMA_FIXED_1 - 16);
 }
 
 int main()
 {
-#if !defined(__APPLE__) || __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__  >= 101300
     test_valid_proc_loadavg_should_produce_expected_result();
+    test_proc_loadavg_should_parse_large_values_exactly();
+    test_proc_loadavg_should_not_read_past_the_given_size();
     test_invalid_proc_loadavg_should_produce_error_and_not_modify_result();
+    test_proc_stat_procs_should_be_found_from_any_line();
+    test_pressure_some_line_should_be_parsed();
+    test_cgroup_files_should_be_parsed();
+    test_cgroup_dir_walk_should_include_the_root();
+    test_ewma_exp_should_match_known_values();
+    test_ewma_should_converge_to_constant_input();
+#if !defined(__APPLE__) || __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__  >= 101300
+    test_sys_devices_cpu_ranges_should_be_counted();
 #else
     fprintf(stderr, "OS X supports fmemopen only at 10.13!\n");
 #endif
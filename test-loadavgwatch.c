@@ -0,0 +1,638 @@
+/**
+ * Copyright (C) 2017 Jussi Judin
+ *
+ * This file is part of loadavgwatch.
+ *
+ * loadavgwatch is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * loadavgwatch is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with loadavgwatch.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <assert.h>
+#include "loadavgwatch.h"
+#include "loadavgwatch-impl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct {
+    loadavgwatch_snapshot snapshot;
+    struct timespec now;
+} g_stub;
+
+static void log_ignore(const char* message, void* data)
+{
+}
+
+static int stub_clock(void* impl_state, struct timespec* now)
+{
+    *now = g_stub.now;
+    return 0;
+}
+
+static loadavgwatch_status stub_get_load_average(
+    void* impl_state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
+{
+    *out_snapshot = g_stub.snapshot;
+    return LOADAVGWATCH_OK;
+}
+
+static loadavgwatch_state* open_stubbed(uint32_t start_load, uint32_t stop_load)
+{
+    loadavgwatch_log_object log = {log_ignore, NULL};
+    loadavgwatch_state* state = NULL;
+    assert(loadavgwatch_open_logging(&state, &log, &log) == LOADAVGWATCH_OK);
+    state->impl.clock = stub_clock;
+    state->impl.get_load_average = stub_get_load_average;
+    loadavgwatch_load start = {start_load, 100};
+    loadavgwatch_load stop = {stop_load, 100};
+    assert(loadavgwatch_set_start_load(state, &start) == LOADAVGWATCH_OK);
+    assert(loadavgwatch_set_stop_load(state, &stop) == LOADAVGWATCH_OK);
+    g_stub.now = (struct timespec){1000000, 0};
+    return state;
+}
+
+static loadavgwatch_poll_result poll_load(
+    loadavgwatch_state* state, uint32_t load, uint32_t scale)
+{
+    g_stub.snapshot.fields = LOADAVGWATCH_SNAPSHOT_LOAD;
+    g_stub.snapshot.load[0] = (loadavgwatch_load){load, scale};
+    loadavgwatch_poll_result result;
+    assert(loadavgwatch_poll(state, &result) == LOADAVGWATCH_OK);
+    return result;
+}
+
+void test_load_equal_to_limits_should_not_start_or_stop(void)
+{
+    loadavgwatch_state* state = open_stubbed(229, 412);
+    loadavgwatch_poll_result result = poll_load(state, 229, 100);
+    assert(result.start_count == 0 && result.stop_count == 0);
+    // Same values with a different scale:
+    result = poll_load(state, 2290, 1000);
+    assert(result.start_count == 0 && result.stop_count == 0);
+    loadavgwatch_close(&state);
+
+    state = open_stubbed(229, 412);
+    result = poll_load(state, 412, 100);
+    assert(result.start_count == 0 && result.stop_count == 0);
+    loadavgwatch_close(&state);
+}
+
+void test_start_and_stop_counts_should_be_exact(void)
+{
+    loadavgwatch_state* state = open_stubbed(302, 412);
+    loadavgwatch_poll_result result = poll_load(state, 0, 100);
+    assert(result.start_count == 4 && result.stop_count == 0);
+    loadavgwatch_close(&state);
+
+    state = open_stubbed(302, 412);
+    result = poll_load(state, 202, 100);
+    assert(result.start_count == 2);
+    loadavgwatch_close(&state);
+
+    state = open_stubbed(302, 412);
+    // 2.0200073 with the sysinfo() scale is just over 2.02:
+    result = poll_load(state, 132385, 65536);
+    assert(result.start_count == 1);
+    loadavgwatch_close(&state);
+
+    state = open_stubbed(302, 412);
+    result = poll_load(state, 612, 100);
+    assert(result.start_count == 0 && result.stop_count == 3);
+    loadavgwatch_close(&state);
+}
+
+void test_start_interval_should_limit_starts(void)
+{
+    loadavgwatch_state* state = open_stubbed(302, 412);
+    struct timespec interval = {10, 0};
+    loadavgwatch_set_start_interval(state, &interval);
+    assert(poll_load(state, 100, 100).start_count == 3);
+    assert(loadavgwatch_register_start(state) == LOADAVGWATCH_OK);
+    g_stub.now.tv_sec += 10;
+    assert(poll_load(state, 100, 100).start_count == 0);
+    g_stub.now.tv_nsec += 1;
+    assert(poll_load(state, 100, 100).start_count == 3);
+    loadavgwatch_close(&state);
+}
+
+void test_start_burst_should_refill_at_start_interval(void)
+{
+    loadavgwatch_state* state = open_stubbed(302, 412);
+    struct timespec interval = {10, 0};
+    loadavgwatch_set_start_interval(state, &interval);
+    assert(loadavgwatch_set_start_burst(state, 0)
+           == LOADAVGWATCH_ERR_INVALID_PARAMETER);
+    assert(loadavgwatch_set_start_burst(state, 3) == LOADAVGWATCH_OK);
+    // Full bucket allows a burst of starts without waiting:
+    for (int i = 0; i < 3; ++i) {
+        g_stub.now.tv_sec += 1;
+        assert(poll_load(state, 100, 100).start_count == 3);
+        assert(loadavgwatch_register_start(state) == LOADAVGWATCH_OK);
+    }
+    g_stub.now.tv_sec += 1;
+    assert(poll_load(state, 100, 100).start_count == 0);
+    // Then one start fits in every start interval:
+    g_stub.now.tv_sec += 8;
+    assert(poll_load(state, 100, 100).start_count == 3);
+    assert(loadavgwatch_register_start(state) == LOADAVGWATCH_OK);
+    g_stub.now.tv_sec += 1;
+    assert(poll_load(state, 100, 100).start_count == 0);
+    // Long pause refills only up to the burst:
+    g_stub.now.tv_sec += 1000;
+    for (int i = 0; i < 3; ++i) {
+        g_stub.now.tv_sec += 1;
+        assert(poll_load(state, 100, 100).start_count == 3);
+        assert(loadavgwatch_register_start(state) == LOADAVGWATCH_OK);
+    }
+    assert(poll_load(state, 100, 100).start_count == 0);
+    loadavgwatch_close(&state);
+}
+
+void test_zero_scale_should_be_rejected(void)
+{
+    loadavgwatch_state* state = open_stubbed(302, 412);
+    loadavgwatch_load invalid = {100, 0};
+    assert(loadavgwatch_set_start_load(state, &invalid)
+           == LOADAVGWATCH_ERR_INVALID_PARAMETER);
+    assert(loadavgwatch_get_start_load(state).load == 302);
+    g_stub.snapshot.load[0] = invalid;
+    loadavgwatch_poll_result result;
+    assert(loadavgwatch_poll(state, &result) == LOADAVGWATCH_ERR_PARSE);
+    loadavgwatch_close(&state);
+}
+
+void test_metric_should_select_the_compared_value(void)
+{
+    loadavgwatch_state* state = open_stubbed(302, 412);
+    g_stub.snapshot = (loadavgwatch_snapshot){
+        .fields = LOADAVGWATCH_SNAPSHOT_LOAD
+        | LOADAVGWATCH_SNAPSHOT_RUNNING_TASKS,
+        .load = {{500, 100}, {100, 100}, {900, 100}},
+        .running_tasks = 2,
+    };
+    loadavgwatch_poll_result result;
+    loadavgwatch_snapshot snapshot;
+    assert(loadavgwatch_poll_snapshot(state, &result, &snapshot)
+           == LOADAVGWATCH_OK);
+    assert(result.start_count == 0 && result.stop_count == 1);
+    assert(snapshot.running_tasks == 2 && snapshot.load[2].load == 900);
+    loadavgwatch_close(&state);
+
+    state = open_stubbed(302, 412);
+    loadavgwatch_set_metric(state, LOADAVGWATCH_METRIC_LOAD_5MIN);
+    assert(loadavgwatch_poll(state, &result) == LOADAVGWATCH_OK);
+    assert(result.start_count == 3 && result.stop_count == 0);
+    loadavgwatch_close(&state);
+
+    state = open_stubbed(302, 412);
+    loadavgwatch_set_metric(state, LOADAVGWATCH_METRIC_RUNNING_TASKS);
+    assert(loadavgwatch_poll(state, &result) == LOADAVGWATCH_OK);
+    assert(result.start_count == 2 && result.stop_count == 0);
+    g_stub.snapshot.fields = LOADAVGWATCH_SNAPSHOT_LOAD;
+    assert(loadavgwatch_poll(state, &result) == LOADAVGWATCH_ERR_READ);
+    loadavgwatch_close(&state);
+
+    state = open_stubbed(1000, 2500);
+    loadavgwatch_set_metric(state, LOADAVGWATCH_METRIC_CPU_PRESSURE_60S);
+    g_stub.snapshot.fields |= LOADAVGWATCH_SNAPSHOT_CPU_PRESSURE;
+    g_stub.snapshot.cpu_pressure[1] = (loadavgwatch_load){3000, 100};
+    assert(loadavgwatch_poll(state, &result) == LOADAVGWATCH_OK);
+    assert(result.start_count == 0 && result.stop_count == 6);
+    loadavgwatch_close(&state);
+}
+
+void test_prediction_should_follow_the_load_trend(void)
+{
+    loadavgwatch_state* state = open_stubbed(302, 412);
+    struct timespec horizon = {30, 0};
+    assert(loadavgwatch_set_prediction_horizon(state, &horizon)
+           == LOADAVGWATCH_OK);
+    // Single sample has no trend:
+    assert(poll_load(state, 100, 100).start_count == 3);
+    g_stub.now.tv_sec += 10;
+    // 1.50 rising 0.05 per second is predicted to be at 3.00:
+    assert(poll_load(state, 150, 100).start_count == 1);
+    g_stub.now.tv_sec += 10;
+    assert(poll_load(state, 200, 100).start_count == 0);
+    loadavgwatch_close(&state);
+
+    state = open_stubbed(302, 412);
+    loadavgwatch_set_prediction_horizon(state, &horizon);
+    assert(poll_load(state, 600, 100).stop_count == 2);
+    g_stub.now.tv_sec += 10;
+    // 5.50 falling 0.05 per second is predicted to be at 4.00:
+    loadavgwatch_poll_result result = poll_load(state, 550, 100);
+    assert(result.start_count == 0 && result.stop_count == 0);
+    loadavgwatch_close(&state);
+}
+
+void test_history_should_summarize_the_window(void)
+{
+    loadavgwatch_state* state = open_stubbed(302, 412);
+    const uint32_t loads[] = {500, 100, 300, 200, 400};
+    for (size_t i = 0; i < sizeof(loads) / sizeof(loads[0]); ++i) {
+        poll_load(state, loads[i], 100);
+        g_stub.now.tv_sec += 10;
+    }
+    // Polls were 10, 20, 30, 40 and 50 seconds ago:
+    loadavgwatch_history_summary summary;
+    struct timespec window = {30, 0};
+    assert(loadavgwatch_history_summarize(state, &window, &summary)
+           == LOADAVGWATCH_OK);
+    assert(summary.samples == 3);
+    assert(summary.min.load == 2 * 65536 && summary.min.scale == 65536);
+    assert(summary.max.load == 4 * 65536 && summary.mean.load == 3 * 65536);
+
+    window.tv_sec = 60;
+    loadavgwatch_load value;
+    assert(loadavgwatch_history_percentile(state, &window, 50, &value)
+           == LOADAVGWATCH_OK);
+    assert(value.load == 3 * 65536);
+    assert(loadavgwatch_history_percentile(state, &window, 95, &value)
+           == LOADAVGWATCH_OK);
+    assert(value.load == 5 * 65536);
+    assert(loadavgwatch_history_percentile(state, &window, 0, &value)
+           == LOADAVGWATCH_OK);
+    assert(value.load == 1 * 65536);
+    assert(loadavgwatch_history_percentile(state, &window, 101, &value)
+           == LOADAVGWATCH_ERR_INVALID_PARAMETER);
+
+    // Shrinking keeps the newest samples:
+    assert(loadavgwatch_set_history_capacity(state, 2) == LOADAVGWATCH_OK);
+    assert(loadavgwatch_history_summarize(state, &window, &summary)
+           == LOADAVGWATCH_OK);
+    assert(summary.samples == 2 && summary.min.load == 2 * 65536);
+    poll_load(state, 700, 100);
+    assert(loadavgwatch_history_summarize(state, &window, &summary)
+           == LOADAVGWATCH_OK);
+    assert(summary.samples == 2 && summary.max.load == 7 * 65536);
+
+    window.tv_sec = 5;
+    g_stub.now.tv_sec += 10;
+    assert(loadavgwatch_history_summarize(state, &window, &summary)
+           == LOADAVGWATCH_ERR_READ);
+    loadavgwatch_close(&state);
+}
+
+void test_poll_interval_should_adapt_to_the_limits(void)
+{
+    loadavgwatch_state* state = open_stubbed(302, 412);
+    loadavgwatch_load band = {50, 100};
+    struct timespec min_interval = {1, 0};
+    struct timespec max_interval = {300, 0};
+    struct timespec interval;
+    // Nothing to compare against before two polls:
+    poll_load(state, 100, 100);
+    assert(loadavgwatch_suggest_poll_interval(
+               state, &band, &min_interval, &max_interval, &interval)
+           == LOADAVGWATCH_OK);
+    assert(interval.tv_sec == 1 && interval.tv_nsec == 0);
+
+    // Stable load far from the limits backs off exponentially:
+    time_t expected[] = {2, 4, 8, 16, 32, 64, 128, 256, 300, 300};
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+        g_stub.now.tv_sec += interval.tv_sec;
+        poll_load(state, 100, 100);
+        assert(loadavgwatch_suggest_poll_interval(
+                   state, &band, &min_interval, &max_interval, &interval)
+               == LOADAVGWATCH_OK);
+        assert(interval.tv_sec == expected[i]);
+    }
+
+    // Load rising 0.80 in 300 seconds would reach the start band
+    // before the next poll:
+    g_stub.now.tv_sec += 300;
+    poll_load(state, 180, 100);
+    assert(loadavgwatch_suggest_poll_interval(
+               state, &band, &min_interval, &max_interval, &interval)
+           == LOADAVGWATCH_OK);
+    assert(interval.tv_sec == 1);
+
+    // Load between the limits is near both of them:
+    g_stub.now.tv_sec += 1;
+    poll_load(state, 350, 100);
+    g_stub.now.tv_sec += 1;
+    poll_load(state, 350, 100);
+    assert(loadavgwatch_suggest_poll_interval(
+               state, &band, &min_interval, &max_interval, &interval)
+           == LOADAVGWATCH_OK);
+    assert(interval.tv_sec == 1);
+
+    assert(loadavgwatch_suggest_poll_interval(
+               state, &band, &max_interval, &min_interval, &interval)
+           == LOADAVGWATCH_ERR_INVALID_PARAMETER);
+    loadavgwatch_close(&state);
+}
+
+// Load that increases on each update of a source with 5.005 second
+// update interval and its first update 1.3 seconds after this time:
+#define CADENCE_START_NS 100000000000
+#define CADENCE_INTERVAL_NS 5005000000
+#define CADENCE_PHASE_NS 1300000000
+
+static int64_t stub_now_ns(void)
+{
+    return (int64_t)g_stub.now.tv_sec * 1000000000 + g_stub.now.tv_nsec;
+}
+
+static int64_t cadence_updates(int64_t time_ns)
+{
+    return (time_ns - CADENCE_START_NS - CADENCE_PHASE_NS + CADENCE_INTERVAL_NS)
+        / CADENCE_INTERVAL_NS;
+}
+
+static loadavgwatch_status stub_get_cadence_load_average(
+    void* impl_state,
+    const struct timespec* now,
+    loadavgwatch_snapshot* out_snapshot)
+{
+    out_snapshot->fields = LOADAVGWATCH_SNAPSHOT_LOAD;
+    out_snapshot->load[0] = (loadavgwatch_load){
+        (uint32_t)cadence_updates(stub_now_ns()), 100};
+    return LOADAVGWATCH_OK;
+}
+
+static bool stub_get_update_interval(
+    const void* impl_state, struct timespec* out_interval)
+{
+    *out_interval = (struct timespec){5, 5000000};
+    return true;
+}
+
+static void set_stub_now_ns(int64_t time_ns)
+{
+    assert(time_ns >= stub_now_ns());
+    g_stub.now.tv_sec = time_ns / 1000000000;
+    g_stub.now.tv_nsec = time_ns % 1000000000;
+}
+
+void test_polls_should_align_to_source_updates(void)
+{
+    loadavgwatch_state* state = open_stubbed(302, 412);
+    state->impl.get_load_average = stub_get_cadence_load_average;
+    state->impl.get_update_interval = stub_get_update_interval;
+    g_stub.now = (struct timespec){CADENCE_START_NS / 1000000000, 0};
+    struct timespec poll_at = g_stub.now;
+    struct timespec aligned_at;
+    assert(loadavgwatch_align_poll_time(state, &poll_at, &aligned_at)
+           == LOADAVGWATCH_ERR_READ);
+    // Polls every 20 seconds for half an hour:
+    uint32_t late_probes = 0;
+    for (size_t i = 0; i < 90; ++i) {
+        struct timespec probe_at;
+        while (loadavgwatch_get_probe_time(state, &poll_at, &probe_at)
+               == LOADAVGWATCH_OK) {
+            set_stub_now_ns(
+                (int64_t)probe_at.tv_sec * 1000000000 + probe_at.tv_nsec);
+            assert(loadavgwatch_probe(state) == LOADAVGWATCH_OK);
+            late_probes += i >= 45;
+        }
+        g_stub.now = poll_at;
+        loadavgwatch_poll_result result;
+        assert(loadavgwatch_poll(state, &result) == LOADAVGWATCH_OK);
+        assert(result.fresh);
+        poll_at.tv_sec += 20;
+        if (loadavgwatch_align_poll_time(state, &poll_at, &aligned_at)
+            == LOADAVGWATCH_OK) {
+            poll_at = aligned_at;
+        }
+    }
+    // Polls happen soon after an update and probing becomes rare as
+    // the interval gets measured:
+    int64_t poll_ns = (int64_t)poll_at.tv_sec * 1000000000 + poll_at.tv_nsec;
+    int64_t update_ns = CADENCE_START_NS + CADENCE_PHASE_NS
+        + (cadence_updates(poll_ns) - 1) * CADENCE_INTERVAL_NS;
+    assert(poll_ns > update_ns && poll_ns - update_ns < 100000000);
+    assert(late_probes < 10);
+
+    // Values of other metrics are calculated on every read:
+    loadavgwatch_set_metric(state, LOADAVGWATCH_METRIC_RUNNING_TASKS);
+    assert(loadavgwatch_probe(state) == LOADAVGWATCH_ERR_READ);
+    assert(loadavgwatch_align_poll_time(state, &poll_at, &aligned_at)
+           == LOADAVGWATCH_ERR_READ);
+    loadavgwatch_close(&state);
+}
+
+static void count_replay_decisions(
+    const loadavgwatch_trace_record* record,
+    const loadavgwatch_poll_result* result,
+    void* data)
+{
+    uint32_t* counts = (uint32_t*)data;
+    counts[0] += result->start_count > 0;
+    counts[1] += result->stop_count > 0;
+}
+
+void test_recorded_trace_should_replay(void)
+{
+    loadavgwatch_log_object log = {log_ignore, NULL};
+    loadavgwatch_state* state = NULL;
+    assert(loadavgwatch_open_virtual(&state, &log, &log, 4)
+           == LOADAVGWATCH_OK);
+    assert(strcmp(loadavgwatch_get_system(state), "virtual") == 0);
+    struct timespec interval = {60, 0};
+    loadavgwatch_set_start_interval(state, &interval);
+    loadavgwatch_set_stop_interval(state, &interval);
+
+    const char template[] = "/tmp/test-loadavgwatch-XXXXXX";
+    char path[sizeof(template)];
+    memcpy(path, template, sizeof(template));
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    // One poll every 20 seconds for 10 minutes, over the stop load
+    // for the last 2 minutes. Recording is continued after reopening:
+    loadavgwatch_recorder* recorder = NULL;
+    for (size_t i = 0; i < 30; ++i) {
+        if (i == 0 || i == 20) {
+            loadavgwatch_recorder_close(&recorder);
+            assert(loadavgwatch_recorder_open(path, 4, &recorder)
+                   == LOADAVGWATCH_OK);
+        }
+        loadavgwatch_snapshot snapshot = {
+            .fields = LOADAVGWATCH_SNAPSHOT_LOAD,
+            .load = {{i < 24 ? 100 : 900, 100}, {0, 100}, {0, 100}},
+        };
+        struct timespec now = {100000 + 20 * (time_t)i, 0};
+        loadavgwatch_poll_result recorded = {0, i >= 24};
+        assert(loadavgwatch_recorder_append(
+                   recorder, &now, &snapshot, &recorded)
+               == LOADAVGWATCH_OK);
+    }
+    assert(loadavgwatch_recorder_close(&recorder) == LOADAVGWATCH_OK);
+    assert(recorder == NULL);
+
+    loadavgwatch_trace* trace = NULL;
+    assert(loadavgwatch_trace_open(path, &trace) == LOADAVGWATCH_OK);
+    // Preallocated space is removed when recording ends:
+    struct stat file_stat;
+    assert(stat(path, &file_stat) == 0);
+    assert(file_stat.st_size == sizeof(loadavgwatch_trace_header)
+           + 30 * sizeof(loadavgwatch_trace_record));
+    unlink(path);
+    assert(loadavgwatch_trace_get_header(trace)->ncpus == 4);
+    size_t count;
+    const loadavgwatch_trace_record* mapped = loadavgwatch_trace_get_records(
+        trace, &count);
+    assert(count == 30 && mapped[29].load[0] == 900);
+    assert(mapped[23].stop_count == 0 && mapped[24].stop_count == 1);
+
+    uint32_t decisions[2] = {0, 0};
+    assert(loadavgwatch_replay(
+               state, mapped, count, count_replay_decisions, decisions)
+           == LOADAVGWATCH_OK);
+    // Interval needs to be exceeded, so polls are 80 seconds apart:
+    assert(decisions[0] == 6 && decisions[1] == 2);
+    // Reset state makes the same decisions again:
+    assert(loadavgwatch_reset(state) == LOADAVGWATCH_OK);
+    decisions[0] = decisions[1] = 0;
+    loadavgwatch_replay(state, mapped, count, count_replay_decisions, decisions);
+    assert(decisions[0] == 6 && decisions[1] == 2);
+    loadavgwatch_trace_close(&trace);
+    assert(trace == NULL);
+    loadavgwatch_close(&state);
+
+    // Real load sources can not be given samples:
+    state = open_stubbed(302, 412);
+    loadavgwatch_trace_record record = {.time_ns = 0};
+    assert(loadavgwatch_replay(state, &record, 1, NULL, NULL)
+           == LOADAVGWATCH_ERR_INVALID_PARAMETER);
+    loadavgwatch_close(&state);
+}
+
+void test_shared_status_should_follow_polls(void)
+{
+    loadavgwatch_log_object log = {log_ignore, NULL};
+    loadavgwatch_state* state;
+    assert(loadavgwatch_open_virtual(&state, &log, &log, 4)
+           == LOADAVGWATCH_OK);
+    char name[64];
+    snprintf(name, sizeof(name), "test-%ld", (long)getpid());
+    assert(loadavgwatch_share_status(state, "a/b")
+           == LOADAVGWATCH_ERR_INVALID_PARAMETER);
+    assert(loadavgwatch_share_status(state, name) == LOADAVGWATCH_OK);
+    // Second publisher would break the sequence lock:
+    loadavgwatch_state* other_state;
+    assert(loadavgwatch_open_virtual(&other_state, &log, &log, 4)
+           == LOADAVGWATCH_OK);
+    assert(loadavgwatch_share_status(other_state, name)
+           == LOADAVGWATCH_ERR_INIT);
+    loadavgwatch_close(&other_state);
+
+    loadavgwatch_status_reader* reader = NULL;
+    assert(loadavgwatch_status_reader_open(name, &reader) == LOADAVGWATCH_OK);
+    loadavgwatch_shared_status status;
+    assert(loadavgwatch_status_reader_read(reader, &status) == LOADAVGWATCH_OK);
+    assert(status.version == LOADAVGWATCH_SHARED_STATUS_VERSION);
+    assert(status.polls == 0);
+
+    struct timespec now = {10000, 0};
+    loadavgwatch_snapshot snapshot = {
+        .fields = LOADAVGWATCH_SNAPSHOT_LOAD,
+        .load = {{50, 100}, {0, 100}, {0, 100}},
+    };
+    loadavgwatch_set_virtual_sample(state, &now, &snapshot);
+    loadavgwatch_poll_result result;
+    assert(loadavgwatch_poll(state, &result) == LOADAVGWATCH_OK);
+    assert(result.start_count > 0);
+    loadavgwatch_register_start(state);
+
+    assert(loadavgwatch_status_reader_read(reader, &status) == LOADAVGWATCH_OK);
+    assert(status.polls == 1);
+    assert(status.poll_time_ns == 10000000000000LL);
+    assert(status.last_start_time_ns == 10000000000000LL);
+    assert(status.last_stop_time_ns == 0);
+    assert(status.value.load == 50 && status.value.scale == 100);
+    assert(status.result.start_count == result.start_count);
+    assert(memcmp(&status.snapshot, &snapshot, sizeof(snapshot)) == 0);
+
+    // Mapping stays readable after the publisher removes the object:
+    loadavgwatch_close(&state);
+    assert(loadavgwatch_status_reader_read(reader, &status) == LOADAVGWATCH_OK);
+    loadavgwatch_status_reader_close(&reader);
+    assert(loadavgwatch_status_reader_open(name, &reader)
+           == LOADAVGWATCH_ERR_READ);
+}
+
+void test_group_should_allow_one_start_per_interval(void)
+{
+    loadavgwatch_log_object log = {log_ignore, NULL};
+    char name[64];
+    snprintf(name, sizeof(name), "test-%ld", (long)getpid());
+    loadavgwatch_state* states[2];
+    struct timespec interval = {60, 0};
+    for (int i = 0; i < 2; ++i) {
+        assert(loadavgwatch_open_virtual(&states[i], &log, &log, 4)
+               == LOADAVGWATCH_OK);
+        loadavgwatch_set_start_interval(states[i], &interval);
+        assert(loadavgwatch_join_group(states[i], name) == LOADAVGWATCH_OK);
+    }
+    assert(loadavgwatch_join_group(states[0], name)
+           == LOADAVGWATCH_ERR_INVALID_PARAMETER);
+
+    loadavgwatch_snapshot snapshot = {
+        .fields = LOADAVGWATCH_SNAPSHOT_LOAD,
+        .load = {{50, 100}, {0, 100}, {0, 100}},
+    };
+    // Only the first of the members that see the same load starts:
+    struct timespec now = {10000, 0};
+    loadavgwatch_poll_result results[2];
+    for (int i = 0; i < 2; ++i) {
+        loadavgwatch_set_virtual_sample(states[i], &now, &snapshot);
+        assert(loadavgwatch_poll(states[i], &results[i]) == LOADAVGWATCH_OK);
+    }
+    assert(results[0].start_count > 0 && results[1].start_count == 0);
+    loadavgwatch_register_start(states[0]);
+
+    // Start of the other member is counted until the interval ends:
+    now.tv_sec += 30;
+    loadavgwatch_set_virtual_sample(states[1], &now, &snapshot);
+    assert(loadavgwatch_poll(states[1], &results[1]) == LOADAVGWATCH_OK);
+    assert(results[1].start_count == 0);
+    now.tv_sec += 31;
+    loadavgwatch_set_virtual_sample(states[1], &now, &snapshot);
+    assert(loadavgwatch_poll(states[1], &results[1]) == LOADAVGWATCH_OK);
+    assert(results[1].start_count > 0);
+
+    for (int i = 0; i < 2; ++i) {
+        loadavgwatch_close(&states[i]);
+    }
+    char object_name[96];
+    snprintf(object_name, sizeof(object_name), "/loadavgwatch-group.%s", name);
+    assert(shm_unlink(object_name) == 0);
+}
+
+int main()
+{
+    test_load_equal_to_limits_should_not_start_or_stop();
+    test_start_and_stop_counts_should_be_exact();
+    test_start_interval_should_limit_starts();
+    test_start_burst_should_refill_at_start_interval();
+    test_zero_scale_should_be_rejected();
+    test_metric_should_select_the_compared_value();
+    test_prediction_should_follow_the_load_trend();
+    test_history_should_summarize_the_window();
+    test_poll_interval_should_adapt_to_the_limits();
+    test_polls_should_align_to_source_updates();
+    test_recorded_trace_should_replay();
+    test_shared_status_should_follow_polls();
+    test_group_should_allow_one_start_per_interval();
+    return EXIT_SUCCESS;
+}
@@ -19,9 +19,21 @@
 #define _XOPEN_SOURCE 600
 
 #include <assert.h>
+#include <signal.h>
+#ifdef __linux__
+#include "main-admission.c"
+#endif
+#include "main-config.c"
+#include "main-environment.c"
+#include "main-jobserver.c"
 #include "main-parsers.c"
+#include "main-process.c"
+#include "main-rules.c"
+#include "main-schedule.c"
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <time.h>
 
 #define ASSERT_TIMESPEC_TO_STRING_OUT(expected, seconds) \
@@ -81,10 +93,385 @@ void test_string_to_timespec_should_be_able_to_parse_more_exotic_time_representa
     ASSERT_STRING_TO_TIMESPEC_NSEC_OUT(1, 200000000, "1.2s");
 }
 
+void test_string_to_timespec_list_should_require_exact_item_count(void)
+{
+    struct timespec times[3];
+    assert(_string_to_timespec_list("5s,15s,1m", times, 3));
+    assert(times[0].tv_sec == 5 && times[1].tv_sec == 15 && times[2].tv_sec == 60);
+    assert(_string_to_timespec_list("0.5, 1 ,2m", times, 3));
+    assert(times[0].tv_sec == 0 && times[0].tv_nsec == 500000000);
+    assert(!_string_to_timespec_list("5s,15s", times, 3));
+    assert(!_string_to_timespec_list("5s,15s,1m,2m", times, 3));
+    assert(!_string_to_timespec_list("5s,,1m", times, 3));
+    assert(!_string_to_timespec_list("", times, 3));
+}
+
+void test_split_plain_command_should_leave_shell_features_to_shell(void)
+{
+    char buffer[PLAIN_COMMAND_MAX_LENGTH];
+    char* argv[PLAIN_COMMAND_MAX_ARGUMENTS + 1];
+    assert(_split_plain_command("  make -j4  all ", buffer, argv));
+    assert(strcmp(argv[0], "make") == 0 && strcmp(argv[1], "-j4") == 0);
+    assert(strcmp(argv[2], "all") == 0 && argv[3] == NULL);
+    // Equal sign could be a variable assignment:
+    assert(!_split_plain_command("/opt/job/run.sh --from=x", buffer, argv));
+    assert(!_split_plain_command("echo 'a b'", buffer, argv));
+    assert(!_split_plain_command("sleep 1; echo $HOME", buffer, argv));
+    assert(!_split_plain_command("job > out", buffer, argv));
+    assert(!_split_plain_command("ls *", buffer, argv));
+    assert(!_split_plain_command("   ", buffer, argv));
+}
+
+static void assert_child_succeeds(pid_t pid)
+{
+    int wait_status;
+    assert(waitpid(pid, &wait_status, 0) == pid);
+    assert(WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0);
+}
+
+void test_spawn_command_should_not_wait_for_command(void)
+{
+    struct timespec before;
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    pid_t pid;
+    assert(_spawn_command("sleep 5", environ, &pid));
+    struct timespec after;
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    assert(after.tv_sec - before.tv_sec < 2);
+    // Command is still running after the start returns:
+    int wait_status;
+    assert(waitpid(pid, &wait_status, WNOHANG) == 0);
+    assert(kill(pid, SIGTERM) == 0);
+    assert(waitpid(pid, &wait_status, 0) == pid);
+    assert(WIFSIGNALED(wait_status) && WTERMSIG(wait_status) == SIGTERM);
+}
+
+void test_instance_environment_should_replace_instance_variables(void)
+{
+    char* base_envp[] = {
+        "LOADAVGWATCH_INSTANCE=9",
+        "HOME=/root",
+        "LOADAVGWATCH_INSTANCES=10",
+        "LOADAVGWATCH_INSTANCE_NAME=kept",
+        NULL,
+    };
+    instance_environment environment;
+    assert(_instance_environment_init(&environment, base_envp));
+    _instance_environment_set(&environment, 1, 3);
+    char** envp = environment.envp;
+    assert(strcmp(envp[0], "HOME=/root") == 0);
+    assert(strcmp(envp[1], "LOADAVGWATCH_INSTANCE_NAME=kept") == 0);
+    assert(strcmp(envp[2], "LOADAVGWATCH_INSTANCE=1") == 0);
+    assert(strcmp(envp[3], "LOADAVGWATCH_INSTANCES=3") == 0);
+    assert(envp[4] == NULL);
+    // Every instance sees its own index:
+    for (uint32_t instance = 0; instance < 3; ++instance) {
+        _instance_environment_set(&environment, instance, 3);
+        char command[64];
+        snprintf(command,
+                 sizeof(command),
+                 "test \"$LOADAVGWATCH_INSTANCE/$LOADAVGWATCH_INSTANCES\" = %u/3",
+                 instance);
+        pid_t pid;
+        assert(_spawn_command(command, environment.envp, &pid));
+        assert_child_succeeds(pid);
+    }
+    _instance_environment_free(&environment);
+}
+
+#define ASSERT_NEXT_TIME(expected_sec, expected_nsec, scheduled, now) \
+    { \
+        const struct timespec interval = {20, 0}; \
+        struct timespec next = _schedule_next_time( \
+            &(scheduled), &interval, &(now)); \
+        assert(next.tv_sec == (expected_sec) \
+               && next.tv_nsec == (expected_nsec)); \
+    }
+
+void test_schedule_next_time_should_keep_cadence(void)
+{
+    const struct timespec scheduled = {100, 500000000};
+    // Future deadlines stay as they are:
+    ASSERT_NEXT_TIME(100, 500000000, scheduled, ((struct timespec){90, 0}));
+    // Time spent after the deadline does not move the cadence:
+    ASSERT_NEXT_TIME(120, 500000000, scheduled, scheduled);
+    ASSERT_NEXT_TIME(120, 500000000, scheduled, ((struct timespec){101, 0}));
+    ASSERT_NEXT_TIME(
+        120, 500000000, scheduled, ((struct timespec){120, 499999999}));
+    // Missed slots, for example after a suspend, are skipped:
+    ASSERT_NEXT_TIME(
+        140, 500000000, scheduled, ((struct timespec){120, 500000000}));
+    ASSERT_NEXT_TIME(
+        1000000100, 500000000, scheduled, ((struct timespec){1000000090, 0}));
+    // Zero interval polls right away:
+    const struct timespec zero = {0, 0};
+    const struct timespec now = {105, 0};
+    struct timespec next = _schedule_next_time(&scheduled, &zero, &now);
+    assert(next.tv_sec == 105 && next.tv_nsec == 0);
+}
+
+static void log_ignore(const char* message, void* data)
+{
+}
+
+static loadavgwatch_poll_result poll_virtual(
+    loadavgwatch_state* state, time_t seconds, uint32_t load_hundredths)
+{
+    const struct timespec now = {seconds, 0};
+    const loadavgwatch_snapshot snapshot = {
+        .fields = LOADAVGWATCH_SNAPSHOT_LOAD,
+        .load = {{load_hundredths, 100}, {0, 100}, {0, 100}},
+    };
+    assert(loadavgwatch_set_virtual_sample(state, &now, &snapshot)
+           == LOADAVGWATCH_OK);
+    loadavgwatch_poll_result result;
+    assert(loadavgwatch_poll(state, &result) == LOADAVGWATCH_OK);
+    return result;
+}
+
+void test_rules_carry_over_should_keep_start_times_and_history(void)
+{
+    loadavgwatch_log_object log = {log_ignore, NULL};
+    const struct timespec interval = {60, 0};
+    loadavgwatch_state* previous;
+    assert(loadavgwatch_open_virtual(&previous, &log, &log, 4)
+           == LOADAVGWATCH_OK);
+    loadavgwatch_set_start_interval(previous, &interval);
+    assert(poll_virtual(previous, 10000, 50).start_count > 0);
+    loadavgwatch_register_start(previous);
+
+    loadavgwatch_state* reloaded;
+    assert(loadavgwatch_open_virtual(&reloaded, &log, &log, 4)
+           == LOADAVGWATCH_OK);
+    const loadavgwatch_load start_load = {300, 100};
+    loadavgwatch_set_start_load(reloaded, &start_load);
+    loadavgwatch_set_start_interval(reloaded, &interval);
+    _rules_carry_over(&reloaded, &previous);
+    assert(previous == NULL);
+    loadavgwatch_load reloaded_start = loadavgwatch_get_start_load(reloaded);
+    assert(reloaded_start.load * start_load.scale
+           == start_load.load * reloaded_start.scale);
+    // Start before the reload still counts for the start interval:
+    assert(poll_virtual(reloaded, 10010, 50).start_count == 0);
+    assert(poll_virtual(reloaded, 10061, 50).start_count > 0);
+    const struct timespec window = {3600, 0};
+    loadavgwatch_history_summary summary;
+    assert(loadavgwatch_history_summarize(reloaded, &window, &summary)
+           == LOADAVGWATCH_OK);
+    assert(summary.samples == 3);
+
+    // Reloaded rule that compares another metric starts a new history:
+    loadavgwatch_state* other_metric;
+    assert(loadavgwatch_open_virtual(&other_metric, &log, &log, 4)
+           == LOADAVGWATCH_OK);
+    loadavgwatch_set_metric(other_metric, LOADAVGWATCH_METRIC_LOAD_5MIN);
+    _rules_carry_over(&other_metric, &reloaded);
+    assert(loadavgwatch_get_metric(other_metric)
+           == LOADAVGWATCH_METRIC_LOAD_5MIN);
+    assert(loadavgwatch_history_summarize(other_metric, &window, &summary)
+           == LOADAVGWATCH_ERR_READ);
+    loadavgwatch_close(&other_metric);
+}
+
+void test_rules_join_group_should_leave_out_rules_that_only_stop(void)
+{
+    loadavgwatch_log_object log = {log_ignore, NULL};
+    char name[64];
+    snprintf(name, sizeof(name), "test-rules-%ld", (long)getpid());
+    const struct timespec interval = {60, 0};
+    loadavgwatch_state* states[3];
+    for (int i = 0; i < 3; ++i) {
+        assert(loadavgwatch_open_virtual(&states[i], &log, &log, 4)
+               == LOADAVGWATCH_OK);
+        loadavgwatch_set_start_interval(states[i], &interval);
+    }
+    loadavgwatch_state* stopper = states[0];
+    loadavgwatch_state* starter = states[1];
+    loadavgwatch_state* other_starter = states[2];
+    assert(_rules_join_group(stopper, name, false) == LOADAVGWATCH_OK);
+    assert(_rules_join_group(starter, name, true) == LOADAVGWATCH_OK);
+    assert(_rules_join_group(other_starter, name, true) == LOADAVGWATCH_OK);
+    assert(_rules_join_group(starter, NULL, true) == LOADAVGWATCH_OK);
+    // Rule that only stops sees the low load first, but does not claim
+    // the start of the group:
+    assert(poll_virtual(stopper, 10000, 50).start_count > 0);
+    assert(poll_virtual(starter, 10000, 50).start_count > 0);
+    loadavgwatch_register_start(starter);
+    assert(poll_virtual(other_starter, 10000, 50).start_count == 0);
+    for (int i = 0; i < 3; ++i) {
+        loadavgwatch_close(&states[i]);
+    }
+    char object_name[96];
+    snprintf(object_name, sizeof(object_name), "/loadavgwatch-group.%s", name);
+    assert(shm_unlink(object_name) == 0);
+}
+
+void test_config_parse_should_turn_rules_to_arguments(void)
+{
+    char text[] =
+        "# Graduated rules\n"
+        "[light]\n"
+        "  start-command = run-light --fast \n"
+        "max-start=4\n"
+        "\n"
+        "[ heavy ]\n"
+        "honor-counts\n";
+    config_rules rules;
+    size_t error_line = 0;
+    assert(_config_parse(text, &rules, &error_line));
+    assert(rules.count == 2);
+    assert(rules.rules[0].argc == 3);
+    assert(strcmp(rules.rules[0].argv[0], "light") == 0);
+    assert(strcmp(rules.rules[0].argv[1], "--start-command=run-light --fast") == 0);
+    assert(strcmp(rules.rules[0].argv[2], "--max-start=4") == 0);
+    assert(rules.rules[0].argv[3] == NULL);
+    assert(strcmp(rules.rules[1].argv[0], "heavy") == 0);
+    assert(strcmp(rules.rules[1].argv[1], "--honor-counts") == 0);
+    _config_free(&rules);
+
+    char outside[] = "max-start = 4\n[light]\n";
+    assert(!_config_parse(outside, &rules, &error_line) && error_line == 1);
+    char unknown[] = "[light]\nsource = stat\n";
+    assert(!_config_parse(unknown, &rules, &error_line) && error_line == 2);
+    char no_value[] = "[light]\nmax-start\n";
+    assert(!_config_parse(no_value, &rules, &error_line) && error_line == 2);
+    char duplicate[] = "[light]\n[light]\n";
+    assert(!_config_parse(duplicate, &rules, &error_line) && error_line == 2);
+    char unclosed[] = "[light\n";
+    assert(!_config_parse(unclosed, &rules, &error_line) && error_line == 1);
+    char empty[] = "# Nothing\n";
+    assert(!_config_parse(empty, &rules, &error_line) && error_line == 0);
+}
+
+void test_jobserver_should_withhold_returned_tokens(void)
+{
+    char path[] = "/tmp/test-main-parsers-jobserver-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+    unlink(path);
+    jobserver jobserver;
+    assert(_jobserver_open(path, 4, &jobserver));
+    assert(!_jobserver_open(path, 4, &(struct jobserver){0}));
+    assert(_jobserver_add(&jobserver, 3) == 3);
+    assert(_jobserver_add(&jobserver, 3) == 1);
+    assert(jobserver.tokens == 4);
+
+    // Client holds two tokens:
+    char tokens[2];
+    int client_fd = open(path, O_RDONLY | O_NONBLOCK);
+    assert(read(client_fd, tokens, sizeof(tokens)) == 2);
+    assert(_jobserver_withhold(&jobserver, 3) == 3);
+    assert(_jobserver_collect(&jobserver) == 2);
+    assert(jobserver.tokens == 2 && jobserver.withheld == 1);
+    // Returned token is reclaimed and the other one stays in use:
+    int client_write_fd = open(path, O_WRONLY | O_NONBLOCK);
+    assert(write(client_write_fd, tokens, 1) == 1);
+    assert(_jobserver_collect(&jobserver) == 1);
+    assert(jobserver.tokens == 1 && jobserver.withheld == 0);
+    assert(_jobserver_withhold(&jobserver, 3) == 1);
+    // Adding cancels withholding before adding new tokens:
+    assert(_jobserver_add(&jobserver, 2) == 2);
+    assert(jobserver.tokens == 2 && jobserver.withheld == 0);
+    close(client_fd);
+    close(client_write_fd);
+    _jobserver_close(&jobserver);
+    assert(access(path, F_OK) != 0);
+}
+
+#ifdef __linux__
+static int connect_admission_client(const char* path, const char* request)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd != -1);
+    assert(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0);
+    assert(write(fd, request, strlen(request)) == (ssize_t)strlen(request));
+    return fd;
+}
+
+static void assert_admission_reply(int fd, const char* expected)
+{
+    char reply[16] = {0};
+    assert(read(fd, reply, sizeof(reply) - 1) == (ssize_t)strlen(expected));
+    assert(strcmp(reply, expected) == 0);
+}
+
+void test_admission_should_grant_by_priority_and_release_on_disconnect(void)
+{
+    char path[] = "/tmp/test-main-parsers-admission-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+    unlink(path);
+    admission_server server;
+    assert(_admission_open(path, 2, &server));
+    int first = connect_admission_client(path, "request\n");
+    int second = connect_admission_client(path, "request\n");
+    int urgent = connect_admission_client(path, "request 9\n");
+    int invalid = connect_admission_client(path, "request 10\n");
+    _admission_handle(&server);
+    assert(server.waiting_count == 3 && server.granted_count == 0);
+    assert_admission_reply(invalid, "error\n");
+    close(invalid);
+
+    // Open slots are capped and higher priority goes first and equal
+    // priorities in request order:
+    assert(_admission_open_slots(&server, 3) == 2);
+    assert(_admission_grant(&server) == 2);
+    assert_admission_reply(urgent, "granted\n");
+    assert_admission_reply(first, "granted\n");
+    assert(server.waiting_count == 1 && server.granted_count == 2);
+    assert(_admission_grant(&server) == 0);
+    // Disconnecting releases the slot to the next waiter:
+    close(first);
+    _admission_handle(&server);
+    assert_admission_reply(second, "granted\n");
+    assert(server.waiting_count == 0 && server.granted_count == 2);
+    // Last granted client is asked to stop only once and its slot is
+    // closed:
+    assert(_admission_stop(&server, 1) == 1);
+    assert_admission_reply(second, "stop\n");
+    assert(server.slots == 1);
+    int late = connect_admission_client(path, "request\n");
+    _admission_handle(&server);
+    assert(server.waiting_count == 1);
+    close(second);
+    _admission_handle(&server);
+    assert(server.waiting_count == 1 && server.granted_count == 1);
+    assert(_admission_stop(&server, 2) == 1);
+    assert_admission_reply(urgent, "stop\n");
+    assert(_admission_stop(&server, 1) == 0);
+    assert(server.slots == 0);
+    close(urgent);
+    _admission_handle(&server);
+    assert(server.waiting_count == 1 && server.granted_count == 0);
+    assert(_admission_open_slots(&server, 1) == 1);
+    assert(_admission_grant(&server) == 1);
+    assert_admission_reply(late, "granted\n");
+    close(late);
+    _admission_close(&server);
+    assert(access(path, F_OK) != 0);
+}
+#endif
+
 int main()
 {
     test_timespec_to_string_should_be_able_to_output_all_time_units();
     test_string_to_timespec_should_be_able_to_parse_all_regular_time_units();
     test_string_to_timespec_should_be_able_to_parse_more_exotic_time_representations();
+    test_string_to_timespec_list_should_require_exact_item_count();
+    test_split_plain_command_should_leave_shell_features_to_shell();
+    test_spawn_command_should_not_wait_for_command();
+    test_instance_environment_should_replace_instance_variables();
+    test_schedule_next_time_should_keep_cadence();
+    test_config_parse_should_turn_rules_to_arguments();
+    test_rules_carry_over_should_keep_start_times_and_history();
+    test_rules_join_group_should_leave_out_rules_that_only_stop();
+    test_jobserver_should_withhold_returned_tokens();
+#ifdef __linux__
+    test_admission_should_grant_by_priority_and_release_on_disconnect();
+#endif
     return EXIT_SUCCESS;
 }